@@ -1,4 +1,5 @@
 import { defineSuite } from "esbench";
+import { generateImage, sizes } from "./images.js";
 
 const codecs = typeof window === "undefined"
 	? await import("../lib/node.js")
@@ -41,6 +42,9 @@ function browserDecode(blob: Blob, extract: typeof extract2D) {
 }
 
 /*
+ * Decode synthetic images of various size, bit depth and content, they are
+ * encoded by the same codec with default options in setup.
+ *
  * Run benchmark on Node:
  *     `pnpm exec esbench --file decode.ts --executor in-process`
  *
@@ -51,21 +55,33 @@ function browserDecode(blob: Blob, extract: typeof extract2D) {
 export default defineSuite({
 	params: {
 		codec: codecNames,
+		size: Object.keys(sizes),
+		depth: [8, 10, 12, 16],
+		content: ["photo", "screenshot", "alpha"],
 	},
 	baseline: {
 		type: "Name",
 		value: "icodec",
 	},
 	async setup(scene) {
-		const name = scene.params.codec as keyof typeof codecs;
-		const { loadDecoder, decode, extension } = codecs[name];
+		const { codec, size, depth, content } = scene.params;
+		const name = codec as keyof typeof codecs;
+		const { loadEncoder, loadDecoder, encode, decode, bitDepth, mimeType } = codecs[name];
+
+		if (!bitDepth.includes(depth)) {
+			return; // Unsupported bit depth, skip.
+		}
+		if (typeof window === "undefined" && name === "heic") {
+			return; // The encoder does not work in Node.
+		}
+
+		const [width, height] = sizes[size];
+		await loadEncoder();
+		const input = encode(generateImage(content, width, height, depth));
 		await loadDecoder();
 
 		if (typeof window === "undefined") {
 			const { default: sharp } = await import("sharp");
-			const { readFileSync } = await import("fs");
-
-			const input = readFileSync(`test/snapshot/image.${extension}`);
 			const instance = sharp(input);
 
 			scene.bench("icodec", () => decode(input));
@@ -74,8 +90,7 @@ export default defineSuite({
 				scene.benchAsync("Sharp", () => instance.raw().toBuffer());
 			}
 		} else {
-			const response = await fetch(`test/snapshot/image.${extension}`);
-			const blob = await response.blob();
+			const blob = new Blob([input], { type: mimeType });
 			scene.benchAsync("icodec", async () => decode(new Uint8Array(await blob.arrayBuffer())));
 
 			const _2d = extract2D.bind(document.createElement("canvas"));
@@ -0,0 +1,67 @@
+import { ImageDataLike } from "../lib/common.js";
+
+/*
+ * Image sizes, from thumbnail to a 50 MP camera photo.
+ */
+export const sizes: Record<string, [number, number]> = {
+	thumbnail: [160, 120],
+	"1MP": [1280, 800],
+	"12MP": [4000, 3000],
+	"50MP": [8192, 6144],
+};
+
+// Simple deterministic PRNG, so the content is the same between runs.
+function mulberry32(seed: number) {
+	return () => {
+		seed = (seed + 0x6D2B79F5) | 0;
+		let t = Math.imul(seed ^ (seed >>> 15), seed | 1);
+		t ^= t + Math.imul(t ^ (t >>> 7), t | 61);
+		return ((t ^ (t >>> 14)) >>> 0) / 4294967296;
+	};
+}
+
+/**
+ * Generate a synthetic image of the content class:
+ *
+ * - photo: smooth gradients with sensor-like noise, opaque.
+ * - screenshot: flat areas with sharp edges and few colors, opaque.
+ * - alpha: same as photo, with a radial transparent gradient.
+ */
+export function generateImage(content: string, width: number, height: number, depth: number): ImageDataLike {
+	const random = mulberry32(width ^ height ^ depth);
+	const max = (1 << depth) - 1;
+	const length = width * height * 4;
+	const data = depth === 8 ? new Uint8Array(length) : new Uint16Array(length);
+
+	for (let y = 0, i = 0; y < height; y++) {
+		for (let x = 0; x < width; x++, i += 4) {
+			const u = x / width;
+			const v = y / height;
+
+			if (content === "screenshot") {
+				const cell = ((x >> 6) + (y >> 5) * 7) % 5;
+				const glyph = ((x * 7) ^ (y * 3)) % 11 === 0;
+				const c = glyph ? 0 : cell / 4;
+				data[i] = c * max;
+				data[i + 1] = (1 - c) * max;
+				data[i + 2] = (y % 32 < 20 ? 1 : 0.5) * max;
+				data[i + 3] = max;
+			} else {
+				const noise = (random() - 0.5) * 0.04;
+				data[i] = Math.min(1, Math.max(0, u + noise)) * max;
+				data[i + 1] = Math.min(1, Math.max(0, v + noise)) * max;
+				data[i + 2] = Math.min(1, Math.max(0, (1 - u * v) + noise)) * max;
+
+				if (content === "alpha") {
+					const d = Math.hypot(u - 0.5, v - 0.5) * 2;
+					data[i + 3] = Math.max(0, 1 - d) * max;
+				} else {
+					data[i + 3] = max;
+				}
+			}
+		}
+	}
+
+	const bytes = new Uint8ClampedArray(data.buffer);
+	return _icodec_ImageData(bytes, width, height, depth);
+}
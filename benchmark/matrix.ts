@@ -0,0 +1,177 @@
+import { defineSuite, MetricAnalysis, Profiler } from "esbench";
+import { readFileSync } from "node:fs";
+import * as codecs from "../lib/node.js";
+import { encodeES } from "../lib/common.js";
+import { generateImage, sizes } from "./images.js";
+
+type CodecName = keyof typeof codecs;
+
+/*
+ * Representative option sets of each codec, from fastest to slowest.
+ * Codecs that are not listed here are benchmarked with default options.
+ */
+const presets: Record<string, Record<string, object>> = {
+	avif: {
+		fast: { speed: 10 },
+		default: {},
+		slow: { speed: 4 },
+	},
+	jxl: {
+		fast: { effort: 3 },
+		default: {},
+		slow: { effort: 9 },
+	},
+	webp: {
+		fast: { method: 0 },
+		default: {},
+		slow: { method: 6 },
+	},
+	wp2: {
+		fast: { effort: 0 },
+		default: {},
+		slow: { effort: 9 },
+	},
+	jpeg: {
+		fast: { progressive: false, optimizeCoding: false, quality: 75 },
+		default: {},
+		slow: { quality: 90, trellisMultipass: true },
+	},
+	png: {
+		fast: { level: 0 },
+		default: {},
+		slow: { level: 6 },
+	},
+};
+
+const codecNames = Object.keys(codecs).filter(k => codecs[k as CodecName].encode);
+
+// Does not work in Node.
+codecNames.splice(codecNames.indexOf("heic"), 1);
+
+/*
+ * Emscripten modules of encoders in dist, PNG is built by wasm-bindgen,
+ * which has only one instance, so it is not listed.
+ */
+const encoderFiles: Record<string, string> = {
+	avif: "avif-enc",
+	jpeg: "mozjpeg",
+	jxl: "jxl-enc",
+	webp: "webp-enc",
+	qoi: "qoi",
+	wp2: "wp2-enc",
+};
+
+/**
+ * Instantiate a new encoder module, linear memory can only grow,
+ * so its size after the case is the peak usage of that case alone.
+ */
+async function instantiate(codec: string) {
+	const name = encoderFiles[codec];
+	const { default: factory } = await import(`../dist/${name}.js`);
+	return factory({ wasmBinary: readFileSync(`dist/${name}.wasm`) });
+}
+
+// State of the running scene, `output` is set by the benchmark function.
+let current: {
+	pixels: number;
+	wasm?: any;
+	output?: Uint8Array;
+};
+
+/**
+ * Collects throughput, compression ratio and the peak linear memory size.
+ * Output is the result of the last invocation by the time profiler.
+ */
+const throughputProfiler: Profiler = {
+	onStart(ctx) {
+		ctx.defineMetric({
+			key: "MP/s",
+			format: "{number}",
+			analysis: MetricAnalysis.Compare,
+			lowerIsBetter: false,
+		});
+		ctx.defineMetric({
+			key: "bpp",
+			format: "{number}",
+			analysis: MetricAnalysis.Compare,
+			lowerIsBetter: true,
+		});
+		ctx.defineMetric({
+			key: "heap",
+			format: "{dataSize}",
+			analysis: MetricAnalysis.Compare,
+			lowerIsBetter: true,
+		});
+	},
+	async onCase(_, case_, metrics) {
+		const time = metrics.time as number[] | undefined;
+		let ms: number;
+
+		if (time?.length) {
+			ms = time.reduce((s, v) => s + v) / time.length;
+		} else {
+			// Time profiler is disabled, the case has not been run.
+			const start = performance.now();
+			await case_.invoke();
+			ms = performance.now() - start;
+		}
+
+		const { pixels, wasm, output } = current;
+		metrics["MP/s"] = pixels / 1000 / ms;
+		metrics.bpp = output!.byteLength * 8 / pixels;
+
+		if (wasm) {
+			metrics.heap = wasm.HEAP8.buffer.byteLength;
+		}
+	},
+};
+
+/*
+ * Encode synthetic images of various size, bit depth, content and options,
+ * report MP/s, bits per pixel and the peak WASM heap size of each case.
+ *
+ * The full matrix is big, use `--grep` to narrow it:
+ *     `pnpm exec esbench --file matrix.ts --grep codec=avif`
+ *
+ * Check regressions against the committed baseline:
+ *     `node benchmark/regression.js reports/result.json`
+ */
+export default defineSuite({
+	params: {
+		codec: codecNames,
+		size: Object.keys(sizes),
+		depth: [8, 10, 12, 16],
+		content: ["photo", "screenshot", "alpha"],
+		preset: ["fast", "default", "slow"],
+	},
+	timing: {
+		iterations: 1,
+		samples: 3,
+	},
+	profilers: [throughputProfiler],
+	async setup(scene) {
+		const { codec, size, depth, content, preset } = scene.params;
+		const { loadEncoder, encode, bitDepth, defaultOptions } = codecs[codec as CodecName] as any;
+
+		if (!bitDepth.includes(depth)) {
+			return; // Unsupported bit depth, skip.
+		}
+		const options = presets[codec]?.[preset];
+		if (!options && preset !== "default") {
+			return; // The codec has no options to tune.
+		}
+
+		const [width, height] = sizes[size];
+		const image = generateImage(content, width, height, depth);
+		const state: typeof current = { pixels: width * height };
+		current = state;
+
+		if (codec in encoderFiles) {
+			const wasm = state.wasm = await instantiate(codec);
+			scene.bench("icodec", () => state.output = encodeES(codec, wasm, defaultOptions, image, options));
+		} else {
+			await loadEncoder();
+			scene.bench("icodec", () => state.output = encode(image, options));
+		}
+	},
+});
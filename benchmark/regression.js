@@ -0,0 +1,153 @@
+import { readdirSync, readFileSync, statSync, writeFileSync } from "node:fs";
+import { argv, exit } from "node:process";
+
+const baselineFile = new URL("baseline.json", import.meta.url);
+const distDir = new URL("../dist/", import.meta.url);
+
+const options = {
+	/**
+	 * Path of the raw report generated by esbench.
+	 */
+	report: "reports/result.json",
+
+	/**
+	 * Overwrite the baseline with the report, instead of comparing.
+	 */
+	update: false,
+
+	/**
+	 * Relative change of a metric that considered as a regression.
+	 */
+	threshold: 0.1,
+};
+
+/*
+ * Metrics saved in the baseline, and whether a larger value is better.
+ * Time is not included, the throughput is derived from it.
+ */
+const metrics = {
+	"MP/s": true,
+	bpp: false,
+	heap: false,
+	bytes: false,
+};
+
+for (const arg of argv.slice(2)) {
+	const [key, value] = arg.replace(/^--/, "").split("=");
+	if (key === "update") {
+		options.update = true;
+	} else if (key === "threshold") {
+		options.threshold = parseFloat(value);
+	} else {
+		options.report = arg;
+	}
+}
+
+/**
+ * Flatten results of the matrix suite to `{ "k1=v1,k2=v2...": metrics }`.
+ *
+ * Scenes are stored in the order of cartesian product of the params,
+ * the last param changes the fastest.
+ */
+function flatten(report) {
+	const entries = {};
+	for (const [file, results] of Object.entries(report)) {
+		if (!file.includes("matrix")) {
+			continue;
+		}
+		for (const { paramDef, scenes } of results) {
+			for (let i = 0; i < scenes.length; i++) {
+				const keys = [];
+				let rem = i;
+				for (let j = paramDef.length - 1; j >= 0; j--) {
+					const [name, values] = paramDef[j];
+					keys.unshift(`${name}=${values[rem % values.length]}`);
+					rem = Math.floor(rem / values.length);
+				}
+				for (const [name, caseMetrics] of Object.entries(scenes[i])) {
+					const picked = {};
+					for (const key of Object.keys(metrics)) {
+						if (typeof caseMetrics[key] === "number") {
+							picked[key] = caseMetrics[key];
+						}
+					}
+					entries[`${keys.join(",")},case=${name}`] = picked;
+				}
+			}
+		}
+	}
+	return entries;
+}
+
+/**
+ * Sizes of WASM files in the dist folder, as `{ "file=name.wasm": { bytes } }`.
+ * Build options like the allocator affect both size and throughput.
+ */
+function wasmSizes() {
+	const entries = {};
+	for (const name of readdirSync(distDir)) {
+		if (name.endsWith(".wasm")) {
+			const { size } = statSync(new URL(name, distDir));
+			entries[`file=${name}`] = { bytes: size };
+		}
+	}
+	return entries;
+}
+
+const current = {
+	...flatten(JSON.parse(readFileSync(options.report, "utf8"))),
+	...wasmSizes(),
+};
+
+const baseline = JSON.parse(readFileSync(baselineFile, "utf8"));
+
+// The committed baseline is empty, the first run on a machine records it.
+if (options.update || Object.keys(baseline).length === 0) {
+	writeFileSync(baselineFile, JSON.stringify(current, null, "\t") + "\n");
+	console.info(`Baseline updated, ${Object.keys(current).length} entries.`);
+	exit(0);
+}
+
+const regressions = [];
+const missing = [];
+
+for (const [key, values] of Object.entries(current)) {
+	const expected = baseline[key];
+	if (!expected) {
+		missing.push(key);
+		continue;
+	}
+	for (const [metric, largerIsBetter] of Object.entries(metrics)) {
+		const before = expected[metric];
+		const after = values[metric];
+		if (before === undefined || after === undefined) {
+			continue;
+		}
+		const change = (after - before) / before;
+		if (largerIsBetter ? change < -options.threshold : change > options.threshold) {
+			regressions.push({ key, metric, before, after, change });
+		} else if (metric === "bytes" && change !== 0) {
+			// Size changes below the threshold are reported but do not fail.
+			console.info(`${key}: ${metric} ${before} -> ${after} (${(change * 100).toFixed(1)}%)`);
+		}
+	}
+}
+
+if (missing.length > 0) {
+	console.warn(`${missing.length} cases are not in the baseline, e.g. ${missing[0]}`);
+}
+if (missing.length === Object.keys(current).length) {
+	console.error("Nothing to compare, record the baseline with `--update` first.");
+	exit(1);
+}
+
+if (regressions.length === 0) {
+	console.info("No regression found.");
+} else {
+	for (const { key, metric, before, after, change } of regressions) {
+		const percent = (change * 100).toFixed(1);
+		console.error(`${key}: ${metric} ${before} -> ${after} (${percent}%)`);
+	}
+	console.error(`${regressions.length} regressions found.`);
+	exit(1);
+}
@@ -1,48 +1,187 @@
+#include <algorithm>
+#include <thread>
+#include <vector>
 #include <emscripten/bind.h>
 #include "icodec.h"
 #include "avif/avif.h"
 
-#define CHECK_STATUS(s) if (s != AVIF_RESULT_OK)	\
-{													\
-	return val(avifResultToString(s));				\
-}
+namespace
+{
 
-/**
- * AVIF decode from memory. Implementation reference:
- * https://github.com/AOMediaCodec/libavif/blob/main/examples/avif_example_decode_memory.c
+#define CHECK_STATUS(s)                             \
+	{                                               \
+		auto status = s;                            \
+		if (status != AVIF_RESULT_OK)               \
+		{                                           \
+			return val(avifResultToString(status)); \
+		}                                           \
+	}
+
+/*
+ * Read the file from the JS stream source. libavif requests data by offset
+ * and size, the buffer is reused so data is not persistent, libavif copies
+ * what it needs to keep.
  */
-val decode(std::string input)
+struct StreamIO
 {
-	auto bytes = reinterpret_cast<uint8_t *>(input.data());
-	auto decoder = toRAII(avifDecoderCreate(), avifDecoderDestroy);
-	if (!decoder)
+	avifIO io;
+	val source;
+	std::vector<uint8_t> buffer;
+
+	static avifResult read(avifIO *io, uint32_t readFlags, uint64_t offset, size_t size, avifROData *out)
 	{
-		return val("Out of memory");
+		auto self = reinterpret_cast<StreamIO *>(io);
+		if (readFlags != 0 || offset > io->sizeHint)
+		{
+			return AVIF_RESULT_IO_ERROR;
+		}
+		size = std::min<uint64_t>(size, io->sizeHint - offset);
+		self->buffer.resize(size);
+
+		size_t length = 0;
+		while (length < size)
+		{
+			auto n = readChunk(self->source, self->buffer.data() + length, size - length, offset + length);
+			if (n == 0)
+			{
+				break;
+			}
+			length += n;
+		}
+		out->data = self->buffer.data();
+		out->size = length;
+		return AVIF_RESULT_OK;
 	}
 
-	// Do not use `avifDecoderReadMemory`, it will do a redundant copy.
-	CHECK_STATUS(avifDecoderSetIOMemory(decoder.get(), bytes, input.length()));
+	static void destroy(avifIO *io)
+	{
+		delete reinterpret_cast<StreamIO *>(io);
+	}
+};
+
+/*
+ * Shared by `decode` and `decodeStream`, the IO of the decoder must be set.
+ */
+val decodeWith(avifDecoder *decoder, val control)
+{
+	Progress progress(control);
+	Limits limits(control);
+
+	// libavif rejects larger images (including grids) while parsing.
+	if (limits.maxPixels > 0)
+	{
+		decoder->imageSizeLimit = std::min<double>(limits.maxPixels, decoder->imageSizeLimit);
+	}
+
+#ifndef __EMSCRIPTEN__
+	decoder->maxThreads = std::thread::hardware_concurrency();
+#endif
 
 	// Read metadata from header.
-	CHECK_STATUS(avifDecoderParse(decoder.get()));
+	CHECK_STATUS(avifDecoderParse(decoder));
+
+	// Check before decoding, the output buffer is the largest allocation.
+	auto image = decoder->image;
+	auto bytes = (double)image->width * image->height * CHANNELS_RGBA * (image->depth > 8 ? 2 : 1);
+	if (auto error = limits.check(image->width, image->height, bytes))
+	{
+		return val(error);
+	}
+
+	// libaom has no progress callback, we can only check between steps.
+	if (!progress.check())
+	{
+		return val(CANCELLED);
+	}
 
 	// Read the first image frame data.
-	CHECK_STATUS(avifDecoderNextImage(decoder.get()));
+	CHECK_STATUS(avifDecoderNextImage(decoder));
+	if (!progress.update(0.9))
+	{
+		return val(CANCELLED);
+	}
 
 	// Create a RGB image structure describe the format we want.
-	// Defaults to AVIF_RGB_FORMAT_RGBA.
+	// Defaults to AVIF_RGB_FORMAT_RGBA, other formats are converted by JS side.
 	avifRGBImage rgb;
 	avifRGBImageSetDefaults(&rgb, decoder->image);
+	auto channels = channelsOf(control) == 3 ? 3 : CHANNELS_RGBA;
+	if (channels == 3)
+	{
+		rgb.format = AVIF_RGB_FORMAT_RGB;
+	}
 
 	// Convert libavif internal image structure to our RGBA format.
 	CHECK_STATUS(avifRGBImageAllocatePixels(&rgb));
 	CHECK_STATUS(avifImageYUVToRGB(decoder->image, &rgb));
 
 	auto _ = toRAII(&rgb, avifRGBImageFreePixels);
-	return toImageData(rgb.pixels, rgb.width, rgb.height, rgb.depth);
+	return toImageData(rgb.pixels, rgb.width, rgb.height, rgb.depth, channels);
+}
+
+/**
+ * AVIF decode from memory. Implementation reference:
+ * https://github.com/AOMediaCodec/libavif/blob/main/examples/avif_example_decode_memory.c
+ */
+val decode(std::string input, val control)
+{
+	auto bytes = reinterpret_cast<uint8_t *>(input.data());
+	auto decoder = toRAII(avifDecoderCreate(), avifDecoderDestroy);
+	if (!decoder)
+	{
+		return val("Out of memory");
+	}
+
+	// Do not use `avifDecoderReadMemory`, it will do a redundant copy.
+	CHECK_STATUS(avifDecoderSetIOMemory(decoder.get(), bytes, input.length()));
+	return decodeWith(decoder.get(), control);
+}
+
+/**
+ * Decode from the JS stream source, only the boxes and items requested
+ * by libavif are read into memory.
+ *
+ * @param source JS object with size and read(buffer, position).
+ */
+val decodeStream(val source, val control)
+{
+	auto decoder = toRAII(avifDecoderCreate(), avifDecoderDestroy);
+	if (!decoder)
+	{
+		return val("Out of memory");
+	}
+
+	// The decoder takes the ownership of IO.
+	auto size = source["size"].as<double>();
+	auto io = new StreamIO{{StreamIO::destroy, StreamIO::read, nullptr, (uint64_t)size, AVIF_FALSE, nullptr}, source};
+	avifDecoderSetIO(decoder.get(), &io->io);
+	return decodeWith(decoder.get(), control);
+}
+
+val probe(std::string input)
+{
+	auto bytes = reinterpret_cast<uint8_t *>(input.data());
+	auto decoder = toRAII(avifDecoderCreate(), avifDecoderDestroy);
+	if (!decoder)
+	{
+		return val("Out of memory");
+	}
+	CHECK_STATUS(avifDecoderSetIOMemory(decoder.get(), bytes, input.length()));
+	CHECK_STATUS(avifDecoderParse(decoder.get()));
+
+	auto image = decoder->image;
+	return toImageInfo(image->width, image->height, image->depth);
 }
 
 EMSCRIPTEN_BINDINGS(icodec_module_AVIF)
 {
+#ifdef ICODEC_TRANSCODER
+	transcoder::decoder("avif", &decode);
+#else
 	function("decode", &decode);
+	function("decodeStream", &decodeStream);
+	function("probe", &probe);
+#endif
+}
+
 }
@@ -1,16 +1,36 @@
+#include <algorithm>
+#include <thread>
+#include <vector>
 #include <emscripten/bind.h>
 #include "icodec.h"
 
 #define AVIF_ENABLE_EXPERIMENTAL_SAMPLE_TRANSFORM
 #include "avif/avif.h"
 
-#define CHECK_STATUS(s) if (s != AVIF_RESULT_OK)	\
-{													\
-	return val(avifResultToString(s));				\
-}
+namespace
+{
+
+#define CHECK_STATUS(s)                              \
+	{                                                \
+		auto status = s;                             \
+		if (status != AVIF_RESULT_OK)                \
+		{                                            \
+			return val(avifResultToString(status)); \
+		}                                            \
+	}
+
+// Used in functions that return avifResult instead of val.
+#define RETURN_IF_ERROR(s)            \
+	{                                 \
+		auto status = s;              \
+		if (status != AVIF_RESULT_OK) \
+		{                             \
+			return status;            \
+		}                             \
+	}
 
 #define SET_OPTION(key, value) \
-	CHECK_STATUS(avifEncoderSetCodecSpecificOption(encoder.get(), key, value))
+	RETURN_IF_ERROR(avifEncoderSetCodecSpecificOption(encoder, key, value))
 
 struct AvifOptions
 {
@@ -26,35 +46,27 @@ struct AvifOptions
 	int tune;
 	int denoiseLevel;
 	bool sharpYUV;
+	bool keepAlpha;
 
 	uint32_t bitDepth;
+	uint32_t channels;
 };
 
-/**
- * AVIF encode. Implementation reference:
- * https://github.com/AOMediaCodec/libavif/blob/main/examples/avif_example_encode.c
- * https://github.com/AOMediaCodec/libavif/blob/main/apps/avifenc.c
- */
-val encode(std::string pixels, uint32_t width, uint32_t height, AvifOptions options)
+// `matrixCoefficients` must set to identity for lossless.
+bool isIdentityMatrix(const AvifOptions &options)
 {
-	auto format = static_cast<avifPixelFormat>(options.subsample);
-
-	// Smart pointer for the input image in YUV format
-	auto image = toRAII(avifImageCreate(width, height, options.bitDepth, format), avifImageDestroy);
-	if (image == nullptr)
-	{
-		return val("Out of memory");
-	}
-
-	if (options.qualityAlpha == -1)
-	{
-		options.qualityAlpha = options.quality;
-	}
+	return options.quality == AVIF_QUALITY_LOSSLESS &&
+		   options.qualityAlpha == AVIF_QUALITY_LOSSLESS &&
+		   options.subsample == AVIF_PIXEL_FORMAT_YUV444;
+}
 
-	// `matrixCoefficients` must set to identity for lossless.
-	if (options.quality == AVIF_QUALITY_LOSSLESS &&
-		options.qualityAlpha == AVIF_QUALITY_LOSSLESS &&
-		format == AVIF_PIXEL_FORMAT_YUV444)
+/*
+ * Set the color conversion of the YUV image, and convert RGB or RGBA pixels to it,
+ * the alpha plane is not created for RGB, or RGBA if all pixels are opaque.
+ */
+avifResult importPixels(avifImage *image, uint8_t *pixels, const AvifOptions &options, bool opaque)
+{
+	if (isIdentityMatrix(options))
 	{
 		image->matrixCoefficients = AVIF_MATRIX_COEFFICIENTS_IDENTITY;
 	}
@@ -65,23 +77,22 @@ val encode(std::string pixels, uint32_t width, uint32_t height, AvifOptions opti
 
 	// Convert our RGBA format image to libavif internal YUV structure.
 	avifRGBImage srcRGB;
-	avifRGBImageSetDefaults(&srcRGB, image.get());
-	srcRGB.pixels = reinterpret_cast<uint8_t *>(pixels.data());
+	avifRGBImageSetDefaults(&srcRGB, image);
+	srcRGB.pixels = pixels;
 	srcRGB.depth = options.bitDepth;
-	srcRGB.rowBytes = width * CHANNELS_RGBA * ((options.bitDepth + 7) / 8);
+	srcRGB.format = options.channels == 3 ? AVIF_RGB_FORMAT_RGB : AVIF_RGB_FORMAT_RGBA;
+	srcRGB.rowBytes = image->width * options.channels * ((options.bitDepth + 7) / 8);
+	srcRGB.ignoreAlpha = opaque && !options.keepAlpha;
 	if (options.sharpYUV)
 	{
 		srcRGB.chromaDownsampling = AVIF_CHROMA_DOWNSAMPLING_SHARP_YUV;
 	}
 
-	CHECK_STATUS(avifImageRGBToYUV(image.get(), &srcRGB));
+	return avifImageRGBToYUV(image, &srcRGB);
+}
 
-	// Create a smart pointer for the encoder
-	auto encoder = toRAII(avifEncoderCreate(), avifEncoderDestroy);
-	if (encoder == nullptr)
-	{
-		return val("Out of memory");
-	}
+avifResult setupEncoder(avifEncoder *encoder, const AvifOptions &options)
+{
 	encoder->quality = options.quality;
 	encoder->qualityAlpha = options.qualityAlpha;
 	encoder->speed = options.speed;
@@ -89,6 +100,11 @@ val encode(std::string pixels, uint32_t width, uint32_t height, AvifOptions opti
 	encoder->tileRowsLog2 = options.tileRowsLog2;
 	encoder->tileColsLog2 = options.tileColsLog2;
 
+#ifndef __EMSCRIPTEN__
+	// Native addons have real threads, aom splits tiles and rows.
+	encoder->maxThreads = std::thread::hardware_concurrency();
+#endif
+
 	if (options.bitDepth == 16) {
 		encoder-> sampleTransformRecipe = AVIF_SAMPLE_TRANSFORM_BIT_DEPTH_EXTENSION_12B_4B;
 	}
@@ -106,17 +122,244 @@ val encode(std::string pixels, uint32_t width, uint32_t height, AvifOptions opti
 	{
 		SET_OPTION("color:enable-chroma-deltaq", "1");
 	}
+	return AVIF_RESULT_OK;
+}
+
+/**
+ * AVIF encode. Implementation reference:
+ * https://github.com/AOMediaCodec/libavif/blob/main/examples/avif_example_encode.c
+ * https://github.com/AOMediaCodec/libavif/blob/main/apps/avifenc.c
+ *
+ * libaom has no progress callback, cancellation is only checked
+ * between steps, the encoding itself cannot be interrupted.
+ */
+val encode(std::string pixels, uint32_t width, uint32_t height, AvifOptions options, val control)
+{
+	Progress progress(control);
+	auto format = static_cast<avifPixelFormat>(options.subsample);
+
+	// Smart pointer for the input image in YUV format
+	auto image = toRAII(avifImageCreate(width, height, options.bitDepth, format), avifImageDestroy);
+	if (image == nullptr)
+	{
+		return val("Out of memory");
+	}
+
+	if (options.qualityAlpha == -1)
+	{
+		options.qualityAlpha = options.quality;
+	}
+
+	auto rgba = reinterpret_cast<uint8_t *>(pixels.data());
+	auto opaque = !options.keepAlpha && isOpaque(rgba, (size_t)width * height, options.bitDepth, options.channels);
+	CHECK_STATUS(importPixels(image.get(), rgba, options, opaque));
+	if (!progress.update(0.1))
+	{
+		return val(CANCELLED);
+	}
+
+	// Create a smart pointer for the encoder
+	auto encoder = toRAII(avifEncoderCreate(), avifEncoderDestroy);
+	if (encoder == nullptr)
+	{
+		return val("Out of memory");
+	}
+	CHECK_STATUS(setupEncoder(encoder.get(), options));
 
 	avifRWData output = AVIF_DATA_EMPTY;
 	CHECK_STATUS(avifEncoderWrite(encoder.get(), image.get(), &output));
 
 	auto _ = toRAII(&output, avifRWDataFree);
+	progress.update(1);
+	return toUint8Array(output.data, output.size);
+}
+
+/**
+ * Encode the image with multiple options, the RGB to YUV conversion
+ * is done once for options with the same subsampling, matrix and sharpYUV.
+ *
+ * @param optionsList Array of AvifOptions objects.
+ * @return Array of encoded data, in the same order as options.
+ */
+val encodeMany(std::string pixels, uint32_t width, uint32_t height, val optionsList, val control)
+{
+	Progress progress(control);
+	auto count = optionsList["length"].as<size_t>();
+	auto results = val::array();
+
+	struct Converted
+	{
+		AvifOptions options;
+		std::unique_ptr<avifImage, decltype(&avifImageDestroy)> image;
+	};
+	std::vector<Converted> converted;
+
+	auto rgba = reinterpret_cast<uint8_t *>(pixels.data());
+	auto opaque = false;
+	if (count > 0)
+	{
+		auto first = optionsList[0].as<AvifOptions>();
+		opaque = isOpaque(rgba, (size_t)width * height, first.bitDepth, first.channels);
+	}
+
+	for (size_t i = 0; i < count; i++)
+	{
+		auto options = optionsList[i].as<AvifOptions>();
+		if (options.qualityAlpha == -1)
+		{
+			options.qualityAlpha = options.quality;
+		}
+		progress.range((double)i / count, (double)(i + 1) / count);
+
+		auto entry = std::find_if(converted.begin(), converted.end(), [&](const Converted &c)
+		{
+			return c.options.subsample == options.subsample &&
+				   c.options.sharpYUV == options.sharpYUV &&
+				   c.options.keepAlpha == options.keepAlpha &&
+				   isIdentityMatrix(c.options) == isIdentityMatrix(options);
+		});
+
+		if (entry == converted.end())
+		{
+			auto format = static_cast<avifPixelFormat>(options.subsample);
+			auto image = toRAII(avifImageCreate(width, height, options.bitDepth, format), avifImageDestroy);
+			if (image == nullptr)
+			{
+				return val("Out of memory");
+			}
+			CHECK_STATUS(importPixels(image.get(), rgba, options, opaque));
+			entry = converted.insert(converted.end(), {options, std::move(image)});
+		}
+		if (!progress.update(0.1))
+		{
+			return val(CANCELLED);
+		}
+
+		auto encoder = toRAII(avifEncoderCreate(), avifEncoderDestroy);
+		if (encoder == nullptr)
+		{
+			return val("Out of memory");
+		}
+		CHECK_STATUS(setupEncoder(encoder.get(), options));
+
+		avifRWData output = AVIF_DATA_EMPTY;
+		auto _ = toRAII(&output, avifRWDataFree);
+		CHECK_STATUS(avifEncoderWrite(encoder.get(), entry->image.get(), &output));
+
+		progress.update(1);
+		results.call<void>("push", toUint8Array(output.data, output.size));
+	}
+	return results;
+}
+
+/**
+ * Encode a large image as a grid, pixels are pulled from the JS source
+ * by cells, so the RGBA data of the whole image is not needed.
+ *
+ * This is not streaming, memory is not bounded by the cell size. libavif has
+ * no API to add cells one by one, avifEncoderAddImageGrid takes all of them,
+ * so YUV and alpha planes of the whole image are kept until then, which is
+ * smaller than RGBA (2.5 bytes per pixel for 8-bit 4:2:0).
+ *
+ * @param source JS object with width, height, tileWidth, tileHeight and read().
+ */
+val encodeTiled(val source, AvifOptions options, val control)
+{
+	Progress progress(control);
+	auto format = static_cast<avifPixelFormat>(options.subsample);
+	auto width = source["width"].as<uint32_t>();
+	auto height = source["height"].as<uint32_t>();
+	auto tileWidth = source["tileWidth"].as<uint32_t>();
+	auto tileHeight = source["tileHeight"].as<uint32_t>();
+
+	if (options.bitDepth == 16)
+	{
+		return val("16-bit is not supported by tiled encoding");
+	}
+	if (options.qualityAlpha == -1)
+	{
+		options.qualityAlpha = options.quality;
+	}
+
+	// AVIF allows at most 256 columns and rows in a grid.
+	auto columns = (width + tileWidth - 1) / tileWidth;
+	auto rows = (height + tileHeight - 1) / tileHeight;
+	if (columns > 256 || rows > 256)
+	{
+		return val("Too many tiles, the grid is limited to 256x256");
+	}
+
+	auto pixelBytes = CHANNELS_RGBA * ((options.bitDepth + 7) / 8);
+	auto buffer = std::make_unique_for_overwrite<uint8_t[]>((size_t)tileWidth * tileHeight * pixelBytes);
+	std::vector<std::unique_ptr<avifImage, decltype(&avifImageDestroy)>> cells;
+	std::vector<const avifImage *> cellPointers;
+	auto opaque = !options.keepAlpha;
+
+	// The right-most column and bottom-most row can be smaller.
+	for (uint32_t y = 0; y < height; y += tileHeight)
+	{
+		for (uint32_t x = 0; x < width; x += tileWidth)
+		{
+			auto w = std::min(tileWidth, width - x);
+			auto h = std::min(tileHeight, height - y);
+
+			if (!readTile(source, buffer.get(), x, y, w, h, options.bitDepth))
+			{
+				return val("Tile data length mismatch");
+			}
+			auto cell = toRAII(avifImageCreate(w, h, options.bitDepth, format), avifImageDestroy);
+			if (cell == nullptr)
+			{
+				return val("Out of memory");
+			}
+			// Cells must all have alpha or not, it's removed after all are read.
+			opaque = opaque && isOpaque(buffer.get(), (size_t)w * h, options.bitDepth, CHANNELS_RGBA);
+			CHECK_STATUS(importPixels(cell.get(), buffer.get(), options, false));
+
+			cellPointers.push_back(cell.get());
+			cells.push_back(std::move(cell));
+
+			if (!progress.update(0.1 * cells.size() / (columns * rows)))
+			{
+				return val(CANCELLED);
+			}
+		}
+	}
+	buffer.reset();
+
+	if (opaque)
+	{
+		for (auto &cell : cells)
+		{
+			avifImageFreePlanes(cell.get(), AVIF_PLANES_A);
+		}
+	}
+
+	auto encoder = toRAII(avifEncoderCreate(), avifEncoderDestroy);
+	if (encoder == nullptr)
+	{
+		return val("Out of memory");
+	}
+	CHECK_STATUS(setupEncoder(encoder.get(), options));
+
+	avifRWData output = AVIF_DATA_EMPTY;
+	auto _ = toRAII(&output, avifRWDataFree);
+	CHECK_STATUS(avifEncoderAddImageGrid(encoder.get(), columns, rows, cellPointers.data(), AVIF_ADD_IMAGE_FLAG_SINGLE));
+	CHECK_STATUS(avifEncoderFinish(encoder.get(), &output));
+
+	progress.update(1);
 	return toUint8Array(output.data, output.size);
 }
 
 EMSCRIPTEN_BINDINGS(icodec_module_AVIF)
 {
+#ifdef ICODEC_TRANSCODER
+	transcoder::encoder("avif", &encode);
+#else
 	function("encode", &encode);
+	function("encodeMany", &encodeMany);
+	function("encodeTiled", &encodeTiled);
+#endif
 
 	value_object<AvifOptions>("AvifOptions")
 		.field("quality", &AvifOptions::quality)
@@ -131,5 +374,9 @@ EMSCRIPTEN_BINDINGS(icodec_module_AVIF)
 		.field("denoiseLevel", &AvifOptions::denoiseLevel)
 		.field("subsample", &AvifOptions::subsample)
 		.field("sharpYUV", &AvifOptions::sharpYUV)
-		.field("bitDepth", &AvifOptions::bitDepth);
+		.field("keepAlpha", &AvifOptions::keepAlpha)
+		.field("bitDepth", &AvifOptions::bitDepth)
+		.field("channels", &AvifOptions::channels);
+}
+
 }
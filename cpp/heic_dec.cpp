@@ -3,37 +3,126 @@
 #include "icodec.h"
 #include "libheif/heif_cxx.h"
 
+namespace
+{
+
+/*
+ * Callbacks of `heif_decoding_options`, libheif reports progress of
+ * decoding grid tiles, and checks for cancellation between them.
+ */
+struct DecodeProgress
+{
+	Progress progress;
+	int max = 0;
+
+	explicit DecodeProgress(val control) : progress(control) {}
+
+	static void start(heif_progress_step step, int max, void *self)
+	{
+		reinterpret_cast<DecodeProgress *>(self)->max = max;
+	}
+
+	static void update(heif_progress_step step, int value, void *self)
+	{
+		auto p = reinterpret_cast<DecodeProgress *>(self);
+		if (p->max > 0)
+		{
+			p->progress.update((double)value / p->max);
+		}
+	}
+
+	static void end(heif_progress_step step, void *self) {}
+
+	static int cancel(void *self)
+	{
+		return !reinterpret_cast<DecodeProgress *>(self)->progress.check();
+	}
+};
+
 /**
  * HEIC decode from memory. Implementation reference:
  * https://github.com/saschazar21/webassembly/blob/main/packages/heif/main.cpp
  */
-val decode(std::string input)
+val decode(std::string input, val control)
 {
 	auto ctx = heif::Context();
 	ctx.read_from_memory_without_copy(input.c_str(), input.length());
 	auto handle = ctx.get_primary_image_handle();
 
+	// libheif can output RGB or RGBA, other formats are converted by JS side.
 	auto bitDepth = handle.get_luma_bits_per_pixel();
-	auto image = handle.decode_image(heif_colorspace_RGB, bitDepth == 8
-		? heif_chroma_interleaved_RGBA
-		: heif_chroma_interleaved_RRGGBBAA_LE);
+	auto channels = channelsOf(control) == 3 ? 3 : CHANNELS_RGBA;
+	heif_chroma chroma;
+	if (channels == 3)
+	{
+		chroma = bitDepth == 8 ? heif_chroma_interleaved_RGB : heif_chroma_interleaved_RRGGBB_LE;
+	}
+	else
+	{
+		chroma = bitDepth == 8 ? heif_chroma_interleaved_RGBA : heif_chroma_interleaved_RRGGBBAA_LE;
+	}
 
+	// Check before decoding, pixels exist twice: the decoded image and the copy.
 	auto width = handle.get_width();
 	auto height = handle.get_height();
+	auto row_bytes = width * channels * ((bitDepth + 7) / 8);
+	if (auto error = Limits(control).check(width, height, 2.0 * row_bytes * height))
+	{
+		return val(error);
+	}
+
+	// The C++ API does not support decoding options.
+	DecodeProgress tracker(control);
+	auto options = toRAII(heif_decoding_options_alloc(), heif_decoding_options_free);
+	options->start_progress = DecodeProgress::start;
+	options->on_progress = DecodeProgress::update;
+	options->end_progress = DecodeProgress::end;
+	options->cancel_decoding = DecodeProgress::cancel;
+	options->progress_user_data = &tracker;
+
+	heif_image *raw;
+	auto error = heif_decode_image(handle.get_raw_image_handle().get(), &raw, heif_colorspace_RGB, chroma, options.get());
+	if (tracker.progress.cancelled())
+	{
+		return val(CANCELLED);
+	}
+	if (error.code != heif_error_Ok)
+	{
+		return val(error.message);
+	}
+	auto image = heif::Image(raw);
+
 	int stride;
 	auto p = image.get_plane(heif_channel_interleaved, &stride);
 
-	auto row_bytes = width * CHANNELS_RGBA * ((bitDepth + 7) / 8);
-	auto rgba = std::make_unique_for_overwrite<uint8_t[]>(row_bytes * height);
+	auto pixels = std::make_unique_for_overwrite<uint8_t[]>(row_bytes * height);
 	for (auto y = 0; y < height; y++)
 	{
-		memcpy(&rgba[row_bytes * y], p + stride * y, row_bytes);
+		memcpy(&pixels[row_bytes * y], p + stride * y, row_bytes);
 	}
 
-	return toImageData(rgba.get(), (uint32_t)width, (uint32_t)height, (uint32_t)bitDepth);
+	return toImageData(pixels.get(), (uint32_t)width, (uint32_t)height, (uint32_t)bitDepth, channels);
+}
+
+val probe(std::string input)
+{
+	auto ctx = heif::Context();
+	ctx.read_from_memory_without_copy(input.c_str(), input.length());
+	auto handle = ctx.get_primary_image_handle();
+
+	auto width = (uint32_t)handle.get_width();
+	auto height = (uint32_t)handle.get_height();
+	return toImageInfo(width, height, handle.get_luma_bits_per_pixel());
 }
 
 EMSCRIPTEN_BINDINGS(icodec_module_HEIC)
 {
+#ifdef ICODEC_TRANSCODER
+	transcoder::decoder("heic", &decode);
+#else
 	function("decode", &decode);
+	function("probe", &probe);
+#endif
+}
+
 }
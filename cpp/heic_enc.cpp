@@ -13,25 +13,41 @@ struct HeicOptions
 	int complexity;
 	std::string chroma;
 	bool sharpYUV;
+	bool keepAlpha;
 
 	int bitDepth;
 };
 
+/*
+ * libheif writes the whole file at once, it's copied to a Uint8Array,
+ * or sent to the sink directly and returns the number of bytes.
+ */
 struct JSWriter : public heif::Context::Writer
 {
-	val uint8Array;
+	val sink;
+	val result;
+
+	explicit JSWriter(val sink) : sink(sink), result(val::undefined()) {}
 
 	heif_error write(const void *data, size_t size)
 	{
-		uint8Array = toUint8Array((uint8_t *)data, size);
+		if (sink.isUndefined())
+		{
+			result = toUint8Array((uint8_t *)data, size);
+		}
+		else
+		{
+			writeChunk(sink, (uint8_t *)data, size);
+			result = val((double)size);
+		}
 		return heif_error_success;
 	}
 
-	static val writeImageToUint8Array(heif::Context ctx)
+	static val writeImage(heif::Context ctx, val sink)
 	{
-		auto writer = JSWriter();
+		auto writer = JSWriter(sink);
 		ctx.write(writer);
-		return writer.uint8Array;
+		return writer.result;
 	}
 };
 
@@ -39,22 +55,36 @@ struct JSWriter : public heif::Context::Writer
  * HEIC encode. Implementation reference:
  * https://github.com/strukturag/libheif/blob/master/examples/decoder_png.cc
  * https://github.com/strukturag/libheif/blob/master/examples/heif_enc.cc
+ *
+ * x265 runs in its own threads and has no progress callback,
+ * cancellation is only checked before encoding.
  */
-val encode(std::string pixels, int width, int height, HeicOptions options)
+val encode(std::string pixels, int width, int height, HeicOptions options, val control)
 {
+	Progress progress(control);
+
+	// Opaque images are imported as RGB, so libheif does not encode the alpha image.
+	uint32_t channels = CHANNELS_RGBA;
+	if (!options.keepAlpha)
+	{
+		auto rgba = reinterpret_cast<uint8_t *>(pixels.data());
+		channels = dropOpaqueAlpha(rgba, (size_t)width * height, options.bitDepth, channels);
+	}
+	auto chroma = options.bitDepth == 8
+		? (channels == 3 ? heif_chroma_interleaved_RGB : heif_chroma_interleaved_RGBA)
+		: (channels == 3 ? heif_chroma_interleaved_RRGGBB_LE : heif_chroma_interleaved_RRGGBBAA_LE);
+
 	auto image = heif::Image();
-	image.create(width, height, heif_colorspace_RGB, options.bitDepth == 8
-		? heif_chroma_interleaved_RGBA
-		: heif_chroma_interleaved_RRGGBBAA_LE);
+	image.create(width, height, heif_colorspace_RGB, chroma);
 	image.add_plane(heif_channel_interleaved, width, height, options.bitDepth);
 
 	// Planes can have padding, so we need copy the data by row.
-	auto row_bytes = width * CHANNELS_RGBA * ((options.bitDepth + 7) / 8);
+	auto row_bytes = width * channels * ((options.bitDepth + 7) / 8);
 	int stride;
 	auto p = image.get_plane(heif_channel_interleaved, &stride);
 	for (auto y = 0; y < height; y++)
 	{
-		memcpy(p + stride * y, &pixels[row_bytes * y], stride);
+		memcpy(p + stride * y, &pixels[row_bytes * y], row_bytes);
 	}
 
 	// libheif does not automitic adjust chroma for lossless.
@@ -72,6 +102,11 @@ val encode(std::string pixels, int width, int height, HeicOptions options)
 	encoder.set_integer_parameter("complexity", options.complexity);
 	encoder.set_string_parameter("chroma", options.chroma);
 
+	if (!progress.check())
+	{
+		return val(CANCELLED);
+	}
+
 	auto context = heif::Context();
 	auto config = heif::Context::EncodingOptions();
 
@@ -97,7 +132,8 @@ val encode(std::string pixels, int width, int height, HeicOptions options)
 		context.encode_image(image, encoder, config);
 	}
 
-	return JSWriter::writeImageToUint8Array(context);
+	progress.update(1);
+	return JSWriter::writeImage(context, sinkOf(control));
 }
 
 EMSCRIPTEN_BINDINGS(icodec_module_HEIC)
@@ -113,5 +149,6 @@ EMSCRIPTEN_BINDINGS(icodec_module_HEIC)
 		.field("complexity", &HeicOptions::complexity)
 		.field("chroma", &HeicOptions::chroma)
 		.field("sharpYUV", &HeicOptions::sharpYUV)
+		.field("keepAlpha", &HeicOptions::keepAlpha)
 		.field("bitDepth", &HeicOptions::bitDepth);
 }
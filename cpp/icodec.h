@@ -1,3 +1,13 @@
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+#include <cstdlib>
+#include <functional>
+#include <string>
+#include <vector>
+#include <emscripten/emscripten.h>
 #include <emscripten/val.h>
 
 using namespace emscripten;
@@ -8,6 +18,14 @@ using namespace emscripten;
 // We want RGBA bytes in raw image data.
 #define CHANNELS_RGBA 4
 
+// Error message of cancelled operations, JS side converts it to `CancelledError`.
+#define CANCELLED "Cancelled"
+
+// Prefix of error messages of exceeded limits, JS side converts it to `LimitError`.
+#define LIMIT_EXCEEDED "Limit exceeded"
+#define TOO_MANY_PIXELS LIMIT_EXCEEDED ": maxPixels"
+#define OUT_OF_BUDGET LIMIT_EXCEEDED ": maxMemory"
+
 thread_local const val Uint8Array = val::global("Uint8Array");
 thread_local const val Uint8ClampedArray = val::global("Uint8ClampedArray");
 thread_local const val _icodec_ImageData = val::global("_icodec_ImageData");
@@ -26,6 +44,50 @@ std::unique_ptr<T, Deletion> toRAII(T *pointer, Deletion deletion)
 	return {pointer, deletion};
 }
 
+// Names of pixel formats in JS, indexed by the number of channels.
+const char *const PIXEL_FORMATS[] = {nullptr, "gray", "grayAlpha", "rgb", "rgba"};
+
+/*!
+ * Get the number of channels of the pixel format requested by `options.format`,
+ * default is RGBA. Decoders output it if the codec supports, otherwise
+ * output RGBA and JS side converts it.
+ */
+inline int channelsOf(val options)
+{
+	auto format = options.isUndefined() ? options : options["format"];
+	if (format.isUndefined())
+	{
+		return CHANNELS_RGBA;
+	}
+	auto name = format.as<std::string>();
+	for (int i = 1; i < CHANNELS_RGBA; i++)
+	{
+		if (name == PIXEL_FORMATS[i])
+		{
+			return i;
+		}
+	}
+	return CHANNELS_RGBA;
+}
+
+#ifdef ICODEC_TRANSCODER
+/*!
+ * Pixels decoded by the transcoder, they are kept in WASM memory and moved
+ * to the encoder, instead of being copied to JS and back.
+ */
+struct DecodedPixels
+{
+	std::string data;
+	uint32_t width = 0;
+	uint32_t height = 0;
+	uint32_t depth = 0;
+	int channels = 0;
+};
+
+// Set by the transcoder while decoding, `toImageData` writes into it.
+inline thread_local DecodedPixels *decodedPixels = nullptr;
+#endif
+
 /*!
  * Convert the buffer to JS ImageDataLike object, data are copied.
  *
@@ -35,19 +97,522 @@ std::unique_ptr<T, Deletion> toRAII(T *pointer, Deletion deletion)
  * @param bytes A buffer containing the underlying pixel representation of the image.
  * @param width An unsigned long representing the width of the image.
  * @param width An unsigned long representing the height of the image.
+ * @param channels Number of interleaved channels, see `PIXEL_FORMATS`.
  */
-val toImageData(const uint8_t *bytes, uint32_t width, uint32_t height, uint32_t depth)
+inline val toImageData(const uint8_t *bytes, uint32_t width, uint32_t height, uint32_t depth, int channels = CHANNELS_RGBA)
 {
-	auto length = ((size_t)CHANNELS_RGBA) * width * height * ((depth + 7) / 8);
+	auto length = ((size_t)channels) * width * height * ((depth + 7) / 8);
+#ifdef ICODEC_TRANSCODER
+	if (decodedPixels)
+	{
+		decodedPixels->data.assign(reinterpret_cast<const char *>(bytes), length);
+		decodedPixels->width = width;
+		decodedPixels->height = height;
+		decodedPixels->depth = depth;
+		decodedPixels->channels = channels;
+		return val::undefined();
+	}
+#endif
 	auto view = typed_memory_view(length, bytes);
 	auto data = Uint8ClampedArray.new_(view);
-	return _icodec_ImageData(data, width, height, depth);
+	return _icodec_ImageData(data, width, height, depth, val(PIXEL_FORMATS[channels]));
+}
+
+/*!
+ * Create the result of `probe` functions, which read dimensions and
+ * bit depth from the header without decoding pixels.
+ */
+inline val toImageInfo(uint32_t width, uint32_t height, uint32_t depth)
+{
+	auto info = val::object();
+	info.set("width", width);
+	info.set("height", height);
+	info.set("depth", depth);
+	return info;
 }
 
 /*!
  * Convert the buffer to JS Uint8Array object, data are copied.
  */
-val toUint8Array(const uint8_t *bytes, size_t length)
+inline val toUint8Array(const uint8_t *bytes, size_t length)
 {
 	return Uint8Array.new_(typed_memory_view(length, bytes));
 }
+
+template <typename T, int Channels>
+bool isOpaqueOf(const T *pixels, size_t count, T max)
+{
+	// AND of alpha values in blocks has no branch, so it's vectorized.
+	for (size_t i = 0; i < count; i += 4096)
+	{
+		auto end = std::min(count, i + 4096);
+		T all = max;
+		for (auto j = i; j < end; j++)
+		{
+			all &= pixels[j * Channels + Channels - 1];
+		}
+		if (all != max)
+		{
+			return false;
+		}
+	}
+	return true;
+}
+
+/*!
+ * Check whether all alpha values are the max, pixels of 8-bit are bytes,
+ * otherwise they are 16-bit integers.
+ *
+ * @param count The number of pixels.
+ * @param channels 2 (gray alpha) or 4 (RGBA), other formats have no alpha.
+ */
+inline bool isOpaque(const uint8_t *pixels, size_t count, uint32_t bitDepth, uint32_t channels)
+{
+	if (channels % 2 != 0)
+	{
+		return true;
+	}
+	if (bitDepth == 8)
+	{
+		return channels == 2
+			? isOpaqueOf<uint8_t, 2>(pixels, count, 255)
+			: isOpaqueOf<uint8_t, 4>(pixels, count, 255);
+	}
+	auto words = reinterpret_cast<const uint16_t *>(pixels);
+	auto max = static_cast<uint16_t>((1 << bitDepth) - 1);
+	return channels == 2
+		? isOpaqueOf<uint16_t, 2>(words, count, max)
+		: isOpaqueOf<uint16_t, 4>(words, count, max);
+}
+
+template <typename T>
+void removeAlpha(T *pixels, size_t count, uint32_t channels)
+{
+	for (size_t i = 0; i < count; i++)
+	{
+		for (uint32_t c = 0; c < channels - 1; c++)
+		{
+			pixels[i * (channels - 1) + c] = pixels[i * channels + c];
+		}
+	}
+}
+
+/*!
+ * If all pixels are opaque, remove the alpha channel in place, so encoders
+ * take the path without alpha, which saves time and bytes to code it.
+ *
+ * @return The number of channels after that.
+ */
+inline uint32_t dropOpaqueAlpha(uint8_t *pixels, size_t count, uint32_t bitDepth, uint32_t channels)
+{
+	if (!isOpaque(pixels, count, bitDepth, channels) || channels % 2 != 0)
+	{
+		return channels;
+	}
+	if (bitDepth == 8)
+	{
+		removeAlpha(pixels, count, channels);
+	}
+	else
+	{
+		removeAlpha(reinterpret_cast<uint16_t *>(pixels), count, channels);
+	}
+	return channels - 1;
+}
+
+/*!
+ * Report progress and check for cancellation at hook points of codecs.
+ *
+ * Created from the `control` argument of encode and decode functions, which is
+ * undefined or an object with `deadline` (timestamp of `performance.now()`)
+ * and `onProgress` (a function returns false to cancel).
+ */
+class Progress
+{
+	double deadline = INFINITY;
+	val callback = val::undefined();
+	double current = 0;
+	double offset = 0;
+	double scale = 1;
+	int reported = -1;
+	bool stopped = false;
+
+public:
+	explicit Progress(val control)
+	{
+		if (control.isUndefined() || control.isNull())
+		{
+			return;
+		}
+		auto value = control["deadline"];
+		if (!value.isUndefined())
+		{
+			deadline = value.as<double>();
+		}
+		callback = control["onProgress"];
+	}
+
+	/*!
+	 * Update the progress, the callback is invoked only if it changed by
+	 * at least 1%, to reduce the overhead of calling into JS.
+	 *
+	 * @param value Progress in [0, 1].
+	 * @return false if the operation should be cancelled.
+	 */
+	bool update(double value)
+	{
+		if (stopped)
+		{
+			return false;
+		}
+		current = value;
+		if (deadline != INFINITY && emscripten_get_now() > deadline)
+		{
+			stopped = true;
+			return false;
+		}
+		value = offset + value * scale;
+		auto percent = (int)(value * 100);
+		if (percent != reported && !callback.isUndefined())
+		{
+			reported = percent;
+			stopped = !callback(value).as<bool>();
+		}
+		return !stopped;
+	}
+
+	/*!
+	 * Map following updates to [start, end] of the reported progress,
+	 * used by batch functions that run multiple operations.
+	 */
+	void range(double start, double end)
+	{
+		offset = start;
+		scale = end - start;
+		current = 0;
+	}
+
+	/*!
+	 * Check for cancellation without changing the progress.
+	 */
+	bool check()
+	{
+		return update(current);
+	}
+
+	/*!
+	 * Whether the operation has been cancelled, used to distinguish
+	 * cancellation from other errors after a library call failed.
+	 */
+	bool cancelled() const
+	{
+		return stopped;
+	}
+};
+
+/*!
+ * A rectangle of the image to decode, read from `options.region`.
+ */
+struct Region
+{
+	uint32_t x = 0;
+	uint32_t y = 0;
+	uint32_t width = 0;
+	uint32_t height = 0;
+
+	/*!
+	 * Read the region from options, default is the whole image.
+	 *
+	 * @return false if the region is empty or out of the image.
+	 */
+	bool read(val options, uint32_t imageWidth, uint32_t imageHeight)
+	{
+		auto region = options.isUndefined() ? options : options["region"];
+		if (region.isUndefined())
+		{
+			width = imageWidth;
+			height = imageHeight;
+			return true;
+		}
+		x = region["x"].as<uint32_t>();
+		y = region["y"].as<uint32_t>();
+		width = region["width"].as<uint32_t>();
+		height = region["height"].as<uint32_t>();
+
+		return width > 0 && height > 0 &&
+			   (uint64_t)x + width <= imageWidth &&
+			   (uint64_t)y + height <= imageHeight;
+	}
+};
+
+/*!
+ * Resource limits read from `maxPixels` and `maxMemory` of the control,
+ * 0 means unlimited. Decoders check them after reading the header and
+ * before allocating for pixels, to fail fast on decompression bombs.
+ */
+struct Limits
+{
+	double maxPixels = 0;
+	double maxMemory = 0;
+
+	explicit Limits(val control)
+	{
+		if (control.isUndefined() || control.isNull())
+		{
+			return;
+		}
+		auto value = control["maxPixels"];
+		if (!value.isUndefined())
+		{
+			maxPixels = value.as<double>();
+		}
+		value = control["maxMemory"];
+		if (!value.isUndefined())
+		{
+			maxMemory = value.as<double>();
+		}
+	}
+
+	/*!
+	 * @param bytes Size of the buffer going to be allocated for the image.
+	 * @return The error message if exceeded, otherwise nullptr.
+	 */
+	const char *check(double width, double height, double bytes = 0) const
+	{
+		if (maxPixels > 0 && width * height > maxPixels)
+		{
+			return TOO_MANY_PIXELS;
+		}
+		if (maxMemory > 0 && bytes > maxMemory)
+		{
+			return OUT_OF_BUDGET;
+		}
+		return nullptr;
+	}
+};
+
+/*!
+ * Count the memory allocated by a codec and refuse allocations beyond
+ * the limit. `alloc` and `free` have signatures of custom allocator hooks
+ * in C libraries (e.g. JxlMemoryManager), with this object as the opaque.
+ */
+class MemoryBudget
+{
+	double limit;
+	double used = 0;
+
+public:
+	bool exceeded = false;
+
+	explicit MemoryBudget(double limit) : limit(limit) {}
+
+	/*!
+	 * Take bytes from the budget, used for buffers allocated by ourselves.
+	 *
+	 * @return false if the limit would be exceeded.
+	 */
+	bool reserve(double bytes)
+	{
+		if (limit > 0 && used + bytes > limit)
+		{
+			exceeded = true;
+			return false;
+		}
+		used += bytes;
+		return true;
+	}
+
+	/*
+	 * The size is stored in a header before the block, `malloc_usable_size`
+	 * is not portable (macOS has `malloc_size` instead).
+	 * It keeps the alignment of `malloc`.
+	 */
+	static constexpr size_t HEADER = alignof(std::max_align_t);
+
+	static void *alloc(void *opaque, size_t size)
+	{
+		auto self = reinterpret_cast<MemoryBudget *>(opaque);
+		if (!self->reserve((double)size + HEADER))
+		{
+			return nullptr;
+		}
+		auto block = reinterpret_cast<uint8_t *>(malloc(size + HEADER));
+		if (!block)
+		{
+			self->used -= (double)size + HEADER;
+			return nullptr;
+		}
+		*reinterpret_cast<size_t *>(block) = size;
+		return block + HEADER;
+	}
+
+	static void free(void *opaque, void *address)
+	{
+		if (address)
+		{
+			auto block = reinterpret_cast<uint8_t *>(address) - HEADER;
+			auto size = *reinterpret_cast<size_t *>(block);
+			reinterpret_cast<MemoryBudget *>(opaque)->used -= (double)size + HEADER;
+			::free(block);
+		}
+	}
+};
+
+/*!
+ * Pull a rectangle of RGBA pixels from the JS tile source of tiled encoding,
+ * by calling `source.read(x, y, width, height)`, the result is copied to dest.
+ *
+ * @return false if the returned data has a wrong length.
+ */
+inline bool readTile(val source, uint8_t *dest, uint32_t x, uint32_t y, uint32_t width, uint32_t height, uint32_t depth)
+{
+	auto length = ((size_t)CHANNELS_RGBA) * width * height * ((depth + 7) / 8);
+	auto data = source.call<val>("read", x, y, width, height);
+	if (data["byteLength"].as<size_t>() != length)
+	{
+		return false;
+	}
+	// The view must be created after the call, which may grow the memory.
+	auto bytes = Uint8Array.new_(data["buffer"], data["byteOffset"], length);
+	Uint8Array.new_(typed_memory_view(length, dest)).call<void>("set", bytes);
+	return true;
+}
+
+/*!
+ * Read bytes from the JS stream source of `decodeStream` functions, by calling
+ * `source.read(buffer, position)`, the buffer is a view of dest in WASM memory.
+ *
+ * @return The number of bytes read, 0 means the end of the stream.
+ */
+inline size_t readChunk(val source, uint8_t *dest, size_t length, double position)
+{
+	return source.call<double>("read", typed_memory_view(length, dest), position);
+}
+
+/*!
+ * Get the sink from the control argument of encode functions, encoded data
+ * is written to it by chunks instead of returned, undefined if not set.
+ */
+inline val sinkOf(val control)
+{
+	return control.isUndefined() ? control : control["sink"];
+}
+
+/*!
+ * Send a chunk of encoded data to the JS sink by calling `sink.write(chunk)`,
+ * the chunk is a view of WASM memory, it must be consumed before return.
+ */
+inline void writeChunk(val sink, const uint8_t *data, size_t length)
+{
+	sink.call<void>("write", typed_memory_view(length, data));
+}
+
+/*!
+ * Collect small writes of encoders (e.g. headers and partitions), and send them
+ * to the JS sink by chunks, to reduce calls into JS. `flush` must be called at the end.
+ */
+class SinkBuffer
+{
+	val sink;
+	std::vector<uint8_t> buffer;
+
+public:
+	double written = 0;
+
+	explicit SinkBuffer(val sink, size_t capacity = 65536) : sink(sink)
+	{
+		buffer.reserve(capacity);
+	}
+
+	void write(const uint8_t *data, size_t length)
+	{
+		if (buffer.size() + length > buffer.capacity())
+		{
+			flush();
+		}
+		if (length >= buffer.capacity())
+		{
+			writeChunk(sink, data, length);
+			written += length;
+		}
+		else
+		{
+			buffer.insert(buffer.end(), data, data + length);
+		}
+	}
+
+	void flush()
+	{
+		if (!buffer.empty())
+		{
+			writeChunk(sink, buffer.data(), buffer.size());
+			written += buffer.size();
+			buffer.clear();
+		}
+	}
+};
+
+#ifdef ICODEC_TRANSCODER
+/*!
+ * Codecs linked into the transcoder register their functions here instead of
+ * exporting them to JS, see transcoder.cpp.
+ */
+namespace transcoder
+{
+	using Decode = std::function<val(std::string, val)>;
+	using Encode = std::function<val(std::string, uint32_t, uint32_t, val, val)>;
+
+	template <typename F>
+	using Registry = std::vector<std::pair<std::string, F>>;
+
+	inline Registry<Decode> &decoders()
+	{
+		static Registry<Decode> list;
+		return list;
+	}
+
+	inline Registry<Encode> &encoders()
+	{
+		static Registry<Encode> list;
+		return list;
+	}
+
+	inline void decoder(const char *name, val (*fn)(std::string, val))
+	{
+		decoders().emplace_back(name, fn);
+	}
+
+	/*!
+	 * Options from JS are converted to the struct of the codec,
+	 * which must be registered by `value_object`.
+	 */
+	template <typename Size, typename Options>
+	void encoder(const char *name, val (*fn)(std::string, Size, Size, Options, val))
+	{
+		encoders().emplace_back(name, [fn](std::string pixels, uint32_t width, uint32_t height, val options, val control)
+		{
+			if constexpr (std::is_same_v<Options, val>)
+			{
+				return fn(std::move(pixels), width, height, options, control);
+			}
+			else
+			{
+				return fn(std::move(pixels), width, height, options.as<Options>(), control);
+			}
+		});
+	}
+
+	template <typename F>
+	const F *find(const Registry<F> &registry, const std::string &name)
+	{
+		for (auto &[key, fn] : registry)
+		{
+			if (key == name)
+			{
+				return &fn;
+			}
+		}
+		return nullptr;
+	}
+}
+#endif
@@ -0,0 +1,1055 @@
+/*
+ * WebAssembly SIMD128 implementation of libjpeg-turbo's `jsimd_*` interface,
+ * replaces `jsimd_none.c` in the mozjpeg build.
+ *
+ * Implemented kernels are bit-exact with their C counterparts, except that
+ * out-of-range IDCT results are saturated instead of wrapped by the range
+ * limit table, same as the x86 & ARM SIMD code of libjpeg-turbo.
+ *
+ * Entries we don't implement report unavailable in `jsimd_can_*`, and the
+ * library uses its C code for them. Notable ones:
+ *
+ * - quantize: mozjpeg uses trellis quantization by default, which does not call it.
+ * - ifast, float DCT and reduced-size IDCT: not used by icodec.
+ * - merged upsample: only used when fancy upsampling is disabled.
+ * - Huffman encoding: bit-stream packing is not suitable for SIMD128.
+ */
+#define JPEG_INTERNALS
+#include "jinclude.h"
+#include "jpeglib.h"
+#include "jsimd.h"
+#include "jdct.h"
+#include "jsimddct.h"
+#include <wasm_simd128.h>
+
+#define SCALEBITS 16
+#define ONE_HALF ((int32_t)1 << (SCALEBITS - 1))
+#define CBCR_OFFSET ((int32_t)CENTERJSAMPLE << SCALEBITS)
+
+#define CONST_BITS 13
+#define PASS1_BITS 2
+
+#define FIX_0_298631336 2446
+#define FIX_0_390180644 3196
+#define FIX_0_541196100 4433
+#define FIX_0_765366865 6270
+#define FIX_0_899976223 7373
+#define FIX_1_175875602 9633
+#define FIX_1_501321110 12299
+#define FIX_1_847759065 15137
+#define FIX_1_961570560 16069
+#define FIX_2_053119869 16819
+#define FIX_2_562915447 20995
+#define FIX_3_072711026 25172
+
+#define SPLAT(x) wasm_i32x4_splat(x)
+#define MUL(a, c) wasm_i32x4_mul(a, SPLAT(c))
+#define DESCALE(x, n) wasm_i32x4_shr(wasm_i32x4_add(x, SPLAT(1 << ((n) - 1))), n)
+
+/* Widen 8 bytes at `p` to two vectors of i32. */
+static inline void load_u8x8(const JSAMPLE *p, v128_t *lo, v128_t *hi)
+{
+	v128_t v = wasm_u16x8_extend_low_u8x16(wasm_v128_load64_zero(p));
+	*lo = wasm_u32x4_extend_low_u16x8(v);
+	*hi = wasm_u32x4_extend_high_u16x8(v);
+}
+
+/* Saturate two vectors of i32 to 8 bytes, in the low half of the result. */
+static inline v128_t pack_u8x8(v128_t lo, v128_t hi)
+{
+	v128_t v = wasm_i16x8_narrow_i32x4(lo, hi);
+	return wasm_u8x16_narrow_i16x8(v, v);
+}
+
+/*
+ * Get the byte offset of R, G, B component and the pixel size of the color space,
+ * only the extended RGB spaces and JCS_RGB are supported.
+ */
+static int rgb_layout(J_COLOR_SPACE space, int *r, int *g, int *b)
+{
+	switch (space)
+	{
+	case JCS_RGB:
+		*r = RGB_RED, *g = RGB_GREEN, *b = RGB_BLUE;
+		return RGB_PIXELSIZE;
+	case JCS_EXT_RGB:
+		*r = 0, *g = 1, *b = 2;
+		return 3;
+	case JCS_EXT_RGBX:
+	case JCS_EXT_RGBA:
+		*r = 0, *g = 1, *b = 2;
+		return 4;
+	case JCS_EXT_BGR:
+		*r = 2, *g = 1, *b = 0;
+		return 3;
+	case JCS_EXT_BGRX:
+	case JCS_EXT_BGRA:
+		*r = 2, *g = 1, *b = 0;
+		return 4;
+	case JCS_EXT_XBGR:
+	case JCS_EXT_ABGR:
+		*r = 3, *g = 2, *b = 1;
+		return 4;
+	case JCS_EXT_XRGB:
+	case JCS_EXT_ARGB:
+		*r = 1, *g = 2, *b = 3;
+		return 4;
+	default:
+		return 0;
+	}
+}
+
+static inline int simd_supported(void)
+{
+	return sizeof(JDIMENSION) == 4 && BITS_IN_JSAMPLE == 8 && DCTSIZE == 8;
+}
+
+/* ============================== Color Conversion ============================== */
+
+GLOBAL(int)
+jsimd_can_rgb_ycc(void)
+{
+	return simd_supported();
+}
+
+GLOBAL(int)
+jsimd_can_rgb_gray(void)
+{
+	return 0;
+}
+
+GLOBAL(int)
+jsimd_can_ycc_rgb(void)
+{
+	return simd_supported();
+}
+
+GLOBAL(int)
+jsimd_can_ycc_rgb565(void)
+{
+	return 0;
+}
+
+GLOBAL(void)
+jsimd_rgb_ycc_convert(j_compress_ptr cinfo, JSAMPARRAY input_buf,
+					  JSAMPIMAGE output_buf, JDIMENSION output_row,
+					  int num_rows)
+{
+	int r, g, b;
+	int pixel_size = rgb_layout(cinfo->in_color_space, &r, &g, &b);
+	JDIMENSION width = cinfo->image_width;
+
+	while (--num_rows >= 0)
+	{
+		JSAMPROW in = *input_buf++;
+		JSAMPROW y_out = output_buf[0][output_row];
+		JSAMPROW cb_out = output_buf[1][output_row];
+		JSAMPROW cr_out = output_buf[2][output_row];
+		JDIMENSION col = 0;
+		output_row++;
+
+		// Vectorized path for 4 bytes per pixel, 8 pixels per iteration.
+		for (; pixel_size == 4 && col + 8 <= width; col += 8, in += 32)
+		{
+			v128_t a = wasm_v128_load(in);
+			v128_t c = wasm_v128_load(in + 16);
+			v128_t ch[4] = {
+				wasm_i8x16_shuffle(a, c, 0, 4, 8, 12, 16, 20, 24, 28, 0, 0, 0, 0, 0, 0, 0, 0),
+				wasm_i8x16_shuffle(a, c, 1, 5, 9, 13, 17, 21, 25, 29, 0, 0, 0, 0, 0, 0, 0, 0),
+				wasm_i8x16_shuffle(a, c, 2, 6, 10, 14, 18, 22, 26, 30, 0, 0, 0, 0, 0, 0, 0, 0),
+				wasm_i8x16_shuffle(a, c, 3, 7, 11, 15, 19, 23, 27, 31, 0, 0, 0, 0, 0, 0, 0, 0),
+			};
+			v128_t rw = wasm_u16x8_extend_low_u8x16(ch[r]);
+			v128_t gw = wasm_u16x8_extend_low_u8x16(ch[g]);
+			v128_t bw = wasm_u16x8_extend_low_u8x16(ch[b]);
+			v128_t R[2] = {wasm_u32x4_extend_low_u16x8(rw), wasm_u32x4_extend_high_u16x8(rw)};
+			v128_t G[2] = {wasm_u32x4_extend_low_u16x8(gw), wasm_u32x4_extend_high_u16x8(gw)};
+			v128_t B[2] = {wasm_u32x4_extend_low_u16x8(bw), wasm_u32x4_extend_high_u16x8(bw)};
+			v128_t Y[2], Cb[2], Cr[2];
+
+			for (int i = 0; i < 2; i++)
+			{
+				Y[i] = wasm_i32x4_add(wasm_i32x4_add(MUL(R[i], 19595), MUL(G[i], 38470)),
+									  wasm_i32x4_add(MUL(B[i], 7471), SPLAT(ONE_HALF)));
+				Cb[i] = wasm_i32x4_add(wasm_i32x4_add(MUL(R[i], -11059), MUL(G[i], -21709)),
+									   wasm_i32x4_add(MUL(B[i], 32768), SPLAT(CBCR_OFFSET + ONE_HALF - 1)));
+				Cr[i] = wasm_i32x4_add(wasm_i32x4_add(MUL(R[i], 32768), MUL(G[i], -27439)),
+									   wasm_i32x4_add(MUL(B[i], -5329), SPLAT(CBCR_OFFSET + ONE_HALF - 1)));
+				Y[i] = wasm_i32x4_shr(Y[i], SCALEBITS);
+				Cb[i] = wasm_i32x4_shr(Cb[i], SCALEBITS);
+				Cr[i] = wasm_i32x4_shr(Cr[i], SCALEBITS);
+			}
+
+			wasm_v128_store64_lane(y_out + col, pack_u8x8(Y[0], Y[1]), 0);
+			wasm_v128_store64_lane(cb_out + col, pack_u8x8(Cb[0], Cb[1]), 0);
+			wasm_v128_store64_lane(cr_out + col, pack_u8x8(Cr[0], Cr[1]), 0);
+		}
+
+		for (; col < width; col++, in += pixel_size)
+		{
+			int32_t R = in[r], G = in[g], B = in[b];
+			y_out[col] = (JSAMPLE)((19595 * R + 38470 * G + 7471 * B + ONE_HALF) >> SCALEBITS);
+			cb_out[col] = (JSAMPLE)((-11059 * R - 21709 * G + 32768 * B + CBCR_OFFSET + ONE_HALF - 1) >> SCALEBITS);
+			cr_out[col] = (JSAMPLE)((32768 * R - 27439 * G - 5329 * B + CBCR_OFFSET + ONE_HALF - 1) >> SCALEBITS);
+		}
+	}
+}
+
+GLOBAL(void)
+jsimd_rgb_gray_convert(j_compress_ptr cinfo, JSAMPARRAY input_buf,
+					   JSAMPIMAGE output_buf, JDIMENSION output_row,
+					   int num_rows)
+{
+}
+
+static inline JSAMPLE clamp_u8(int32_t x)
+{
+	return (JSAMPLE)(x < 0 ? 0 : x > MAXJSAMPLE ? MAXJSAMPLE : x);
+}
+
+GLOBAL(void)
+jsimd_ycc_rgb_convert(j_decompress_ptr cinfo, JSAMPIMAGE input_buf,
+					  JDIMENSION input_row, JSAMPARRAY output_buf,
+					  int num_rows)
+{
+	int r, g, b;
+	int pixel_size = rgb_layout(cinfo->out_color_space, &r, &g, &b);
+	JDIMENSION width = cinfo->output_width;
+
+	// The remaining one in [0, 3] is the alpha (or padding) channel.
+	int a = 6 - r - g - b;
+
+	while (--num_rows >= 0)
+	{
+		JSAMPROW y_in = input_buf[0][input_row];
+		JSAMPROW cb_in = input_buf[1][input_row];
+		JSAMPROW cr_in = input_buf[2][input_row];
+		JSAMPROW out = *output_buf++;
+		JDIMENSION col = 0;
+		input_row++;
+
+		for (; pixel_size == 4 && col + 8 <= width; col += 8, out += 32)
+		{
+			v128_t Y[2], Cb[2], Cr[2], R[2], G[2], B[2];
+			load_u8x8(y_in + col, &Y[0], &Y[1]);
+			load_u8x8(cb_in + col, &Cb[0], &Cb[1]);
+			load_u8x8(cr_in + col, &Cr[0], &Cr[1]);
+
+			for (int i = 0; i < 2; i++)
+			{
+				v128_t cb = wasm_i32x4_sub(Cb[i], SPLAT(CENTERJSAMPLE));
+				v128_t cr = wasm_i32x4_sub(Cr[i], SPLAT(CENTERJSAMPLE));
+				v128_t cr_r = wasm_i32x4_shr(wasm_i32x4_add(MUL(cr, 91881), SPLAT(ONE_HALF)), SCALEBITS);
+				v128_t cb_b = wasm_i32x4_shr(wasm_i32x4_add(MUL(cb, 116130), SPLAT(ONE_HALF)), SCALEBITS);
+				v128_t cbcr_g = wasm_i32x4_add(MUL(cb, -22554), MUL(cr, -46802));
+				cbcr_g = wasm_i32x4_shr(wasm_i32x4_add(cbcr_g, SPLAT(ONE_HALF)), SCALEBITS);
+				R[i] = wasm_i32x4_add(Y[i], cr_r);
+				G[i] = wasm_i32x4_add(Y[i], cbcr_g);
+				B[i] = wasm_i32x4_add(Y[i], cb_b);
+			}
+
+			v128_t ch[4];
+			ch[r] = pack_u8x8(R[0], R[1]);
+			ch[g] = pack_u8x8(G[0], G[1]);
+			ch[b] = pack_u8x8(B[0], B[1]);
+			ch[a] = wasm_i8x16_splat(-1);
+
+			v128_t c01 = wasm_i8x16_shuffle(ch[0], ch[1], 0, 16, 1, 17, 2, 18, 3, 19, 4, 20, 5, 21, 6, 22, 7, 23);
+			v128_t c23 = wasm_i8x16_shuffle(ch[2], ch[3], 0, 16, 1, 17, 2, 18, 3, 19, 4, 20, 5, 21, 6, 22, 7, 23);
+			wasm_v128_store(out, wasm_i16x8_shuffle(c01, c23, 0, 8, 1, 9, 2, 10, 3, 11));
+			wasm_v128_store(out + 16, wasm_i16x8_shuffle(c01, c23, 4, 12, 5, 13, 6, 14, 7, 15));
+		}
+
+		for (; col < width; col++, out += pixel_size)
+		{
+			int32_t y = y_in[col];
+			int32_t cb = cb_in[col] - CENTERJSAMPLE;
+			int32_t cr = cr_in[col] - CENTERJSAMPLE;
+			out[r] = clamp_u8(y + ((91881 * cr + ONE_HALF) >> SCALEBITS));
+			out[g] = clamp_u8(y + ((-22554 * cb - 46802 * cr + ONE_HALF) >> SCALEBITS));
+			out[b] = clamp_u8(y + ((116130 * cb + ONE_HALF) >> SCALEBITS));
+			if (pixel_size == 4)
+			{
+				out[a] = 0xFF;
+			}
+		}
+	}
+}
+
+GLOBAL(void)
+jsimd_ycc_rgb565_convert(j_decompress_ptr cinfo, JSAMPIMAGE input_buf,
+						 JDIMENSION input_row, JSAMPARRAY output_buf,
+						 int num_rows)
+{
+}
+
+/* ============================== Downsampling ============================== */
+
+/*
+ * Expand a component horizontally from width input_cols to width output_cols,
+ * by duplicating the rightmost samples. Same as the function in jcsample.c
+ */
+static void expand_right_edge(JSAMPARRAY image_data, int num_rows,
+							  JDIMENSION input_cols, JDIMENSION output_cols)
+{
+	int count = (int)(output_cols - input_cols);
+	if (count <= 0)
+	{
+		return;
+	}
+	for (int row = 0; row < num_rows; row++)
+	{
+		JSAMPROW ptr = image_data[row] + input_cols;
+		memset(ptr, ptr[-1], count);
+	}
+}
+
+GLOBAL(int)
+jsimd_can_h2v2_downsample(void)
+{
+	return simd_supported();
+}
+
+GLOBAL(int)
+jsimd_can_h2v1_downsample(void)
+{
+	return simd_supported();
+}
+
+GLOBAL(int)
+jsimd_can_h2v2_smooth_downsample(void)
+{
+	return 0;
+}
+
+/*
+ * The output width is `width_in_blocks * DCTSIZE`, always multiple of 8,
+ * so there is no tail to handle.
+ */
+GLOBAL(void)
+jsimd_h2v1_downsample(j_compress_ptr cinfo, jpeg_component_info *compptr,
+					  JSAMPARRAY input_data, JSAMPARRAY output_data)
+{
+	JDIMENSION output_cols = compptr->width_in_blocks * DCTSIZE;
+	expand_right_edge(input_data, cinfo->max_v_samp_factor, cinfo->image_width, output_cols * 2);
+
+	// Bias alternates 0, 1, 0, 1... to avoid rounding towards one direction.
+	v128_t bias = wasm_i16x8_make(0, 1, 0, 1, 0, 1, 0, 1);
+
+	for (int row = 0; row < cinfo->max_v_samp_factor; row++)
+	{
+		JSAMPROW in = input_data[row];
+		JSAMPROW out = output_data[row];
+
+		for (JDIMENSION col = 0; col < output_cols; col += 8)
+		{
+			v128_t sum = wasm_u16x8_extadd_pairwise_u8x16(wasm_v128_load(in + col * 2));
+			sum = wasm_u16x8_shr(wasm_i16x8_add(sum, bias), 1);
+			wasm_v128_store64_lane(out + col, wasm_u8x16_narrow_i16x8(sum, sum), 0);
+		}
+	}
+}
+
+GLOBAL(void)
+jsimd_h2v2_downsample(j_compress_ptr cinfo, jpeg_component_info *compptr,
+					  JSAMPARRAY input_data, JSAMPARRAY output_data)
+{
+	JDIMENSION output_cols = compptr->width_in_blocks * DCTSIZE;
+	expand_right_edge(input_data, cinfo->max_v_samp_factor, cinfo->image_width, output_cols * 2);
+
+	v128_t bias = wasm_i16x8_make(1, 2, 1, 2, 1, 2, 1, 2);
+
+	for (int row = 0; row < compptr->v_samp_factor; row++)
+	{
+		JSAMPROW in0 = input_data[row * 2];
+		JSAMPROW in1 = input_data[row * 2 + 1];
+		JSAMPROW out = output_data[row];
+
+		for (JDIMENSION col = 0; col < output_cols; col += 8)
+		{
+			v128_t s0 = wasm_u16x8_extadd_pairwise_u8x16(wasm_v128_load(in0 + col * 2));
+			v128_t s1 = wasm_u16x8_extadd_pairwise_u8x16(wasm_v128_load(in1 + col * 2));
+			v128_t sum = wasm_i16x8_add(wasm_i16x8_add(s0, s1), bias);
+			sum = wasm_u16x8_shr(sum, 2);
+			wasm_v128_store64_lane(out + col, wasm_u8x16_narrow_i16x8(sum, sum), 0);
+		}
+	}
+}
+
+GLOBAL(void)
+jsimd_h2v2_smooth_downsample(j_compress_ptr cinfo, jpeg_component_info *compptr,
+							 JSAMPARRAY input_data, JSAMPARRAY output_data)
+{
+}
+
+/* ============================== Upsampling ============================== */
+
+GLOBAL(int)
+jsimd_can_h2v2_upsample(void)
+{
+	return simd_supported();
+}
+
+GLOBAL(int)
+jsimd_can_h2v1_upsample(void)
+{
+	return simd_supported();
+}
+
+GLOBAL(int)
+jsimd_can_int_upsample(void)
+{
+	return 0;
+}
+
+/* Duplicate each sample horizontally, writes `output_width` rounded up to even. */
+static void h2_upsample_row(JSAMPROW in, JSAMPROW out, JDIMENSION output_width)
+{
+	JDIMENSION col = 0;
+	for (; (col + 16) * 2 <= output_width; col += 16)
+	{
+		v128_t v = wasm_v128_load(in + col);
+		wasm_v128_store(out + col * 2, wasm_i8x16_shuffle(v, v, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6, 7, 7));
+		wasm_v128_store(out + col * 2 + 16, wasm_i8x16_shuffle(v, v, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13, 14, 14, 15, 15));
+	}
+	for (; col * 2 < output_width; col++)
+	{
+		out[col * 2] = out[col * 2 + 1] = in[col];
+	}
+}
+
+GLOBAL(void)
+jsimd_h2v1_upsample(j_decompress_ptr cinfo, jpeg_component_info *compptr,
+					JSAMPARRAY input_data, JSAMPARRAY *output_data_ptr)
+{
+	JSAMPARRAY output_data = *output_data_ptr;
+	for (int row = 0; row < cinfo->max_v_samp_factor; row++)
+	{
+		h2_upsample_row(input_data[row], output_data[row], cinfo->output_width);
+	}
+}
+
+GLOBAL(void)
+jsimd_h2v2_upsample(j_decompress_ptr cinfo, jpeg_component_info *compptr,
+					JSAMPARRAY input_data, JSAMPARRAY *output_data_ptr)
+{
+	JSAMPARRAY output_data = *output_data_ptr;
+	for (int row = 0; row < cinfo->max_v_samp_factor; row += 2)
+	{
+		h2_upsample_row(input_data[row / 2], output_data[row], cinfo->output_width);
+		jcopy_sample_rows(output_data, row, output_data, row + 1, 1, cinfo->output_width);
+	}
+}
+
+GLOBAL(void)
+jsimd_int_upsample(j_decompress_ptr cinfo, jpeg_component_info *compptr,
+				   JSAMPARRAY input_data, JSAMPARRAY *output_data_ptr)
+{
+}
+
+GLOBAL(int)
+jsimd_can_h2v2_fancy_upsample(void)
+{
+	return simd_supported();
+}
+
+GLOBAL(int)
+jsimd_can_h2v1_fancy_upsample(void)
+{
+	return simd_supported();
+}
+
+GLOBAL(int)
+jsimd_can_h1v2_fancy_upsample(void)
+{
+	return 0;
+}
+
+/*
+ * Triangle filter, each output sample is 3/4 of the nearer input sample plus 1/4
+ * of the further. The samples beyond the edges are treated as duplicates of the
+ * edge samples, which gives the same result as the special cases in jdsample.c
+ */
+GLOBAL(void)
+jsimd_h2v1_fancy_upsample(j_decompress_ptr cinfo, jpeg_component_info *compptr,
+						  JSAMPARRAY input_data, JSAMPARRAY *output_data_ptr)
+{
+	JSAMPARRAY output_data = *output_data_ptr;
+	JDIMENSION width = compptr->downsampled_width;
+	v128_t one = wasm_i16x8_splat(1);
+	v128_t two = wasm_i16x8_splat(2);
+
+	for (int row = 0; row < cinfo->max_v_samp_factor; row++)
+	{
+		JSAMPROW in = input_data[row];
+		JSAMPROW out = output_data[row];
+		JDIMENSION col = 0;
+
+		// The first sample needs its left neighbor duplicated.
+		out[0] = in[0];
+		out[1] = (JSAMPLE)((in[0] * 3 + in[width > 1] + 2) >> 2);
+		col = 1;
+
+		for (; col + 9 <= width; col += 8)
+		{
+			v128_t prev = wasm_u16x8_extend_low_u8x16(wasm_v128_load64_zero(in + col - 1));
+			v128_t cur = wasm_u16x8_extend_low_u8x16(wasm_v128_load64_zero(in + col));
+			v128_t next = wasm_u16x8_extend_low_u8x16(wasm_v128_load64_zero(in + col + 1));
+			v128_t cur3 = wasm_i16x8_mul(cur, wasm_i16x8_splat(3));
+
+			v128_t even = wasm_u16x8_shr(wasm_i16x8_add(wasm_i16x8_add(cur3, prev), one), 2);
+			v128_t odd = wasm_u16x8_shr(wasm_i16x8_add(wasm_i16x8_add(cur3, next), two), 2);
+			even = wasm_u8x16_narrow_i16x8(even, even);
+			odd = wasm_u8x16_narrow_i16x8(odd, odd);
+
+			wasm_v128_store(out + col * 2, wasm_i8x16_shuffle(even, odd, 0, 16, 1, 17, 2, 18, 3, 19, 4, 20, 5, 21, 6, 22, 7, 23));
+		}
+
+		for (; col < width; col++)
+		{
+			int cur = in[col] * 3;
+			int next = in[col + 1 < width ? col + 1 : col];
+			out[col * 2] = (JSAMPLE)((cur + in[col - 1] + 1) >> 2);
+			out[col * 2 + 1] = (JSAMPLE)((cur + next + 2) >> 2);
+		}
+	}
+}
+
+/*
+ * Same as above in both directions, the vertical neighbor is the row above for
+ * the upper output row, and the row below for the lower, the context rows are
+ * provided by the main controller.
+ */
+GLOBAL(void)
+jsimd_h2v2_fancy_upsample(j_decompress_ptr cinfo, jpeg_component_info *compptr,
+						  JSAMPARRAY input_data, JSAMPARRAY *output_data_ptr)
+{
+	JSAMPARRAY output_data = *output_data_ptr;
+	JDIMENSION width = compptr->downsampled_width;
+	v128_t three = wasm_i16x8_splat(3);
+	v128_t seven = wasm_i16x8_splat(7);
+	v128_t eight = wasm_i16x8_splat(8);
+
+	for (int inrow = 0, outrow = 0; outrow < cinfo->max_v_samp_factor; inrow++)
+	{
+		for (int v = 0; v < 2; v++, outrow++)
+		{
+			JSAMPROW in0 = input_data[inrow];
+			JSAMPROW in1 = input_data[v == 0 ? inrow - 1 : inrow + 1];
+			JSAMPROW out = output_data[outrow];
+
+#define COLSUM(i) (in0[i] * 3 + in1[i])
+
+			int this_sum = COLSUM(0);
+			int next_sum = width > 1 ? COLSUM(1) : this_sum;
+			out[0] = (JSAMPLE)((this_sum * 4 + 8) >> 4);
+			out[1] = (JSAMPLE)((this_sum * 3 + next_sum + 7) >> 4);
+
+			JDIMENSION col = 1;
+			for (; col + 9 <= width; col += 8)
+			{
+				v128_t sums[3];
+				for (int k = 0; k < 3; k++)
+				{
+					v128_t a = wasm_u16x8_extend_low_u8x16(wasm_v128_load64_zero(in0 + col - 1 + k));
+					v128_t b = wasm_u16x8_extend_low_u8x16(wasm_v128_load64_zero(in1 + col - 1 + k));
+					sums[k] = wasm_i16x8_add(wasm_i16x8_mul(a, three), b);
+				}
+				v128_t cur3 = wasm_i16x8_mul(sums[1], three);
+
+				v128_t even = wasm_u16x8_shr(wasm_i16x8_add(wasm_i16x8_add(cur3, sums[0]), eight), 4);
+				v128_t odd = wasm_u16x8_shr(wasm_i16x8_add(wasm_i16x8_add(cur3, sums[2]), seven), 4);
+				even = wasm_u8x16_narrow_i16x8(even, even);
+				odd = wasm_u8x16_narrow_i16x8(odd, odd);
+
+				wasm_v128_store(out + col * 2, wasm_i8x16_shuffle(even, odd, 0, 16, 1, 17, 2, 18, 3, 19, 4, 20, 5, 21, 6, 22, 7, 23));
+			}
+
+			for (; col < width; col++)
+			{
+				int last_sum = COLSUM(col - 1);
+				this_sum = COLSUM(col);
+				next_sum = col + 1 < width ? COLSUM(col + 1) : this_sum;
+				out[col * 2] = (JSAMPLE)((this_sum * 3 + last_sum + 8) >> 4);
+				out[col * 2 + 1] = (JSAMPLE)((this_sum * 3 + next_sum + 7) >> 4);
+			}
+
+#undef COLSUM
+		}
+	}
+}
+
+GLOBAL(void)
+jsimd_h1v2_fancy_upsample(j_decompress_ptr cinfo, jpeg_component_info *compptr,
+						  JSAMPARRAY input_data, JSAMPARRAY *output_data_ptr)
+{
+}
+
+GLOBAL(int)
+jsimd_can_h2v2_merged_upsample(void)
+{
+	return 0;
+}
+
+GLOBAL(int)
+jsimd_can_h2v1_merged_upsample(void)
+{
+	return 0;
+}
+
+GLOBAL(void)
+jsimd_h2v2_merged_upsample(j_decompress_ptr cinfo, JSAMPIMAGE input_buf,
+						   JDIMENSION in_row_group_ctr, JSAMPARRAY output_buf)
+{
+}
+
+GLOBAL(void)
+jsimd_h2v1_merged_upsample(j_decompress_ptr cinfo, JSAMPIMAGE input_buf,
+						   JDIMENSION in_row_group_ctr, JSAMPARRAY output_buf)
+{
+}
+
+/* ============================== DCT ============================== */
+
+/*
+ * The 8x8 block is held in 16 vectors, `m[i][h]` contains elements
+ * [i][h * 4 .. h * 4 + 3], so a 1-D transform on `m[0..7][h]`
+ * processes 4 lines in parallel.
+ */
+typedef v128_t block_t[8][2];
+
+static inline void transpose4x4(v128_t *a, v128_t *b, v128_t *c, v128_t *d)
+{
+	v128_t t0 = wasm_i32x4_shuffle(*a, *b, 0, 4, 1, 5);
+	v128_t t1 = wasm_i32x4_shuffle(*a, *b, 2, 6, 3, 7);
+	v128_t t2 = wasm_i32x4_shuffle(*c, *d, 0, 4, 1, 5);
+	v128_t t3 = wasm_i32x4_shuffle(*c, *d, 2, 6, 3, 7);
+	*a = wasm_i64x2_shuffle(t0, t2, 0, 2);
+	*b = wasm_i64x2_shuffle(t0, t2, 1, 3);
+	*c = wasm_i64x2_shuffle(t1, t3, 0, 2);
+	*d = wasm_i64x2_shuffle(t1, t3, 1, 3);
+}
+
+static void transpose8x8(block_t m)
+{
+	for (int h = 0; h < 2; h++)
+	{
+		transpose4x4(&m[h * 4][h], &m[h * 4 + 1][h], &m[h * 4 + 2][h], &m[h * 4 + 3][h]);
+	}
+	transpose4x4(&m[0][1], &m[1][1], &m[2][1], &m[3][1]);
+	transpose4x4(&m[4][0], &m[5][0], &m[6][0], &m[7][0]);
+
+	// Swap the off-diagonal 4x4 blocks.
+	for (int i = 0; i < 4; i++)
+	{
+		v128_t t = m[i][1];
+		m[i][1] = m[i + 4][0];
+		m[i + 4][0] = t;
+	}
+}
+
+/* 1-D forward DCT of jfdctint.c, `last` selects the descaling of pass 2. */
+static void fdct_islow_1d(v128_t d[8], int last)
+{
+	v128_t tmp0 = wasm_i32x4_add(d[0], d[7]);
+	v128_t tmp7 = wasm_i32x4_sub(d[0], d[7]);
+	v128_t tmp1 = wasm_i32x4_add(d[1], d[6]);
+	v128_t tmp6 = wasm_i32x4_sub(d[1], d[6]);
+	v128_t tmp2 = wasm_i32x4_add(d[2], d[5]);
+	v128_t tmp5 = wasm_i32x4_sub(d[2], d[5]);
+	v128_t tmp3 = wasm_i32x4_add(d[3], d[4]);
+	v128_t tmp4 = wasm_i32x4_sub(d[3], d[4]);
+
+	v128_t tmp10 = wasm_i32x4_add(tmp0, tmp3);
+	v128_t tmp13 = wasm_i32x4_sub(tmp0, tmp3);
+	v128_t tmp11 = wasm_i32x4_add(tmp1, tmp2);
+	v128_t tmp12 = wasm_i32x4_sub(tmp1, tmp2);
+
+	int shift = last ? CONST_BITS + PASS1_BITS : CONST_BITS - PASS1_BITS;
+
+	if (last)
+	{
+		d[0] = DESCALE(wasm_i32x4_add(tmp10, tmp11), PASS1_BITS);
+		d[4] = DESCALE(wasm_i32x4_sub(tmp10, tmp11), PASS1_BITS);
+	}
+	else
+	{
+		d[0] = wasm_i32x4_shl(wasm_i32x4_add(tmp10, tmp11), PASS1_BITS);
+		d[4] = wasm_i32x4_shl(wasm_i32x4_sub(tmp10, tmp11), PASS1_BITS);
+	}
+
+	v128_t z1 = MUL(wasm_i32x4_add(tmp12, tmp13), FIX_0_541196100);
+	d[2] = DESCALE(wasm_i32x4_add(z1, MUL(tmp13, FIX_0_765366865)), shift);
+	d[6] = DESCALE(wasm_i32x4_add(z1, MUL(tmp12, -FIX_1_847759065)), shift);
+
+	z1 = wasm_i32x4_add(tmp4, tmp7);
+	v128_t z2 = wasm_i32x4_add(tmp5, tmp6);
+	v128_t z3 = wasm_i32x4_add(tmp4, tmp6);
+	v128_t z4 = wasm_i32x4_add(tmp5, tmp7);
+	v128_t z5 = MUL(wasm_i32x4_add(z3, z4), FIX_1_175875602);
+
+	tmp4 = MUL(tmp4, FIX_0_298631336);
+	tmp5 = MUL(tmp5, FIX_2_053119869);
+	tmp6 = MUL(tmp6, FIX_3_072711026);
+	tmp7 = MUL(tmp7, FIX_1_501321110);
+	z1 = MUL(z1, -FIX_0_899976223);
+	z2 = MUL(z2, -FIX_2_562915447);
+	z3 = wasm_i32x4_add(MUL(z3, -FIX_1_961570560), z5);
+	z4 = wasm_i32x4_add(MUL(z4, -FIX_0_390180644), z5);
+
+	d[7] = DESCALE(wasm_i32x4_add(tmp4, wasm_i32x4_add(z1, z3)), shift);
+	d[5] = DESCALE(wasm_i32x4_add(tmp5, wasm_i32x4_add(z2, z4)), shift);
+	d[3] = DESCALE(wasm_i32x4_add(tmp6, wasm_i32x4_add(z2, z3)), shift);
+	d[1] = DESCALE(wasm_i32x4_add(tmp7, wasm_i32x4_add(z1, z4)), shift);
+}
+
+/* 1-D inverse DCT of jidctint.c, `last` selects the descaling of pass 2. */
+static void idct_islow_1d(v128_t d[8], int last)
+{
+	v128_t z1 = MUL(wasm_i32x4_add(d[2], d[6]), FIX_0_541196100);
+	v128_t tmp2 = wasm_i32x4_add(z1, MUL(d[6], -FIX_1_847759065));
+	v128_t tmp3 = wasm_i32x4_add(z1, MUL(d[2], FIX_0_765366865));
+
+	v128_t tmp0 = wasm_i32x4_shl(wasm_i32x4_add(d[0], d[4]), CONST_BITS);
+	v128_t tmp1 = wasm_i32x4_shl(wasm_i32x4_sub(d[0], d[4]), CONST_BITS);
+
+	v128_t tmp10 = wasm_i32x4_add(tmp0, tmp3);
+	v128_t tmp13 = wasm_i32x4_sub(tmp0, tmp3);
+	v128_t tmp11 = wasm_i32x4_add(tmp1, tmp2);
+	v128_t tmp12 = wasm_i32x4_sub(tmp1, tmp2);
+
+	tmp0 = d[7];
+	tmp1 = d[5];
+	tmp2 = d[3];
+	tmp3 = d[1];
+
+	z1 = wasm_i32x4_add(tmp0, tmp3);
+	v128_t z2 = wasm_i32x4_add(tmp1, tmp2);
+	v128_t z3 = wasm_i32x4_add(tmp0, tmp2);
+	v128_t z4 = wasm_i32x4_add(tmp1, tmp3);
+	v128_t z5 = MUL(wasm_i32x4_add(z3, z4), FIX_1_175875602);
+
+	tmp0 = MUL(tmp0, FIX_0_298631336);
+	tmp1 = MUL(tmp1, FIX_2_053119869);
+	tmp2 = MUL(tmp2, FIX_3_072711026);
+	tmp3 = MUL(tmp3, FIX_1_501321110);
+	z1 = MUL(z1, -FIX_0_899976223);
+	z2 = MUL(z2, -FIX_2_562915447);
+	z3 = wasm_i32x4_add(MUL(z3, -FIX_1_961570560), z5);
+	z4 = wasm_i32x4_add(MUL(z4, -FIX_0_390180644), z5);
+
+	tmp0 = wasm_i32x4_add(tmp0, wasm_i32x4_add(z1, z3));
+	tmp1 = wasm_i32x4_add(tmp1, wasm_i32x4_add(z2, z4));
+	tmp2 = wasm_i32x4_add(tmp2, wasm_i32x4_add(z2, z3));
+	tmp3 = wasm_i32x4_add(tmp3, wasm_i32x4_add(z1, z4));
+
+	int shift = last ? CONST_BITS + PASS1_BITS + 3 : CONST_BITS - PASS1_BITS;
+
+	d[0] = DESCALE(wasm_i32x4_add(tmp10, tmp3), shift);
+	d[7] = DESCALE(wasm_i32x4_sub(tmp10, tmp3), shift);
+	d[1] = DESCALE(wasm_i32x4_add(tmp11, tmp2), shift);
+	d[6] = DESCALE(wasm_i32x4_sub(tmp11, tmp2), shift);
+	d[2] = DESCALE(wasm_i32x4_add(tmp12, tmp1), shift);
+	d[5] = DESCALE(wasm_i32x4_sub(tmp12, tmp1), shift);
+	d[3] = DESCALE(wasm_i32x4_add(tmp13, tmp0), shift);
+	d[4] = DESCALE(wasm_i32x4_sub(tmp13, tmp0), shift);
+}
+
+/* Run the 1-D transform on both halves of the block. */
+#define TRANSFORM_1D(fn, m, last)              \
+	for (int h = 0; h < 2; h++)                \
+	{                                          \
+		v128_t d[8];                           \
+		for (int i = 0; i < 8; i++)            \
+			d[i] = m[i][h];                    \
+		fn(d, last);                           \
+		for (int i = 0; i < 8; i++)            \
+			m[i][h] = d[i];                    \
+	}
+
+/*
+ * Type of DCTELEM and ISLOW_MULT_TYPE depends on WITH_SIMD, which is
+ * not defined in our build, handle both 16-bit and 32-bit variants.
+ */
+#define LOAD_I32X4(p) (sizeof(*(p)) == 4 \
+	? wasm_v128_load(p)                  \
+	: wasm_i32x4_extend_low_i16x8(wasm_v128_load64_zero(p)))
+
+#define STORE_I32X4(p, v)                                           \
+	do                                                              \
+	{                                                               \
+		if (sizeof(*(p)) == 4)                                      \
+			wasm_v128_store(p, v);                                  \
+		else                                                        \
+			wasm_v128_store64_lane(p, wasm_i16x8_narrow_i32x4(v, v), 0); \
+	} while (0)
+
+GLOBAL(int)
+jsimd_can_convsamp(void)
+{
+	return simd_supported();
+}
+
+GLOBAL(int)
+jsimd_can_convsamp_float(void)
+{
+	return 0;
+}
+
+GLOBAL(void)
+jsimd_convsamp(JSAMPARRAY sample_data, JDIMENSION start_col,
+			   DCTELEM *workspace)
+{
+	v128_t center = SPLAT(CENTERJSAMPLE);
+	for (int row = 0; row < DCTSIZE; row++)
+	{
+		v128_t lo, hi;
+		load_u8x8(sample_data[row] + start_col, &lo, &hi);
+		STORE_I32X4(workspace + row * DCTSIZE, wasm_i32x4_sub(lo, center));
+		STORE_I32X4(workspace + row * DCTSIZE + 4, wasm_i32x4_sub(hi, center));
+	}
+}
+
+GLOBAL(void)
+jsimd_convsamp_float(JSAMPARRAY sample_data, JDIMENSION start_col,
+					 FAST_FLOAT *workspace)
+{
+}
+
+GLOBAL(int)
+jsimd_can_fdct_islow(void)
+{
+	return simd_supported();
+}
+
+GLOBAL(int)
+jsimd_can_fdct_ifast(void)
+{
+	return 0;
+}
+
+GLOBAL(int)
+jsimd_can_fdct_float(void)
+{
+	return 0;
+}
+
+GLOBAL(void)
+jsimd_fdct_islow(DCTELEM *data)
+{
+	block_t m;
+	for (int i = 0; i < 8; i++)
+	{
+		m[i][0] = LOAD_I32X4(data + i * DCTSIZE);
+		m[i][1] = LOAD_I32X4(data + i * DCTSIZE + 4);
+	}
+
+	// Pass 1: process rows, `m[i]` becomes column i.
+	transpose8x8(m);
+	TRANSFORM_1D(fdct_islow_1d, m, 0);
+
+	// Pass 2: process columns.
+	transpose8x8(m);
+	TRANSFORM_1D(fdct_islow_1d, m, 1);
+
+	for (int i = 0; i < 8; i++)
+	{
+		STORE_I32X4(data + i * DCTSIZE, m[i][0]);
+		STORE_I32X4(data + i * DCTSIZE + 4, m[i][1]);
+	}
+}
+
+GLOBAL(void)
+jsimd_fdct_ifast(DCTELEM *data)
+{
+}
+
+GLOBAL(void)
+jsimd_fdct_float(FAST_FLOAT *data)
+{
+}
+
+GLOBAL(int)
+jsimd_can_quantize(void)
+{
+	return 0;
+}
+
+GLOBAL(int)
+jsimd_can_quantize_float(void)
+{
+	return 0;
+}
+
+GLOBAL(void)
+jsimd_quantize(JCOEFPTR coef_block, DCTELEM *divisors, DCTELEM *workspace)
+{
+}
+
+GLOBAL(void)
+jsimd_quantize_float(JCOEFPTR coef_block, FAST_FLOAT *divisors,
+					 FAST_FLOAT *workspace)
+{
+}
+
+GLOBAL(int)
+jsimd_can_idct_2x2(void)
+{
+	return 0;
+}
+
+GLOBAL(int)
+jsimd_can_idct_4x4(void)
+{
+	return 0;
+}
+
+GLOBAL(int)
+jsimd_can_idct_6x6(void)
+{
+	return 0;
+}
+
+GLOBAL(int)
+jsimd_can_idct_12x12(void)
+{
+	return 0;
+}
+
+GLOBAL(void)
+jsimd_idct_2x2(j_decompress_ptr cinfo, jpeg_component_info *compptr,
+			   JCOEFPTR coef_block, JSAMPARRAY output_buf,
+			   JDIMENSION output_col)
+{
+}
+
+GLOBAL(void)
+jsimd_idct_4x4(j_decompress_ptr cinfo, jpeg_component_info *compptr,
+			   JCOEFPTR coef_block, JSAMPARRAY output_buf,
+			   JDIMENSION output_col)
+{
+}
+
+GLOBAL(void)
+jsimd_idct_6x6(j_decompress_ptr cinfo, jpeg_component_info *compptr,
+			   JCOEFPTR coef_block, JSAMPARRAY output_buf,
+			   JDIMENSION output_col)
+{
+}
+
+GLOBAL(void)
+jsimd_idct_12x12(j_decompress_ptr cinfo, jpeg_component_info *compptr,
+				 JCOEFPTR coef_block, JSAMPARRAY output_buf,
+				 JDIMENSION output_col)
+{
+}
+
+GLOBAL(int)
+jsimd_can_idct_islow(void)
+{
+	return simd_supported();
+}
+
+GLOBAL(int)
+jsimd_can_idct_ifast(void)
+{
+	return 0;
+}
+
+GLOBAL(int)
+jsimd_can_idct_float(void)
+{
+	return 0;
+}
+
+GLOBAL(void)
+jsimd_idct_islow(j_decompress_ptr cinfo, jpeg_component_info *compptr,
+				 JCOEFPTR coef_block, JSAMPARRAY output_buf,
+				 JDIMENSION output_col)
+{
+	ISLOW_MULT_TYPE *quant = (ISLOW_MULT_TYPE *)compptr->dct_table;
+	block_t m;
+
+	// Dequantize, coefficients are 16-bit.
+	for (int i = 0; i < 8; i++)
+	{
+		v128_t c = wasm_v128_load(coef_block + i * DCTSIZE);
+		v128_t lo = wasm_i32x4_extend_low_i16x8(c);
+		v128_t hi = wasm_i32x4_extend_high_i16x8(c);
+		m[i][0] = wasm_i32x4_mul(lo, LOAD_I32X4(quant + i * DCTSIZE));
+		m[i][1] = wasm_i32x4_mul(hi, LOAD_I32X4(quant + i * DCTSIZE + 4));
+	}
+
+	// Pass 1: process columns.
+	TRANSFORM_1D(idct_islow_1d, m, 0);
+
+	// Pass 2: process rows, then transpose back to rows.
+	transpose8x8(m);
+	TRANSFORM_1D(idct_islow_1d, m, 1);
+	transpose8x8(m);
+
+	v128_t center = SPLAT(CENTERJSAMPLE);
+	for (int i = 0; i < 8; i++)
+	{
+		v128_t lo = wasm_i32x4_add(m[i][0], center);
+		v128_t hi = wasm_i32x4_add(m[i][1], center);
+		wasm_v128_store64_lane(output_buf[i] + output_col, pack_u8x8(lo, hi), 0);
+	}
+}
+
+GLOBAL(void)
+jsimd_idct_ifast(j_decompress_ptr cinfo, jpeg_component_info *compptr,
+				 JCOEFPTR coef_block, JSAMPARRAY output_buf,
+				 JDIMENSION output_col)
+{
+}
+
+GLOBAL(void)
+jsimd_idct_float(j_decompress_ptr cinfo, jpeg_component_info *compptr,
+				 JCOEFPTR coef_block, JSAMPARRAY output_buf,
+				 JDIMENSION output_col)
+{
+}
+
+/* ============================== Entropy Coding ============================== */
+
+GLOBAL(int)
+jsimd_can_huff_encode_one_block(void)
+{
+	return 0;
+}
+
+GLOBAL(JOCTET *)
+jsimd_huff_encode_one_block(void *state, JOCTET *buffer, JCOEFPTR block,
+							int last_dc_val, c_derived_tbl *dctbl,
+							c_derived_tbl *actbl)
+{
+	return NULL;
+}
+
+GLOBAL(int)
+jsimd_can_encode_mcu_AC_first_prepare(void)
+{
+	return 0;
+}
+
+GLOBAL(void)
+jsimd_encode_mcu_AC_first_prepare(const JCOEF *block,
+								  const int *jpeg_natural_order_start, int Sl,
+								  int Al, JCOEF *values, size_t *zerobits)
+{
+}
+
+GLOBAL(int)
+jsimd_can_encode_mcu_AC_refine_prepare(void)
+{
+	return 0;
+}
+
+GLOBAL(int)
+jsimd_encode_mcu_AC_refine_prepare(const JCOEF *block,
+								   const int *jpeg_natural_order_start, int Sl,
+								   int Al, JCOEF *absvalues, size_t *bits)
+{
+	return 0;
+}
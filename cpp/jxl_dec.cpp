@@ -1,11 +1,18 @@
+#include <algorithm>
+#include <cstring>
+#include <vector>
 #include <emscripten/bind.h>
 #include <jxl/decode_cxx.h>
+#include <jxl/parallel_runner.h>
 #include "icodec.h"
 
-#define PROCESS_NEXT_STEP(event)                        \
-	if (JxlDecoderProcessInput(decoder.get()) != event) \
-	{                                                   \
-		return val(#event);                             \
+namespace
+{
+
+#define PROCESS_NEXT_STEP(event)                   \
+	if (processInput(decoder, input) != event) \
+	{                                          \
+		return val(#event);                    \
 	}
 
 #define CHECK_STATUS(s)       \
@@ -14,46 +21,245 @@
 		return val::null();   \
 	}
 
-val decode(std::string input)
+/*
+ * Run tasks of the decoder on the current thread, and stop if cancelled.
+ * See the same function in jxl_enc.cpp.
+ */
+JxlParallelRetCode CancellableRunner(
+	void *runner_opaque, void *jpegxl_opaque,
+	JxlParallelRunInit init, JxlParallelRunFunction func,
+	uint32_t start_range, uint32_t end_range)
 {
-	static const int EVENTS = JXL_DEC_BASIC_INFO | JXL_DEC_FULL_IMAGE;
+	auto progress = reinterpret_cast<Progress *>(runner_opaque);
+	auto ret = init(jpegxl_opaque, 1);
+	if (ret != JXL_PARALLEL_RET_SUCCESS)
+	{
+		return ret;
+	}
+	for (auto i = start_range; i < end_range; i++)
+	{
+		if (!progress->check())
+		{
+			return JXL_PARALLEL_RET_RUNNER_ERROR;
+		}
+		func(jpegxl_opaque, i, 0);
+	}
+	return JXL_PARALLEL_RET_SUCCESS;
+}
 
-	// 1. Create a decoder instance and set event filter.
-	auto decoder = JxlDecoderMake(nullptr);
-	CHECK_STATUS(JxlDecoderSubscribeEvents(decoder.get(), EVENTS));
+/*
+ * libjxl has no API to decode a part of the image, so we receive pixels by
+ * a callback and only keep the region, the full frame buffer is not needed.
+ */
+struct RegionWriter
+{
+	Region region;
+	size_t pixelSize;
+	std::unique_ptr<uint8_t[]> output;
 
-	// 2. Set input.
-	auto bytes = reinterpret_cast<uint8_t *>(input.data());
-	JxlDecoderSetInput(decoder.get(), bytes, input.size());
+	static void write(void *opaque, size_t x, size_t y, size_t numPixels, const void *pixels)
+	{
+		auto self = reinterpret_cast<RegionWriter *>(opaque);
+		auto &r = self->region;
+		if (y < r.y || y >= r.y + r.height)
+		{
+			return;
+		}
+		auto start = std::max<size_t>(x, r.x);
+		auto end = std::min<size_t>(x + numPixels, r.x + r.width);
+		if (start >= end)
+		{
+			return;
+		}
+		auto src = reinterpret_cast<const uint8_t *>(pixels) + (start - x) * self->pixelSize;
+		auto offset = ((y - r.y) * r.width + start - r.x) * self->pixelSize;
+		memcpy(&self->output[offset], src, (end - start) * self->pixelSize);
+	}
+};
+
+/*
+ * Feed the decoder from the JS stream source by chunks, unconsumed bytes are
+ * moved to the front of the buffer before reading more. The buffer grows
+ * only if the decoder can't make progress with it full.
+ */
+struct StreamInput
+{
+	val source;
+	std::vector<uint8_t> buffer = std::vector<uint8_t>(65536);
+	size_t length = 0;
+	double position = 0;
+
+	/*
+	 * @return false if reached the end of the stream.
+	 */
+	bool fill(JxlDecoder *decoder)
+	{
+		auto remaining = JxlDecoderReleaseInput(decoder);
+		memmove(buffer.data(), buffer.data() + length - remaining, remaining);
+		if (remaining == buffer.size())
+		{
+			buffer.resize(buffer.size() * 2);
+		}
 
-	// 3. Read metadata.
+		auto n = readChunk(source, buffer.data() + remaining, buffer.size() - remaining, position);
+		position += n;
+		length = remaining + n;
+		JxlDecoderSetInput(decoder, buffer.data(), length);
+
+		if (n == 0)
+		{
+			JxlDecoderCloseInput(decoder);
+		}
+		return n != 0;
+	}
+};
+
+/*
+ * Process until the next event, read more data if the input is a stream.
+ */
+JxlDecoderStatus processInput(JxlDecoder *decoder, StreamInput *input)
+{
+	auto status = JxlDecoderProcessInput(decoder);
+	while (status == JXL_DEC_NEED_MORE_INPUT && input && input->fill(decoder))
+	{
+		status = JxlDecoderProcessInput(decoder);
+	}
+	return status;
+}
+
+/*
+ * Shared by `decode` and `decodeStream`, the input of the decoder must be set,
+ * or `input` is not null. The decoder allocates from the budget, the output
+ * buffer is also counted.
+ */
+val decodeWith(JxlDecoder *decoder, StreamInput *input, val options, MemoryBudget &budget)
+{
+	static const int EVENTS = JXL_DEC_BASIC_INFO | JXL_DEC_FULL_IMAGE;
+	Progress progress(options);
+
+	// 1. Set event filter.
+	CHECK_STATUS(JxlDecoderSubscribeEvents(decoder, EVENTS));
+	CHECK_STATUS(JxlDecoderSetParallelRunner(decoder, CancellableRunner, &progress));
+
+	// 2. Read metadata.
 	PROCESS_NEXT_STEP(JXL_DEC_BASIC_INFO);
 	JxlBasicInfo info;
-	CHECK_STATUS(JxlDecoderGetBasicInfo(decoder.get(), &info));
+	CHECK_STATUS(JxlDecoderGetBasicInfo(decoder, &info));
+
+	if (auto error = Limits(options).check(info.xsize, info.ysize))
+	{
+		return val(error);
+	}
+
+	RegionWriter writer;
+	if (!writer.region.read(options, info.xsize, info.ysize))
+	{
+		return val("Region out of bounds");
+	}
+
+	// libjxl can't output gray for color images, they are decoded as RGB(A)
+	// and converted by JS side, gray images can be output in any format.
+	auto channels = channelsOf(options);
+	if (info.num_color_channels == 3 && channels < 3)
+	{
+		channels += 2;
+	}
 
 	// It seems no need to check JXL_DEC_NEED_IMAGE_OUT_BUFFER
-	// 4. Alloc the output buffer.
-	JxlPixelFormat format = {CHANNELS_RGBA, JXL_TYPE_UINT8, JXL_LITTLE_ENDIAN, 0};
-	size_t length = info.xsize * info.ysize * CHANNELS_RGBA;
+	// 3. Alloc the output buffer.
+	JxlPixelFormat format = {(uint32_t)channels, JXL_TYPE_UINT8, JXL_LITTLE_ENDIAN, 0};
+	writer.pixelSize = channels;
 	if (info.bits_per_sample > 8)
 	{
 		format.data_type = JXL_TYPE_UINT16;
-		length <<= 1;
+		writer.pixelSize <<= 1;
 	}
-	auto output = std::make_unique_for_overwrite<uint8_t[]>(length);
+	auto &region = writer.region;
+	size_t length = (size_t)region.width * region.height * writer.pixelSize;
+	if (!budget.reserve(length))
+	{
+		return val(OUT_OF_BUDGET);
+	}
+	writer.output = std::make_unique_for_overwrite<uint8_t[]>(length);
 
-	// 5. Set output buffer and format.
+	// 4. Set output format and the callback, or the buffer for the whole image.
 	JxlBitDepth outDepth = {JXL_BIT_DEPTH_FROM_CODESTREAM, info.bits_per_sample, 0};
-	CHECK_STATUS(JxlDecoderSetImageOutBuffer(decoder.get(), &format, output.get(), length));
-	CHECK_STATUS(JxlDecoderSetImageOutBitDepth(decoder.get(), &outDepth));
+	if (region.width == info.xsize && region.height == info.ysize)
+	{
+		CHECK_STATUS(JxlDecoderSetImageOutBuffer(decoder, &format, writer.output.get(), length));
+	}
+	else
+	{
+		CHECK_STATUS(JxlDecoderSetImageOutCallback(decoder, &format, RegionWriter::write, &writer));
+	}
+	CHECK_STATUS(JxlDecoderSetImageOutBitDepth(decoder, &outDepth));
 
-	// 6. Read pixels data.
-	PROCESS_NEXT_STEP(JXL_DEC_FULL_IMAGE);
+	// 5. Read pixels data.
+	if (processInput(decoder, input) != JXL_DEC_FULL_IMAGE)
+	{
+		if (budget.exceeded)
+		{
+			return val(OUT_OF_BUDGET);
+		}
+		return val(progress.cancelled() ? CANCELLED : "JXL_DEC_FULL_IMAGE");
+	}
+	progress.update(1);
 
-	return toImageData(output.get(), info.xsize, info.ysize, info.bits_per_sample);
+	return toImageData(writer.output.get(), region.width, region.height, info.bits_per_sample, channels);
+}
+
+val decode(std::string input, val options)
+{
+	MemoryBudget budget(Limits(options).maxMemory);
+	JxlMemoryManager memory{&budget, MemoryBudget::alloc, MemoryBudget::free};
+	auto decoder = JxlDecoderMake(&memory);
+	auto bytes = reinterpret_cast<uint8_t *>(input.data());
+	JxlDecoderSetInput(decoder.get(), bytes, input.size());
+	return decodeWith(decoder.get(), nullptr, options, budget);
+}
+
+/*
+ * Decode from the JS stream source, only a chunk of the file is in memory.
+ *
+ * @param source JS object with size and read(buffer, position).
+ */
+val decodeStream(val source, val options)
+{
+	MemoryBudget budget(Limits(options).maxMemory);
+	JxlMemoryManager memory{&budget, MemoryBudget::alloc, MemoryBudget::free};
+	auto decoder = JxlDecoderMake(&memory);
+	StreamInput input{source};
+	return decodeWith(decoder.get(), &input, options, budget);
+}
+
+val probe(std::string input)
+{
+	auto decoder = JxlDecoderMake(nullptr);
+	CHECK_STATUS(JxlDecoderSubscribeEvents(decoder.get(), JXL_DEC_BASIC_INFO));
+
+	auto bytes = reinterpret_cast<uint8_t *>(input.data());
+	JxlDecoderSetInput(decoder.get(), bytes, input.size());
+	JxlDecoderCloseInput(decoder.get());
+
+	if (JxlDecoderProcessInput(decoder.get()) != JXL_DEC_BASIC_INFO)
+	{
+		return val("JXL_DEC_BASIC_INFO");
+	}
+	JxlBasicInfo info;
+	CHECK_STATUS(JxlDecoderGetBasicInfo(decoder.get(), &info));
+
+	return toImageInfo(info.xsize, info.ysize, info.bits_per_sample);
 }
 
 EMSCRIPTEN_BINDINGS(icodec_module_JXL)
 {
+#ifdef ICODEC_TRANSCODER
+	transcoder::decoder("jxl", &decode);
+#else
 	function("decode", &decode);
+	function("decodeStream", &decodeStream);
+	function("probe", &probe);
+#endif
+}
+
 }
@@ -1,6 +1,12 @@
+#include <algorithm>
+#include <cstring>
 #include <emscripten/bind.h>
 #include "icodec.h"
 #include "jxl/encode_cxx.h"
+#include "jxl/parallel_runner.h"
+
+namespace
+{
 
 #define SET_OPTION(key, value)                                                     \
 	if (JxlEncoderFrameSettingsSetOption(settings, key, value) != JXL_ENC_SUCCESS) \
@@ -16,6 +22,33 @@
 
 #define CHECK_STATUS(s) if (s != JXL_ENC_SUCCESS) { return val::null(); }
 
+/*
+ * libjxl has no progress callback, but it splits the work into tasks through
+ * the parallel runner. This runner executes them on the current thread,
+ * and stops if cancelled, which makes the encoder fail.
+ */
+JxlParallelRetCode CancellableRunner(
+	void *runner_opaque, void *jpegxl_opaque,
+	JxlParallelRunInit init, JxlParallelRunFunction func,
+	uint32_t start_range, uint32_t end_range)
+{
+	auto progress = reinterpret_cast<Progress *>(runner_opaque);
+	auto ret = init(jpegxl_opaque, 1);
+	if (ret != JXL_PARALLEL_RET_SUCCESS)
+	{
+		return ret;
+	}
+	for (auto i = start_range; i < end_range; i++)
+	{
+		if (!progress->check())
+		{
+			return JXL_PARALLEL_RET_RUNNER_ERROR;
+		}
+		func(jpegxl_opaque, i, 0);
+	}
+	return JXL_PARALLEL_RET_SUCCESS;
+}
+
 // https://github.com/libjxl/libjxl/blob/e10fb6858fe9cb506f99b5373f64d6b639fe447d/lib/extras/enc/jxl.cc#L97
 bool ReadCompressedOutput(JxlEncoder *enc, std::vector<uint8_t> *compressed)
 {
@@ -60,14 +93,34 @@ struct JXLOptions
 	float iterations;
 	int modularColorspace;
 	int modularPredictor;
+	bool keepAlpha;
 
 	uint32_t bitDepth;
+	uint32_t channels;
 };
 
-val encode(std::string pixels, uint32_t width, uint32_t height, JXLOptions options)
+JxlPixelFormat pixelFormat(uint32_t bitDepth, uint32_t channels)
 {
-	const JxlEncoderPtr encoder = JxlEncoderMake(nullptr);
-	JxlEncoderAllowExpertOptions(encoder.get());
+	JxlPixelFormat format = {channels, JXL_TYPE_UINT8, JXL_LITTLE_ENDIAN, 0};
+	if (bitDepth > 8)
+	{
+		format.data_type = JXL_TYPE_UINT16;
+	}
+	return format;
+}
+
+/*
+ * Set image info and options, shared by `encode` and `encodeTiled`.
+ *
+ * @return undefined if succeed, otherwise the error.
+ */
+val setupEncoder(JxlEncoder *encoder, JXLOptions &options, uint32_t width, uint32_t height, JxlEncoderFrameSettings **out)
+{
+	JxlEncoderAllowExpertOptions(encoder);
+
+	// Gray and opaque input are stored without the unused channels.
+	auto gray = options.channels < 3;
+	auto alpha = options.channels % 2 == 0;
 
 	JxlBasicInfo info;
 	JxlEncoderInitBasicInfo(&info);
@@ -75,14 +128,15 @@ val encode(std::string pixels, uint32_t width, uint32_t height, JXLOptions optio
 	info.xsize = width;
 	info.ysize = height;
 	info.bits_per_sample = options.bitDepth;
-	info.num_extra_channels = 1;
-	CHECK_STATUS(JxlEncoderSetBasicInfo(encoder.get(), &info));
+	info.num_color_channels = gray ? 1 : 3;
+	info.num_extra_channels = alpha ? 1 : 0;
+	CHECK_STATUS(JxlEncoderSetBasicInfo(encoder, &info));
 
 	JxlColorEncoding color_encoding = {};
-	JxlColorEncodingSetToSRGB(&color_encoding, JXL_FALSE);
-	CHECK_STATUS(JxlEncoderSetColorEncoding(encoder.get(), &color_encoding));
+	JxlColorEncodingSetToSRGB(&color_encoding, gray);
+	CHECK_STATUS(JxlEncoderSetColorEncoding(encoder, &color_encoding));
 
-	auto settings = JxlEncoderFrameSettingsCreate(encoder.get(), nullptr);
+	auto settings = *out = JxlEncoderFrameSettingsCreate(encoder, nullptr);
 	if (options.lossless)
 	{
 		CHECK_STATUS(JxlEncoderSetFrameLossless(settings, JXL_TRUE));
@@ -92,8 +146,11 @@ val encode(std::string pixels, uint32_t width, uint32_t height, JXLOptions optio
 		auto distance = JxlEncoderDistanceFromQuality(options.quality);
 		CHECK_STATUS(JxlEncoderSetFrameDistance(settings, distance));
 
-		distance = JxlEncoderDistanceFromQuality(options.alphaQuality);
-		CHECK_STATUS(JxlEncoderSetExtraChannelDistance(settings, 0, distance));
+		if (alpha)
+		{
+			distance = JxlEncoderDistanceFromQuality(options.alphaQuality);
+			CHECK_STATUS(JxlEncoderSetExtraChannelDistance(settings, 0, distance));
+		}
 	}
 	SET_FLOAT_OPTION(JXL_ENC_FRAME_SETTING_PHOTON_NOISE, options.photonNoiseIso);
 	SET_OPTION(JXL_ENC_FRAME_SETTING_EFFORT, options.effort);
@@ -117,25 +174,427 @@ val encode(std::string pixels, uint32_t width, uint32_t height, JXLOptions optio
 	JxlBitDepth inputDepth = {JXL_BIT_DEPTH_FROM_CODESTREAM, info.bits_per_sample, 0};
 	CHECK_STATUS(JxlEncoderSetFrameBitDepth(settings, &inputDepth));
 
-	JxlPixelFormat format = {CHANNELS_RGBA, JXL_TYPE_UINT8, JXL_LITTLE_ENDIAN, 0};
-	if (info.bits_per_sample > 8)
+	return val::undefined();
+}
+
+/*
+ * Output processor that sends encoded data to the JS sink once a buffer
+ * is released. It can't seek, libjxl keeps the part that will be changed
+ * (e.g. the TOC) until it's finalized.
+ */
+struct SinkOutput
+{
+	val sink;
+	std::vector<uint8_t> buffer;
+	double written = 0;
+
+	static void *getBuffer(void *opaque, size_t *size)
 	{
-		format.data_type = JXL_TYPE_UINT16;
+		auto self = reinterpret_cast<SinkOutput *>(opaque);
+		*size = std::max<size_t>(*size, 65536);
+		if (self->buffer.size() < *size)
+		{
+			self->buffer.resize(*size);
+		}
+		return self->buffer.data();
+	}
+
+	static void releaseBuffer(void *opaque, size_t written)
+	{
+		auto self = reinterpret_cast<SinkOutput *>(opaque);
+		writeChunk(self->sink, self->buffer.data(), written);
+		self->written += written;
+	}
+
+	static void setFinalizedPosition(void *opaque, uint64_t position) {}
+};
+
+/*
+ * If `control.sink` is set, the output is written to it by chunks,
+ * and returns the number of bytes written.
+ */
+val encode(std::string pixels, uint32_t width, uint32_t height, JXLOptions options, val control)
+{
+	Progress progress(control);
+	Limits limits(control);
+	if (auto error = limits.check(width, height))
+	{
+		return val(error);
+	}
+	MemoryBudget budget(limits.maxMemory);
+	JxlMemoryManager memory{&budget, MemoryBudget::alloc, MemoryBudget::free};
+	const JxlEncoderPtr encoder = JxlEncoderMake(&memory);
+	CHECK_STATUS(JxlEncoderSetParallelRunner(encoder.get(), CancellableRunner, &progress));
+
+	// Pixels are owned by us, the alpha can be removed in place.
+	if (!options.keepAlpha)
+	{
+		auto rgba = reinterpret_cast<uint8_t *>(pixels.data());
+		options.channels = dropOpaqueAlpha(rgba, (size_t)width * height, options.bitDepth, options.channels);
+		pixels.resize((size_t)width * height * options.channels * (options.bitDepth > 8 ? 2 : 1));
+	}
+
+	JxlEncoderFrameSettings *settings;
+	auto error = setupEncoder(encoder.get(), options, width, height, &settings);
+	if (!error.isUndefined())
+	{
+		return error;
+	}
+
+	SinkOutput output{sinkOf(control)};
+	if (!output.sink.isUndefined())
+	{
+		JxlEncoderOutputProcessor processor = {
+			&output,
+			SinkOutput::getBuffer,
+			SinkOutput::releaseBuffer,
+			nullptr,
+			SinkOutput::setFinalizedPosition,
+		};
+		CHECK_STATUS(JxlEncoderSetOutputProcessor(encoder.get(), processor));
+	}
+
+	auto format = pixelFormat(options.bitDepth, options.channels);
+	if (JxlEncoderAddImageFrame(settings, &format, pixels.data(), pixels.length()) != JXL_ENC_SUCCESS)
+	{
+		if (budget.exceeded)
+		{
+			return val(OUT_OF_BUDGET);
+		}
+		return progress.cancelled() ? val(CANCELLED) : val::null();
 	}
-	CHECK_STATUS(JxlEncoderAddImageFrame(settings, &format, pixels.data(), pixels.length()));
 	JxlEncoderCloseInput(encoder.get());
 
+	if (!output.sink.isUndefined())
+	{
+		if (JxlEncoderFlushInput(encoder.get()) != JXL_ENC_SUCCESS)
+		{
+			return val(budget.exceeded ? OUT_OF_BUDGET : progress.cancelled() ? CANCELLED : "JxlEncoderFlushInput");
+		}
+		progress.update(1);
+		return val(output.written);
+	}
+
 	std::vector<uint8_t> compressed;
 	if (!ReadCompressedOutput(encoder.get(), &compressed))
 	{
-		return val("ReadCompressedOutput");
+		return val(budget.exceeded ? OUT_OF_BUDGET : progress.cancelled() ? CANCELLED : "ReadCompressedOutput");
 	}
+	progress.update(1);
 	return toUint8Array(compressed.data(), compressed.size());
 }
 
+/*
+ * Chunked input of libjxl, pixels are pulled from the JS source when
+ * the encoder requests a rectangle, buffers are freed after use.
+ *
+ * libjxl requests color and alpha of a rectangle separately, RGBA pixels
+ * are kept until both are served, so the source is read once for each.
+ */
+struct TileInput
+{
+	struct Chunk
+	{
+		size_t x, y, width, height;
+		uint8_t *rgba;
+		bool colorReleased;
+		bool alphaServed;
+	};
+
+	val source;
+	JxlPixelFormat format;
+	uint32_t bitDepth;
+	bool alpha;
+	bool failed = false;
+	std::vector<Chunk> chunks;
+
+	// Chunks are left if the encoding failed.
+	~TileInput()
+	{
+		for (auto &chunk : chunks)
+		{
+			free(chunk.rgba);
+		}
+	}
+
+	size_t sampleSize() const
+	{
+		return (bitDepth + 7) / 8;
+	}
+
+	Chunk *fetch(size_t x, size_t y, size_t width, size_t height)
+	{
+		for (auto &chunk : chunks)
+		{
+			if (chunk.x == x && chunk.y == y && chunk.width == width && chunk.height == height)
+			{
+				return &chunk;
+			}
+		}
+		auto length = width * height * CHANNELS_RGBA * sampleSize();
+		auto rgba = reinterpret_cast<uint8_t *>(malloc(length));
+		if (rgba == nullptr)
+		{
+			return nullptr;
+		}
+		if (!readTile(source, rgba, x, y, width, height, bitDepth))
+		{
+			failed = true;
+			memset(rgba, 0, length);
+		}
+		// Without alpha, the color is RGB and the channel is removed in place.
+		if (!alpha && bitDepth == 8)
+		{
+			removeAlpha(rgba, width * height, CHANNELS_RGBA);
+		}
+		else if (!alpha)
+		{
+			removeAlpha(reinterpret_cast<uint16_t *>(rgba), width * height, CHANNELS_RGBA);
+		}
+		return &chunks.emplace_back(Chunk{x, y, width, height, rgba, false, !alpha});
+	}
+
+	void drop(Chunk *chunk)
+	{
+		if (chunk->colorReleased && chunk->alphaServed)
+		{
+			free(chunk->rgba);
+			chunks.erase(chunks.begin() + (chunk - chunks.data()));
+		}
+	}
+
+	static void getColorFormat(void *opaque, JxlPixelFormat *format)
+	{
+		*format = reinterpret_cast<TileInput *>(opaque)->format;
+	}
+
+	static const void *getColor(void *opaque, size_t x, size_t y, size_t width, size_t height, size_t *rowOffset)
+	{
+		auto self = reinterpret_cast<TileInput *>(opaque);
+		auto chunk = self->fetch(x, y, width, height);
+		if (chunk == nullptr)
+		{
+			return nullptr;
+		}
+		*rowOffset = width * self->format.num_channels * self->sampleSize();
+		return chunk->rgba;
+	}
+
+	static void getAlphaFormat(void *opaque, size_t index, JxlPixelFormat *format)
+	{
+		*format = reinterpret_cast<TileInput *>(opaque)->format;
+		format->num_channels = 1;
+	}
+
+	// Alpha is the only extra channel, copy it from the RGBA pixels of the chunk.
+	static const void *getAlpha(void *opaque, size_t index, size_t x, size_t y, size_t width, size_t height, size_t *rowOffset)
+	{
+		auto self = reinterpret_cast<TileInput *>(opaque);
+		auto sampleSize = self->sampleSize();
+		auto chunk = self->fetch(x, y, width, height);
+		auto plane = reinterpret_cast<uint8_t *>(malloc(width * height * sampleSize));
+		if (chunk == nullptr || plane == nullptr)
+		{
+			free(plane);
+			return nullptr;
+		}
+		for (size_t i = 0, n = width * height; i < n; i++)
+		{
+			memcpy(plane + i * sampleSize, chunk->rgba + (i * CHANNELS_RGBA + 3) * sampleSize, sampleSize);
+		}
+		chunk->alphaServed = true;
+		self->drop(chunk);
+		*rowOffset = width * sampleSize;
+		return plane;
+	}
+
+	// Alpha planes are not in chunks, they are freed directly.
+	static void release(void *opaque, const void *buffer)
+	{
+		auto self = reinterpret_cast<TileInput *>(opaque);
+		for (auto &chunk : self->chunks)
+		{
+			if (chunk.rgba == buffer)
+			{
+				chunk.colorReleased = true;
+				return self->drop(&chunk);
+			}
+		}
+		free(const_cast<void *>(buffer));
+	}
+};
+
+/*
+ * Read the source by blocks to check whether all pixels are opaque, it stops at
+ * the first block with transparent pixels, opaque images are read twice.
+ *
+ * @return undefined if succeed, otherwise the error.
+ */
+val detectOpaque(val source, uint32_t width, uint32_t height, uint32_t bitDepth, Progress &progress, bool &opaque)
+{
+	const uint32_t block = 1024;
+	auto pixelSize = CHANNELS_RGBA * ((bitDepth + 7) / 8);
+	auto buffer = std::make_unique_for_overwrite<uint8_t[]>((size_t)block * block * pixelSize);
+
+	opaque = true;
+	for (uint32_t y = 0; y < height && opaque; y += block)
+	{
+		for (uint32_t x = 0; x < width && opaque; x += block)
+		{
+			auto w = std::min(block, width - x);
+			auto h = std::min(block, height - y);
+			if (!readTile(source, buffer.get(), x, y, w, h, bitDepth))
+			{
+				return val("Tile data length mismatch");
+			}
+			if (!progress.check())
+			{
+				return val(CANCELLED);
+			}
+			opaque = isOpaque(buffer.get(), (size_t)w * h, bitDepth, CHANNELS_RGBA);
+		}
+	}
+	return val::undefined();
+}
+
+/*
+ * Output processor of libjxl, it may seek back to write the TOC,
+ * so the whole output is kept, which is much smaller than the input.
+ */
+struct VectorOutput
+{
+	std::vector<uint8_t> buffer;
+	size_t position = 0;
+	size_t end = 0;
+
+	static void *getBuffer(void *opaque, size_t *size)
+	{
+		auto self = reinterpret_cast<VectorOutput *>(opaque);
+		*size = std::max<size_t>(*size, 65536);
+		if (self->buffer.size() < self->position + *size)
+		{
+			self->buffer.resize(std::max(self->buffer.size() * 2, self->position + *size));
+		}
+		return self->buffer.data() + self->position;
+	}
+
+	static void releaseBuffer(void *opaque, size_t written)
+	{
+		auto self = reinterpret_cast<VectorOutput *>(opaque);
+		self->position += written;
+		self->end = std::max(self->end, self->position);
+	}
+
+	static void seek(void *opaque, uint64_t position)
+	{
+		reinterpret_cast<VectorOutput *>(opaque)->position = position;
+	}
+
+	static void setFinalizedPosition(void *opaque, uint64_t position) {}
+};
+
+/*
+ * Encode a large image with pixels pulled from the JS source by chunks,
+ * and written by streaming output, the whole RGBA data is not needed.
+ *
+ * Opaque images are stored without alpha unless `keepAlpha` is set, like `encode`,
+ * it's detected before encoding if `source.opaque` is not specified.
+ *
+ * @param source JS object with width, height, read() and optional opaque.
+ */
+val encodeTiled(val source, JXLOptions options, val control)
+{
+	Progress progress(control);
+	auto width = source["width"].as<uint32_t>();
+	auto height = source["height"].as<uint32_t>();
+
+	Limits limits(control);
+	if (auto error = limits.check(width, height))
+	{
+		return val(error);
+	}
+	MemoryBudget budget(limits.maxMemory);
+	JxlMemoryManager memory{&budget, MemoryBudget::alloc, MemoryBudget::free};
+	const JxlEncoderPtr encoder = JxlEncoderMake(&memory);
+	CHECK_STATUS(JxlEncoderSetParallelRunner(encoder.get(), CancellableRunner, &progress));
+
+	auto opaque = false;
+	if (!options.keepAlpha)
+	{
+		auto known = source["opaque"];
+		if (!known.isUndefined())
+		{
+			opaque = known.as<bool>();
+		}
+		else if (auto error = detectOpaque(source, width, height, options.bitDepth, progress, opaque); !error.isUndefined())
+		{
+			return error;
+		}
+	}
+	options.channels = opaque ? 3 : CHANNELS_RGBA;
+
+	JxlEncoderFrameSettings *settings;
+	auto error = setupEncoder(encoder.get(), options, width, height, &settings);
+	if (!error.isUndefined())
+	{
+		return error;
+	}
+
+	// Process images larger than 2048x2048 by groups, instead of buffering all.
+	SET_OPTION(JXL_ENC_FRAME_SETTING_BUFFERING, 2);
+
+	VectorOutput output;
+	JxlEncoderOutputProcessor processor = {
+		&output,
+		VectorOutput::getBuffer,
+		VectorOutput::releaseBuffer,
+		VectorOutput::seek,
+		VectorOutput::setFinalizedPosition,
+	};
+	CHECK_STATUS(JxlEncoderSetOutputProcessor(encoder.get(), processor));
+
+	TileInput tiles{source, pixelFormat(options.bitDepth, options.channels), options.bitDepth, !opaque};
+	JxlChunkedFrameInputSource input = {
+		&tiles,
+		TileInput::getColorFormat,
+		TileInput::getColor,
+		TileInput::getAlphaFormat,
+		TileInput::getAlpha,
+		TileInput::release,
+	};
+	auto status = JxlEncoderAddChunkedFrame(settings, JXL_TRUE, input);
+	if (progress.cancelled())
+	{
+		return val(CANCELLED);
+	}
+	if (tiles.failed)
+	{
+		return val("Tile data length mismatch");
+	}
+	if (budget.exceeded)
+	{
+		return val(OUT_OF_BUDGET);
+	}
+	CHECK_STATUS(status);
+
+	JxlEncoderCloseInput(encoder.get());
+	if (JxlEncoderFlushInput(encoder.get()) != JXL_ENC_SUCCESS)
+	{
+		return budget.exceeded ? val(OUT_OF_BUDGET) : val::null();
+	}
+
+	progress.update(1);
+	return toUint8Array(output.buffer.data(), output.end);
+}
+
 EMSCRIPTEN_BINDINGS(icodec_module_JXL)
 {
+#ifdef ICODEC_TRANSCODER
+	transcoder::encoder("jxl", &encode);
+#else
 	function("encode", &encode);
+	function("encodeTiled", &encodeTiled);
+#endif
 
 	value_object<JXLOptions>("JXLOptions")
 		.field("lossless", &JXLOptions::lossless)
@@ -157,5 +616,9 @@ EMSCRIPTEN_BINDINGS(icodec_module_JXL)
 		.field("iterations", &JXLOptions::iterations)
 		.field("modularColorspace", &JXLOptions::modularColorspace)
 		.field("modularPredictor", &JXLOptions::modularPredictor)
-		.field("bitDepth", &JXLOptions::bitDepth);
+		.field("keepAlpha", &JXLOptions::keepAlpha)
+		.field("bitDepth", &JXLOptions::bitDepth)
+		.field("channels", &JXLOptions::channels);
+}
+
 }
@@ -1,3 +1,7 @@
+#include <climits>
+#include <csetjmp>
+#include <cstring>
+#include <vector>
 #include <emscripten/bind.h>
 #include "icodec.h"
 #include "jconfig.h"
@@ -8,6 +12,9 @@ extern "C"
 #include "cdjpeg.h"
 }
 
+namespace
+{
+
 struct MozJpegOptions
 {
 	int quality;
@@ -26,17 +33,160 @@ struct MozJpegOptions
 	int chroma_subsample;
 	bool separate_chroma_quality;
 	int chroma_quality;
+
+	int channels;
+};
+
+/*
+ * The default error handler calls `exit()`, and the progress monitor cannot
+ * return a value, so both jump back to the entry function to clean up.
+ *
+ * No object with destructor should be created between `setjmp` and the
+ * library calls, since `longjmp` skips them.
+ */
+struct ErrorManager
+{
+	jpeg_error_mgr pub;
+	jmp_buf jump;
+	char message[JMSG_LENGTH_MAX];
 };
 
-val encode(std::string pixels, uint32_t width, uint32_t height, MozJpegOptions options)
+struct ProgressManager
+{
+	jpeg_progress_mgr pub;
+	Progress *progress;
+};
+
+/*
+ * Buffers of decoding are owned by the error manager, it's reached by pointer
+ * from libjpeg, so its members are in memory when `longjmp` returns, unlike
+ * locals assigned after `setjmp`, which are indeterminate.
+ */
+struct DecodeErrorManager : ErrorManager
+{
+	std::unique_ptr<uint8_t[]> output;
+	std::unique_ptr<uint8_t[]> row;
+};
+
+void errorExit(j_common_ptr cinfo)
+{
+	auto err = reinterpret_cast<ErrorManager *>(cinfo->err);
+	(*cinfo->err->format_message)(cinfo, err->message);
+	longjmp(err->jump, 1);
+}
+
+void progressMonitor(j_common_ptr cinfo)
+{
+	auto monitor = reinterpret_cast<ProgressManager *>(cinfo->progress);
+	auto &pub = monitor->pub;
+	bool ok;
+
+	if (pub.total_passes > 0 && pub.pass_limit > 0)
+	{
+		auto pass = (double)pub.pass_counter / pub.pass_limit;
+		ok = monitor->progress->update((pub.completed_passes + pass) / pub.total_passes);
+	}
+	else
+	{
+		ok = monitor->progress->check();
+	}
+	if (!ok)
+	{
+		auto err = reinterpret_cast<ErrorManager *>(cinfo->err);
+		strcpy(err->message, CANCELLED);
+		longjmp(err->jump, 1);
+	}
+}
+
+/*
+ * Unlike `jpeg_mem_dest`, which updates the output pointer only at the end,
+ * the buffer is always owned by us, so it can be released after aborting.
+ *
+ * If the sink is set, the buffer is sent to it when full instead of growing.
+ */
+struct VectorDestination
+{
+	jpeg_destination_mgr pub;
+	val sink;
+	std::vector<uint8_t> buffer;
+	double written = 0;
+
+	void flush(size_t length)
+	{
+		writeChunk(sink, buffer.data(), length);
+		written += length;
+	}
+
+	static void init(j_compress_ptr cinfo)
+	{
+		auto dest = reinterpret_cast<VectorDestination *>(cinfo->dest);
+		dest->buffer.resize(65536);
+		dest->pub.next_output_byte = dest->buffer.data();
+		dest->pub.free_in_buffer = dest->buffer.size();
+	}
+
+	static boolean grow(j_compress_ptr cinfo)
+	{
+		auto dest = reinterpret_cast<VectorDestination *>(cinfo->dest);
+		if (!dest->sink.isUndefined())
+		{
+			dest->flush(dest->buffer.size());
+			dest->pub.next_output_byte = dest->buffer.data();
+			dest->pub.free_in_buffer = dest->buffer.size();
+			return TRUE;
+		}
+		auto used = dest->buffer.size();
+		dest->buffer.resize(used * 2);
+		dest->pub.next_output_byte = dest->buffer.data() + used;
+		dest->pub.free_in_buffer = used;
+		return TRUE;
+	}
+
+	static void term(j_compress_ptr cinfo)
+	{
+		auto dest = reinterpret_cast<VectorDestination *>(cinfo->dest);
+		auto used = dest->buffer.size() - dest->pub.free_in_buffer;
+		if (dest->sink.isUndefined())
+		{
+			dest->buffer.resize(used);
+		}
+		else
+		{
+			dest->flush(used);
+		}
+	}
+};
+
+/*
+ * If `control.sink` is set, the output is written to it by chunks,
+ * and returns the number of bytes written.
+ */
+val encode(std::string pixels, uint32_t width, uint32_t height, MozJpegOptions options, val control)
 {
 	// The code below is basically the `write_JPEG_file` function from
 	// https://github.com/mozilla/mozjpeg/blob/master/example.c
-	auto rgba = reinterpret_cast<uint8_t *>(pixels.data());
+	auto bytes = reinterpret_cast<uint8_t *>(pixels.data());
+
+	// Gray input can only be encoded as gray, which also saves the chroma.
+	if (options.channels == 1)
+	{
+		options.color_space = JCS_GRAYSCALE;
+	}
+
+	// A little hacky to build a string for this, but it means we can use
+	// set_quality_ratings which does some useful heuristic stuff.
+	std::string quality_str = std::to_string(options.quality);
+	if (options.separate_chroma_quality && options.color_space == JCS_YCbCr)
+	{
+		quality_str += "," + std::to_string(options.chroma_quality);
+	}
 
 	/* Step 1: allocate and initialize JPEG compression object */
 	jpeg_compress_struct cinfo;
-	jpeg_error_mgr jerr;
+	ErrorManager jerr;
+	Progress progress(control);
+	ProgressManager monitor{{progressMonitor}, &progress};
+	VectorDestination dest{{nullptr, 0, VectorDestination::init, VectorDestination::grow, VectorDestination::term}, sinkOf(control)};
 
 	/*
 	 * We have to set up the error handler first, in case the initialization
@@ -44,20 +194,36 @@ val encode(std::string pixels, uint32_t width, uint32_t height, MozJpegOptions o
 	 * This routine fills in the contents of struct jerr, and returns jerr's
 	 * address which we place into the link field in cinfo.
 	 */
-	cinfo.err = jpeg_std_error(&jerr);
+	cinfo.err = jpeg_std_error(&jerr.pub);
+	jerr.pub.error_exit = errorExit;
+
+	if (setjmp(jerr.jump))
+	{
+		jpeg_destroy_compress(&cinfo);
+		return val(jerr.message);
+	}
 
 	jpeg_create_compress(&cinfo);
+	cinfo.progress = &monitor.pub;
 
 	/* Step 2: specify data destination (eg, a file) */
-	uint8_t *output = nullptr;
-	unsigned long size = 0;
-	jpeg_mem_dest(&cinfo, &output, &size);
+	cinfo.dest = &dest.pub;
 
 	/* Step 3: set parameters for compression */
 	cinfo.image_width = width;
 	cinfo.image_height = height;
-	cinfo.input_components = CHANNELS_RGBA;
-	cinfo.in_color_space = JCS_EXT_RGBA;
+	cinfo.input_components = options.channels;
+	switch (options.channels)
+	{
+	case 1:
+		cinfo.in_color_space = JCS_GRAYSCALE;
+		break;
+	case 3:
+		cinfo.in_color_space = JCS_EXT_RGB;
+		break;
+	default:
+		cinfo.in_color_space = JCS_EXT_RGBA;
+	}
 
 	/*
 	 * Now use the library's routine to set default compression parameters.
@@ -86,13 +252,6 @@ val encode(std::string pixels, uint32_t width, uint32_t height, MozJpegOptions o
 	jpeg_c_set_bool_param(&cinfo, JBOOLEAN_TRELLIS_EOB_OPT, options.trellis_opt_zero);
 	jpeg_c_set_bool_param(&cinfo, JBOOLEAN_TRELLIS_Q_OPT, options.trellis_opt_table);
 
-	// A little hacky to build a string for this, but it means we can use
-	// set_quality_ratings which does some useful heuristic stuff.
-	std::string quality_str = std::to_string(options.quality);
-	if (options.separate_chroma_quality && options.color_space == JCS_YCbCr)
-	{
-		quality_str += "," + std::to_string(options.chroma_quality);
-	}
 	char const *pqual = quality_str.c_str();
 	set_quality_ratings(&cinfo, (char *)pqual, options.baseline);
 
@@ -122,7 +281,7 @@ val encode(std::string pixels, uint32_t width, uint32_t height, MozJpegOptions o
 	jpeg_start_compress(&cinfo, TRUE);
 
 	/* Step 5: while (scan lines remain to be written) */
-	int stride = width * CHANNELS_RGBA;
+	int stride = width * options.channels;
 	while (cinfo.next_scanline < cinfo.image_height)
 	{
 		/*
@@ -130,57 +289,261 @@ val encode(std::string pixels, uint32_t width, uint32_t height, MozJpegOptions o
 		 * Here the array is only one element long, but you could pass
 		 * more than one scanline at a time if that's more convenient.
 		 */
-		JSAMPROW p = &rgba[cinfo.next_scanline * stride];
+		JSAMPROW p = &bytes[cinfo.next_scanline * stride];
 		(void)jpeg_write_scanlines(&cinfo, &p, 1);
 	}
 
 	jpeg_finish_compress(&cinfo);
 	jpeg_destroy_compress(&cinfo);
 
-	return toUint8Array(toRAII(output, free).get(), size);
+	if (!dest.sink.isUndefined())
+	{
+		return val(dest.written);
+	}
+	return toUint8Array(dest.buffer.data(), dest.buffer.size());
 }
 
-val decode(std::string input)
+/*
+ * Read the input from the JS stream source by chunks, like `jpeg_stdio_src`,
+ * but skipping is done by moving the position instead of reading.
+ */
+struct StreamSource
 {
-	auto inBuffer = reinterpret_cast<const uint8_t *>(input.c_str());
+	jpeg_source_mgr pub;
+	val source;
+	double position = 0;
+	std::vector<JOCTET> buffer = std::vector<JOCTET>(65536);
+
+	static void init(j_decompress_ptr cinfo) {}
+
+	static boolean fill(j_decompress_ptr cinfo)
+	{
+		auto src = reinterpret_cast<StreamSource *>(cinfo->src);
+		auto buffer = src->buffer.data();
+		auto n = readChunk(src->source, buffer, src->buffer.size(), src->position);
+		src->position += n;
+
+		// Insert a fake EOI marker for truncated files, same as `jpeg_stdio_src`.
+		if (n == 0)
+		{
+			WARNMS(cinfo, JWRN_JPEG_EOF);
+			buffer[0] = 0xFF;
+			buffer[1] = JPEG_EOI;
+			n = 2;
+		}
+		src->pub.next_input_byte = buffer;
+		src->pub.bytes_in_buffer = n;
+		return TRUE;
+	}
 
+	static void skip(j_decompress_ptr cinfo, long count)
+	{
+		auto src = reinterpret_cast<StreamSource *>(cinfo->src);
+		if (count <= 0)
+		{
+			return;
+		}
+		if ((size_t)count <= src->pub.bytes_in_buffer)
+		{
+			src->pub.next_input_byte += count;
+			src->pub.bytes_in_buffer -= count;
+		}
+		else
+		{
+			src->position += count - src->pub.bytes_in_buffer;
+			src->pub.bytes_in_buffer = 0;
+		}
+	}
+
+	static void term(j_decompress_ptr cinfo) {}
+};
+
+/*
+ * Decode the image, or only a region of it. Only iMCU columns intersecting
+ * the region are decoded (jpeg_crop_scanline), and rows above it are skipped.
+ *
+ * @param setSource Called to set the data source after the object is created.
+ */
+template <typename SetSource>
+val decodeWith(SetSource setSource, val options)
+{
 	jpeg_decompress_struct cinfo;
-	jpeg_error_mgr jerr;
+	DecodeErrorManager jerr;
+	Progress progress(options);
+	Limits limits(options);
+	ProgressManager monitor{{progressMonitor}, &progress};
+	Region region;
+
+	// Initialize the JPEG decompression object with our error handling.
+	cinfo.err = jpeg_std_error(&jerr.pub);
+	jerr.pub.error_exit = errorExit;
+
+	if (setjmp(jerr.jump))
+	{
+		jpeg_destroy_decompress(&cinfo);
+		jerr.output.reset();
+		jerr.row.reset();
+		return val(jerr.message);
+	}
 
-	// Initialize the JPEG decompression object with default error handling.
-	cinfo.err = jpeg_std_error(&jerr);
 	jpeg_create_decompress(&cinfo);
+	cinfo.progress = &monitor.pub;
 
-	jpeg_mem_src(&cinfo, inBuffer, input.length());
+	// Virtual arrays (coefficients of progressive files) can't be swapped
+	// out in WASM, libjpeg fails instead of allocating more than it.
+	// It's `long`, 32-bit in WASM, so the limit is clamped.
+	if (limits.maxMemory > 0)
+	{
+		cinfo.mem->max_memory_to_use = (long)std::min<double>(limits.maxMemory, LONG_MAX);
+	}
+
+	setSource(&cinfo);
 
 	// Read file header, set default decompression parameters.
 	jpeg_read_header(&cinfo, TRUE);
 
-	// Force RGBA decoding, even for grayscale images.
-	cinfo.out_color_space = JCS_EXT_RGBA;
+	if (!region.read(options, cinfo.image_width, cinfo.image_height))
+	{
+		jpeg_destroy_decompress(&cinfo);
+		return val("Region out of bounds");
+	}
+
+	// JPEG has no alpha, gray+alpha is decoded as gray, and JS side adds the alpha.
+	auto channels = channelsOf(options);
+	switch (channels)
+	{
+	case 1:
+	case 2:
+		channels = 1;
+		cinfo.out_color_space = JCS_GRAYSCALE;
+		break;
+	case 3:
+		cinfo.out_color_space = JCS_EXT_RGB;
+		break;
+	default:
+		cinfo.out_color_space = JCS_EXT_RGBA;
+	}
+
+	auto bytes = (double)region.width * region.height * channels;
+	if (auto error = limits.check(cinfo.image_width, cinfo.image_height, bytes))
+	{
+		jpeg_destroy_decompress(&cinfo);
+		return val(error);
+	}
 	jpeg_start_decompress(&cinfo);
 
-	// Prepare output buffer
-	size_t output_size = cinfo.output_width * cinfo.output_height * CHANNELS_RGBA;
-	auto output = std::make_unique_for_overwrite<uint8_t[]>(output_size);
+	// The cropped range is expanded to iMCU boundary, so it may start before the region.
+	JDIMENSION xOffset = region.x;
+	JDIMENSION cropWidth = region.width;
+	if (cropWidth != cinfo.output_width)
+	{
+		jpeg_crop_scanline(&cinfo, &xOffset, &cropWidth);
+	}
+
+	// Prepare output buffer, read into it directly if the width matches.
+	size_t output_size = (size_t)region.width * region.height * channels;
+	auto &output = jerr.output;
+	output = std::make_unique_for_overwrite<uint8_t[]>(output_size);
 
-	auto stride = cinfo.output_width * CHANNELS_RGBA;
-	while (cinfo.output_scanline < cinfo.output_height)
+	auto direct = cinfo.output_width == region.width;
+	if (!direct)
 	{
-		uint8_t *ptr = &output[stride * cinfo.output_scanline];
+		jerr.row = std::make_unique_for_overwrite<uint8_t[]>(cinfo.output_width * channels);
+	}
+
+	auto skip = (region.x - xOffset) * channels;
+	auto stride = region.width * channels;
+	jpeg_skip_scanlines(&cinfo, region.y);
+
+	for (uint32_t y = 0; y < region.height; y++)
+	{
+		uint8_t *dest = &output[stride * y];
+		uint8_t *ptr = direct ? dest : jerr.row.get();
 		jpeg_read_scanlines(&cinfo, &ptr, 1);
+		if (!direct)
+		{
+			memcpy(dest, ptr + skip, stride);
+		}
 	}
 
-	jpeg_finish_decompress(&cinfo);
+	// finish_decompress requires all scanlines to be read.
+	if (cinfo.output_scanline < cinfo.output_height)
+	{
+		jpeg_abort_decompress(&cinfo);
+	}
+	else
+	{
+		jpeg_finish_decompress(&cinfo);
+	}
 	jpeg_destroy_decompress(&cinfo);
 
-	return toImageData(output.get(), cinfo.output_width, cinfo.output_height, 8);
+	return toImageData(output.get(), region.width, region.height, 8, channels);
+}
+
+val decode(std::string input, val options)
+{
+	auto inBuffer = reinterpret_cast<const uint8_t *>(input.c_str());
+	auto setSource = [&](j_decompress_ptr cinfo)
+	{
+		jpeg_mem_src(cinfo, inBuffer, input.length());
+	};
+	return decodeWith(setSource, options);
+}
+
+/*
+ * Decode from the JS stream source, only a chunk of the file is in memory.
+ *
+ * @param source JS object with size and read(buffer, position).
+ */
+val decodeStream(val source, val options)
+{
+	StreamSource src{{nullptr, 0, StreamSource::init, StreamSource::fill,
+					  StreamSource::skip, jpeg_resync_to_restart, StreamSource::term},
+					 source};
+	auto setSource = [&](j_decompress_ptr cinfo)
+	{
+		cinfo->src = &src.pub;
+	};
+	return decodeWith(setSource, options);
+}
+
+val probe(std::string input)
+{
+	auto inBuffer = reinterpret_cast<const uint8_t *>(input.c_str());
+
+	jpeg_decompress_struct cinfo;
+	ErrorManager jerr;
+
+	cinfo.err = jpeg_std_error(&jerr.pub);
+	jerr.pub.error_exit = errorExit;
+
+	if (setjmp(jerr.jump))
+	{
+		jpeg_destroy_decompress(&cinfo);
+		return val(jerr.message);
+	}
+
+	jpeg_create_decompress(&cinfo);
+
+	jpeg_mem_src(&cinfo, inBuffer, input.length());
+	jpeg_read_header(&cinfo, TRUE);
+
+	auto info = toImageInfo(cinfo.image_width, cinfo.image_height, 8);
+	jpeg_destroy_decompress(&cinfo);
+	return info;
 }
 
 EMSCRIPTEN_BINDINGS(icodec_module_MozJpeg)
 {
+#ifdef ICODEC_TRANSCODER
+	transcoder::decoder("jpg", &decode);
+	transcoder::encoder("jpg", &encode);
+#else
 	function("encode", &encode);
 	function("decode", &decode);
+	function("decodeStream", &decodeStream);
+	function("probe", &probe);
+#endif
 
 	value_object<MozJpegOptions>("MozJpegOptions")
 		.field("quality", &MozJpegOptions::quality)
@@ -198,5 +561,8 @@ EMSCRIPTEN_BINDINGS(icodec_module_MozJpeg)
 		.field("autoSubsample", &MozJpegOptions::chroma_subsample)
 		.field("chromaSubsample", &MozJpegOptions::auto_subsample)
 		.field("separateChromaQuality", &MozJpegOptions::separate_chroma_quality)
-		.field("chromaQuality", &MozJpegOptions::chroma_quality);
+		.field("chromaQuality", &MozJpegOptions::chroma_quality)
+		.field("channels", &MozJpegOptions::channels);
+}
+
 }
@@ -0,0 +1,36 @@
+#include <chrono>
+#include <emscripten/bind.h>
+
+/*
+ * Entry of native addons, linked with one glue source (e.g. jxl_dec.cpp), exports
+ * functions it registered in EMSCRIPTEN_BINDINGS, the same as the WASM module.
+ * It's context-aware, so can be loaded by multiple worker threads.
+ */
+NAPI_MODULE_INIT()
+{
+	emscripten::internal::env = env;
+
+	// Measure the offset for `emscripten_get_now`.
+	napi_value global, performance, now, timestamp;
+	napi_get_global(env, &global);
+	napi_get_named_property(env, global, "performance", &performance);
+	napi_get_named_property(env, performance, "now", &now);
+	napi_call_function(env, performance, now, 0, nullptr, &timestamp);
+	double jsNow;
+	napi_get_value_double(env, timestamp, &jsNow);
+	auto steady = std::chrono::steady_clock::now().time_since_epoch();
+	emscripten::internal::timeOrigin = jsNow - std::chrono::duration<double, std::milli>(steady).count();
+
+	for (auto &entry : emscripten::internal::exports())
+	{
+		napi_value fn;
+		napi_create_function(env, entry.name, NAPI_AUTO_LENGTH, entry.callback, entry.data, &fn);
+		napi_set_named_property(env, exports, entry.name, fn);
+	}
+
+	// Lets loaders tell it from Emscripten modules.
+	napi_value native;
+	napi_get_boolean(env, true, &native);
+	napi_set_named_property(env, exports, "native", native);
+	return exports;
+}
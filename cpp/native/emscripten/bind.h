@@ -0,0 +1,147 @@
+#pragma once
+
+/*
+ * Registration API of embind for native addons: `function` exports a C++
+ * function, `value_object` converts JS objects to structs by fields.
+ * Functions are collected when the addon is loaded, see addon.cpp.
+ */
+#include <functional>
+#include <tuple>
+#include <utility>
+#include <vector>
+#include "val.h"
+
+namespace emscripten
+{
+	namespace internal
+	{
+		struct Export
+		{
+			const char *name;
+			napi_callback callback;
+			void *data;
+		};
+
+		inline std::vector<Export> &exports()
+		{
+			static std::vector<Export> list;
+			return list;
+		}
+
+		template <typename T>
+		struct ValueObject
+		{
+			using Setter = std::function<void(T &, napi_value)>;
+
+			static std::vector<std::pair<const char *, Setter>> &fields()
+			{
+				static std::vector<std::pair<const char *, Setter>> list;
+				return list;
+			}
+
+			// Like embind, all fields are required, missing ones throw TypeError.
+			static T read(napi_value object)
+			{
+				T result{};
+				for (auto &[name, setter] : fields())
+				{
+					napi_value value;
+					napi_valuetype type;
+					check(napi_get_named_property(env, object, name, &value));
+					check(napi_typeof(env, value, &type));
+					if (type == napi_undefined)
+					{
+						auto message = std::string("Missing field: ") + name;
+						napi_throw_type_error(env, nullptr, message.c_str());
+						throw PendingException();
+					}
+					setter(result, value);
+				}
+				return result;
+			}
+		};
+
+		template <typename R, typename... Args, size_t... I>
+		napi_value invoke(R (*fn)(Args...), napi_value *argv, std::index_sequence<I...>)
+		{
+			return toJS(fn(fromJS<std::decay_t<Args>>(argv[I])...));
+		}
+
+		/*
+		 * Convert arguments, call the function and convert the result, C++ exceptions
+		 * (libheif throws heif::Error) become JS errors, as they would abort in WASM.
+		 */
+		template <typename R, typename... Args>
+		napi_value bind(napi_env env, napi_callback_info info)
+		{
+			internal::env = env;
+			size_t argc = sizeof...(Args);
+			napi_value argv[sizeof...(Args) + 1];
+			void *data;
+			napi_get_cb_info(env, info, &argc, argv, nullptr, &data);
+
+			if (argc != sizeof...(Args))
+			{
+				napi_throw_type_error(env, nullptr, "Wrong number of arguments");
+				return nullptr;
+			}
+			try
+			{
+				auto fn = reinterpret_cast<R (*)(Args...)>(data);
+				return invoke(fn, argv, std::index_sequence_for<Args...>());
+			}
+			catch (const PendingException &)
+			{
+				return nullptr;
+			}
+			catch (const std::exception &e)
+			{
+				napi_throw_error(env, nullptr, e.what());
+				return nullptr;
+			}
+		}
+	}
+
+	template <typename R, typename... Args>
+	void function(const char *name, R (*fn)(Args...))
+	{
+		internal::exports().push_back({name, internal::bind<R, Args...>, reinterpret_cast<void *>(fn)});
+	}
+
+	template <typename T>
+	class value_object
+	{
+	public:
+		explicit value_object(const char *name) {}
+
+		template <typename F>
+		value_object &field(const char *name, F T::*member)
+		{
+			internal::ValueObject<T>::fields().emplace_back(name, [member](T &object, napi_value value)
+			{
+				object.*member = internal::fromJS<F>(value);
+			});
+			return *this;
+		}
+	};
+
+	/*
+	 * Enums are converted by their underlying type, values need no registration.
+	 */
+	template <typename T>
+	class enum_
+	{
+	public:
+		explicit enum_(const char *name) {}
+
+		enum_ &value(const char *name, T value)
+		{
+			return *this;
+		}
+	};
+}
+
+#define EMSCRIPTEN_BINDINGS(name)                                    \
+	static void embind_init_##name();                                \
+	static const bool embind_registered_##name = (embind_init_##name(), true); \
+	static void embind_init_##name()
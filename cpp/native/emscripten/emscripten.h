@@ -0,0 +1,14 @@
+#pragma once
+
+#include <chrono>
+#include "val.h"
+
+/*
+ * Deadlines of Progress are timestamps of `performance.now()` from JS,
+ * the offset is measured when the addon is loaded on the thread.
+ */
+inline double emscripten_get_now()
+{
+	auto now = std::chrono::steady_clock::now().time_since_epoch();
+	return std::chrono::duration<double, std::milli>(now).count() + emscripten::internal::timeOrigin;
+}
@@ -0,0 +1,347 @@
+#pragma once
+
+/*
+ * The subset of Emscripten's `val` used by our glue code, implemented with
+ * Node-API, so sources in cpp/ can be compiled to native addons unchanged.
+ *
+ * Like handles of embind, values are only valid in the call from JS,
+ * globals created before that are resolved by name when used.
+ */
+#include <cstdint>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <type_traits>
+#include <utility>
+#include <node_api.h>
+
+namespace emscripten
+{
+	class val;
+
+	namespace internal
+	{
+		// Environment of the current call, set by bindings before calling the C++ function.
+		inline thread_local napi_env env = nullptr;
+
+		// Offset from the steady clock to `performance.now()` of the current thread.
+		inline thread_local double timeOrigin = 0;
+
+		/*
+		 * A JS exception is pending, unwind to the binding, which returns to JS
+		 * and lets it propagate, like how a JS exception passes through WASM.
+		 */
+		struct PendingException
+		{
+		};
+
+		inline void check(napi_status status)
+		{
+			if (status == napi_ok)
+			{
+				return;
+			}
+			bool pending = false;
+			napi_is_exception_pending(env, &pending);
+			if (!pending)
+			{
+				const napi_extended_error_info *info;
+				napi_get_last_error_info(env, &info);
+				napi_throw_type_error(env, nullptr, info->error_message ? info->error_message : "Node-API call failed");
+			}
+			throw PendingException();
+		}
+
+		template <typename T>
+		struct ValueObject;
+
+		template <typename T>
+		T fromJS(napi_value value);
+
+		inline napi_value toJS(napi_value value)
+		{
+			return value;
+		}
+
+		inline napi_value toJS(const char *value)
+		{
+			napi_value result;
+			check(napi_create_string_utf8(env, value, NAPI_AUTO_LENGTH, &result));
+			return result;
+		}
+
+		inline napi_value toJS(const std::string &value)
+		{
+			napi_value result;
+			check(napi_create_string_utf8(env, value.data(), value.size(), &result));
+			return result;
+		}
+
+		inline napi_value toJS(bool value)
+		{
+			napi_value result;
+			check(napi_get_boolean(env, value, &result));
+			return result;
+		}
+
+		template <typename T>
+			requires std::is_arithmetic_v<T>
+		napi_value toJS(T value)
+		{
+			napi_value result;
+			check(napi_create_double(env, (double)value, &result));
+			return result;
+		}
+
+		inline napi_value toJS(const val &value);
+	}
+
+	class val
+	{
+		napi_value handle = nullptr;
+		const char *globalName = nullptr;
+
+		template <typename... Args>
+		static void toArgs(napi_value *argv, Args &&...args)
+		{
+			size_t i = 0;
+			((argv[i++] = internal::toJS(std::forward<Args>(args))), ...);
+		}
+
+	public:
+		explicit val(napi_value handle) : handle(handle) {}
+
+		template <typename T>
+			requires(!std::is_same_v<std::decay_t<T>, val> && !std::is_same_v<std::decay_t<T>, napi_value>)
+		explicit val(T &&value) : handle(internal::toJS(std::forward<T>(value)))
+		{
+		}
+
+		static val undefined()
+		{
+			napi_value result;
+			internal::check(napi_get_undefined(internal::env, &result));
+			return val(result);
+		}
+
+		static val null()
+		{
+			napi_value result;
+			internal::check(napi_get_null(internal::env, &result));
+			return val(result);
+		}
+
+		static val object()
+		{
+			napi_value result;
+			internal::check(napi_create_object(internal::env, &result));
+			return val(result);
+		}
+
+		static val array()
+		{
+			napi_value result;
+			internal::check(napi_create_array(internal::env, &result));
+			return val(result);
+		}
+
+		/*
+		 * Globals are often stored in static variables, which are created
+		 * outside of calls, so the lookup is deferred.
+		 */
+		static val global(const char *name)
+		{
+			val result(static_cast<napi_value>(nullptr));
+			result.globalName = name;
+			return result;
+		}
+
+		napi_value get() const
+		{
+			if (!globalName)
+			{
+				return handle;
+			}
+			napi_value global, result;
+			internal::check(napi_get_global(internal::env, &global));
+			internal::check(napi_get_named_property(internal::env, global, globalName, &result));
+			return result;
+		}
+
+		bool isUndefined() const
+		{
+			napi_valuetype type;
+			internal::check(napi_typeof(internal::env, get(), &type));
+			return type == napi_undefined;
+		}
+
+		bool isNull() const
+		{
+			napi_valuetype type;
+			internal::check(napi_typeof(internal::env, get(), &type));
+			return type == napi_null;
+		}
+
+		template <typename K>
+		val operator[](const K &key) const
+		{
+			napi_value result;
+			internal::check(napi_get_property(internal::env, get(), internal::toJS(key), &result));
+			return val(result);
+		}
+
+		template <typename K, typename V>
+		void set(const K &key, const V &value) const
+		{
+			internal::check(napi_set_property(internal::env, get(), internal::toJS(key), internal::toJS(value)));
+		}
+
+		template <typename T>
+		T as() const
+		{
+			return internal::fromJS<T>(get());
+		}
+
+		template <typename... Args>
+		val operator()(Args &&...args) const
+		{
+			napi_value argv[sizeof...(Args) + 1], undefined, result;
+			toArgs(argv, std::forward<Args>(args)...);
+			internal::check(napi_get_undefined(internal::env, &undefined));
+			internal::check(napi_call_function(internal::env, undefined, get(), sizeof...(Args), argv, &result));
+			return val(result);
+		}
+
+		template <typename R, typename... Args>
+		R call(const char *name, Args &&...args) const
+		{
+			napi_value argv[sizeof...(Args) + 1], method, result;
+			toArgs(argv, std::forward<Args>(args)...);
+			auto self = get();
+			internal::check(napi_get_named_property(internal::env, self, name, &method));
+			internal::check(napi_call_function(internal::env, self, method, sizeof...(Args), argv, &result));
+			if constexpr (!std::is_void_v<R>)
+			{
+				return internal::fromJS<R>(result);
+			}
+		}
+
+		template <typename... Args>
+		val new_(Args &&...args) const
+		{
+			napi_value argv[sizeof...(Args) + 1], result;
+			toArgs(argv, std::forward<Args>(args)...);
+			internal::check(napi_new_instance(internal::env, get(), sizeof...(Args), argv, &result));
+			return val(result);
+		}
+	};
+
+	/*
+	 * A Uint8Array over native memory without copying, like views of the WASM
+	 * heap, it must not be used after the memory is released.
+	 */
+	template <typename T>
+	val typed_memory_view(size_t length, const T *data)
+	{
+		static_assert(sizeof(T) == 1, "Only byte views are supported");
+		napi_value buffer, view;
+		internal::check(napi_create_external_arraybuffer(internal::env, (void *)data, length, nullptr, nullptr, &buffer));
+		internal::check(napi_create_typedarray(internal::env, napi_uint8_array, length, buffer, 0, &view));
+		return val(view);
+	}
+
+	namespace internal
+	{
+		inline napi_value toJS(const val &value)
+		{
+			return value.get();
+		}
+
+		/*
+		 * Like embind, strings accept UTF-8 text and bytes of ArrayBuffer
+		 * or its views, which are copied.
+		 */
+		inline std::string toBytes(napi_value value)
+		{
+			void *data = nullptr;
+			size_t length = 0;
+			bool is;
+
+			if (napi_is_arraybuffer(env, value, &is) == napi_ok && is)
+			{
+				check(napi_get_arraybuffer_info(env, value, &data, &length));
+			}
+			else if (napi_is_typedarray(env, value, &is) == napi_ok && is)
+			{
+				napi_typedarray_type type;
+				size_t count, offset;
+				napi_value buffer;
+				check(napi_get_typedarray_info(env, value, &type, &count, &data, &buffer, &offset));
+				napi_value byteLength;
+				check(napi_get_named_property(env, value, "byteLength", &byteLength));
+				double bytes;
+				check(napi_get_value_double(env, byteLength, &bytes));
+				length = (size_t)bytes;
+			}
+			else if (napi_is_dataview(env, value, &is) == napi_ok && is)
+			{
+				napi_value buffer;
+				size_t offset;
+				check(napi_get_dataview_info(env, value, &length, &data, &buffer, &offset));
+			}
+			else
+			{
+				check(napi_get_value_string_utf8(env, value, nullptr, 0, &length));
+				std::string text(length, '\0');
+				check(napi_get_value_string_utf8(env, value, text.data(), length + 1, &length));
+				return text;
+			}
+			return std::string(reinterpret_cast<const char *>(data), length);
+		}
+
+		template <typename T>
+		T fromJS(napi_value value)
+		{
+			if constexpr (std::is_same_v<T, val>)
+			{
+				return val(value);
+			}
+			else if constexpr (std::is_same_v<T, std::string>)
+			{
+				return toBytes(value);
+			}
+			else if constexpr (std::is_same_v<T, bool>)
+			{
+				bool result;
+				if (napi_get_value_bool(env, value, &result) == napi_ok)
+				{
+					return result;
+				}
+				double number;
+				check(napi_get_value_double(env, value, &number));
+				return number != 0;
+			}
+			else if constexpr (std::is_arithmetic_v<T>)
+			{
+				double result;
+				check(napi_get_value_double(env, value, &result));
+				return (T)result;
+			}
+			else if constexpr (std::is_enum_v<T>)
+			{
+				// Enum values of embind are objects with `value`, we also accept numbers.
+				napi_valuetype type;
+				check(napi_typeof(env, value, &type));
+				if (type == napi_object)
+				{
+					check(napi_get_named_property(env, value, "value", &value));
+				}
+				return (T)fromJS<std::underlying_type_t<T>>(value);
+			}
+			else
+			{
+				return ValueObject<T>::read(value);
+			}
+		}
+	}
+}
@@ -4,16 +4,28 @@
 #include "qoi.h"
 #include "icodec.h"
 
+namespace
+{
+
 /*
- * Although QOI has no encode options, we still add the 4th parameter to
- * keep the function signture, because Enscripten does not allow extra arguments.
+ * QOI has no encode options, the 4th parameter only contains the number
+ * of channels, which is passed like `bitDepth` of other codecs.
  * 
  * It's interesting that QOI can benefit from general compression algorithms.
  * https://github.com/phoboslab/qoi/issues/166
+ *
+ * QOI is fast enough, so cancellation is only checked before the operation.
  */
-val encode(std::string pixels, uint32_t width, uint32_t height, val _)
+val encode(std::string pixels, uint32_t width, uint32_t height, val options, val control)
 {
-	qoi_desc desc{ width, height, CHANNELS_RGBA, QOI_SRGB };
+	if (!Progress(control).check())
+	{
+		return val(CANCELLED);
+	}
+
+	// Only RGB and RGBA are supported, JS side converts other formats.
+	auto channels = options["channels"].as<unsigned char>();
+	qoi_desc desc{ width, height, channels, QOI_SRGB };
 	int outSize;
 	auto encoded = (uint8_t *)qoi_encode(pixels.c_str(), &desc, &outSize);
 
@@ -24,20 +36,76 @@ val encode(std::string pixels, uint32_t width, uint32_t height, val _)
 	return toUint8Array(toRAII(encoded, free).get(), outSize);
 }
 
-val decode(std::string input)
+/*
+ * qoi.h does not provide a function to read the header,
+ * it's simple: magic (4 bytes), width and height (32-bit big endian).
+ */
+bool readSize(const std::string &input, uint32_t *width, uint32_t *height)
+{
+	auto bytes = reinterpret_cast<const uint8_t *>(input.c_str());
+	if (input.length() < QOI_HEADER_SIZE)
+	{
+		return false;
+	}
+	auto readU32 = [bytes](int i)
+	{
+		return (uint32_t)bytes[i] << 24 | bytes[i + 1] << 16 | bytes[i + 2] << 8 | bytes[i + 3];
+	};
+	if (readU32(0) != QOI_MAGIC)
+	{
+		return false;
+	}
+	*width = readU32(4);
+	*height = readU32(8);
+	return true;
+}
+
+val decode(std::string input, val control)
 {
+	if (!Progress(control).check())
+	{
+		return val(CANCELLED);
+	}
+
 	qoi_desc desc; // Resultant width and height stored in descriptor.
 
-	auto buffer = qoi_decode(input.c_str(), input.length(), &desc, CHANNELS_RGBA);
+	auto channels = channelsOf(control) == 3 ? 3 : CHANNELS_RGBA;
+	uint32_t width, height;
+	if (readSize(input, &width, &height))
+	{
+		if (auto error = Limits(control).check(width, height, (double)width * height * channels))
+		{
+			return val(error);
+		}
+	}
+	auto buffer = qoi_decode(input.c_str(), input.length(), &desc, channels);
 	if (buffer == NULL) {
 		return val::null();
 	}
 	auto result = toRAII((uint8_t *)buffer, free);
-	return toImageData(result.get(), desc.width, desc.height, 8);
+	return toImageData(result.get(), desc.width, desc.height, 8, channels);
+}
+
+val probe(std::string input)
+{
+	uint32_t width, height;
+	if (!readSize(input, &width, &height))
+	{
+		return val::null();
+	}
+	return toImageInfo(width, height, 8);
 }
 
 EMSCRIPTEN_BINDINGS(icodec_module_QOI)
 {
+#ifdef ICODEC_TRANSCODER
+	transcoder::decoder("qoi", &decode);
+	transcoder::encoder("qoi", &encode);
+#else
 	function("encode", &encode);
 	function("decode", &decode);
+	function("probe", &probe);
+#endif
+}
+
 }
@@ -0,0 +1,165 @@
+#include <algorithm>
+#include <cstring>
+#include <string_view>
+#include <emscripten/bind.h>
+#include "icodec.h"
+
+/*
+ * Entry of the transcoder module, it's linked with glue sources of several
+ * codecs, which are compiled with ICODEC_TRANSCODER and register their
+ * functions in `transcoder` namespace instead of exporting them.
+ *
+ * Decoded pixels stay in WASM memory and are moved to the encoder, converting
+ * between formats with separate modules copies them to JS and back.
+ */
+
+/*
+ * Identify the format of the input by its signature,
+ * return the name of the decoder, or nullptr if unknown.
+ */
+const char *detectFormat(const std::string &input)
+{
+	auto bytes = reinterpret_cast<const uint8_t *>(input.data());
+	auto size = input.size();
+	auto startsWith = [&](size_t offset, const char *magic, size_t length)
+	{
+		return size >= offset + length && memcmp(bytes + offset, magic, length) == 0;
+	};
+
+	if (startsWith(0, "\xFF\xD8\xFF", 3))
+	{
+		return "jpg";
+	}
+	if (startsWith(0, "\xFF\x0A", 2) || startsWith(0, "\0\0\0\x0CJXL \r\n\x87\n", 12))
+	{
+		return "jxl";
+	}
+	if (startsWith(0, "RIFF", 4) && startsWith(8, "WEBP", 4))
+	{
+		return "webp";
+	}
+	if (startsWith(0, "qoif", 4))
+	{
+		return "qoi";
+	}
+	if (!startsWith(4, "ftyp", 4))
+	{
+		return nullptr;
+	}
+
+	// AVIF and HEIC are ISOBMFF, check the major brand and compatible brands.
+	size_t boxSize = (size_t)bytes[0] << 24 | bytes[1] << 16 | bytes[2] << 8 | bytes[3];
+	boxSize = std::min(boxSize, size);
+
+	for (size_t i = 8; i + 4 <= boxSize; i += 4)
+	{
+		if (i == 12)
+		{
+			continue; // Minor version.
+		}
+		auto brand = std::string_view(input).substr(i, 4);
+		if (brand == "avif" || brand == "avis")
+		{
+			return "avif";
+		}
+		if (brand == "heic" || brand == "heix" || brand == "hevc" || brand == "hevx")
+		{
+			return "heic";
+		}
+	}
+	return nullptr;
+}
+
+/*
+ * Rescale 16-bit samples to another bit depth in place, like `toBitDepth`
+ * in JS, used when the encoder does not support the decoded depth.
+ */
+void toBitDepth(DecodedPixels &pixels, uint32_t value)
+{
+	auto count = pixels.data.size() / 2;
+	auto src = reinterpret_cast<const uint16_t *>(pixels.data.data());
+	auto from = (double)((1 << pixels.depth) - 1);
+	auto to = (double)((1 << value) - 1);
+
+	if (value == 8)
+	{
+		auto dist = reinterpret_cast<uint8_t *>(pixels.data.data());
+		for (size_t i = 0; i < count; i++)
+		{
+			dist[i] = (uint8_t)(src[i] / from * to + 0.5);
+		}
+		pixels.data.resize(count);
+	}
+	else
+	{
+		auto dist = reinterpret_cast<uint16_t *>(pixels.data.data());
+		for (size_t i = 0; i < count; i++)
+		{
+			dist[i] = (uint16_t)(src[i] / from * to + 0.5);
+		}
+	}
+	pixels.depth = value;
+}
+
+/**
+ * Decode the input and encode the pixels to another format.
+ *
+ * @param target Name of the encoder, it's the file extension, e.g. "avif".
+ * @param options Options of the encoder, `bitDepth` and `channels` are set here.
+ * @param bitDepths Bit depths supported by the encoder, others are rescaled
+ *                  to the closest lower one in the list, or 8-bit.
+ * @param decodeControl Control and decode options (format, region...) of decoding.
+ * @param encodeControl Control of encoding.
+ */
+val transcode(std::string input, std::string target, val options, val bitDepths, val decodeControl, val encodeControl)
+{
+	auto encode = transcoder::find(transcoder::encoders(), target);
+	if (!encode)
+	{
+		return val("Unsupported target format: " + target);
+	}
+	auto format = detectFormat(input);
+	auto decode = format ? transcoder::find(transcoder::decoders(), format) : nullptr;
+	if (!decode)
+	{
+		return val("Unsupported input format");
+	}
+
+	DecodedPixels pixels;
+	decodedPixels = &pixels;
+	auto result = (*decode)(std::move(input), decodeControl);
+	decodedPixels = nullptr;
+
+	// Decoders return error messages or null, pixels are not set then.
+	if (pixels.channels == 0)
+	{
+		return result;
+	}
+
+	if (pixels.depth != 8)
+	{
+		uint32_t depth = 8;
+		auto length = bitDepths["length"].as<uint32_t>();
+		for (uint32_t i = 0; i < length; i++)
+		{
+			auto value = bitDepths[i].as<uint32_t>();
+			if (value <= pixels.depth && value > depth)
+			{
+				depth = value;
+			}
+		}
+		if (depth != pixels.depth)
+		{
+			toBitDepth(pixels, depth);
+		}
+	}
+
+	options.set("bitDepth", pixels.depth);
+	options.set("channels", pixels.channels);
+	return (*encode)(std::move(pixels.data), pixels.width, pixels.height, options, encodeControl);
+}
+
+EMSCRIPTEN_BINDINGS(icodec_module_Transcoder)
+{
+	function("transcode", &transcode);
+}
@@ -1,19 +1,106 @@
+#include <algorithm>
 #include <emscripten/bind.h>
 #include "icodec.h"
 #include "src/webp/decode.h"
 
-val decode(std::string input)
+namespace
+{
+
+// Size of data fed to the incremental decoder between cancellation checks.
+#define CHUNK_SIZE 65536
+
+/*
+ * WebPDecode does not have a progress hook, so we use the incremental decoder
+ * and feed the input by chunks, the progress is the ratio of consumed bytes.
+ * WebPIUpdate does not copy the data, unlike WebPIAppend.
+ */
+val decodeIncremental(uint8_t *bytes, size_t size, int channels, Progress &progress)
+{
+	WebPDecoderConfig config;
+	if (!WebPInitDecoderConfig(&config))
+	{
+		return val("WebPInitDecoderConfig");
+	}
+	config.output.colorspace = channels == 3 ? MODE_RGB : MODE_RGBA;
+	auto _ = toRAII(&config.output, WebPFreeDecBuffer);
+
+	auto decoder = toRAII(WebPIDecode(nullptr, 0, &config), WebPIDelete);
+	if (!decoder)
+	{
+		return val("Out of memory");
+	}
+
+	auto status = VP8_STATUS_SUSPENDED;
+	for (size_t end = 0; status == VP8_STATUS_SUSPENDED && end < size;)
+	{
+		if (!progress.update((double)end / size))
+		{
+			return val(CANCELLED);
+		}
+		end = std::min(end + CHUNK_SIZE, size);
+		status = WebPIUpdate(decoder.get(), bytes, end);
+	}
+	if (status != VP8_STATUS_OK)
+	{
+		return val::null();
+	}
+
+	auto &rgba = config.output.u.RGBA;
+	return toImageData(rgba.rgba, config.output.width, config.output.height, 8, channels);
+}
+
+/*
+ * WebP can output RGB or RGBA, other formats are converted by JS side.
+ */
+val decode(std::string input, val control)
 {
 	auto bytes = reinterpret_cast<uint8_t *>(input.data());
+	auto channels = channelsOf(control) == 3 ? 3 : CHANNELS_RGBA;
 	int width, height;
 
-	auto rgba = WebPDecodeRGBA(bytes, input.size(), &width, &height);
-	std::unique_ptr<uint8_t[]> _(rgba);
+	// The header is cheap to read, check it before allocating for pixels.
+	if (WebPGetInfo(bytes, input.size(), &width, &height))
+	{
+		if (auto error = Limits(control).check(width, height, (double)width * height * channels))
+		{
+			return val(error);
+		}
+	}
+
+	if (!control.isUndefined() && !control["onProgress"].isUndefined())
+	{
+		Progress progress(control);
+		return decodeIncremental(bytes, input.size(), channels, progress);
+	}
 
-	return rgba ? toImageData(rgba, width, height, 8) : val::null();
+	auto pixels = channels == 3
+		? WebPDecodeRGB(bytes, input.size(), &width, &height)
+		: WebPDecodeRGBA(bytes, input.size(), &width, &height);
+	std::unique_ptr<uint8_t[]> _(pixels);
+
+	return pixels ? toImageData(pixels, width, height, 8, channels) : val::null();
+}
+
+val probe(std::string input)
+{
+	auto bytes = reinterpret_cast<uint8_t *>(input.data());
+	int width, height;
+
+	if (!WebPGetInfo(bytes, input.size(), &width, &height))
+	{
+		return val::null();
+	}
+	return toImageInfo(width, height, 8);
 }
 
 EMSCRIPTEN_BINDINGS(icodec_module_WebP)
 {
+#ifdef ICODEC_TRANSCODER
+	transcoder::decoder("webp", &decode);
+#else
 	function("decode", &decode);
+	function("probe", &probe);
+#endif
+}
+
 }
@@ -1,12 +1,47 @@
+#include <algorithm>
 #include <emscripten/bind.h>
 #include "src/webp/encode.h"
 #include "icodec.h"
 
-val encode(std::string pixels, int width, int height, WebPConfig config)
+namespace
 {
+
+int progressHook(int percent, const WebPPicture *picture)
+{
+	return reinterpret_cast<Progress *>(picture->user_data)->update(percent / 100.0);
+}
+
+int sinkWrite(const uint8_t *data, size_t size, const WebPPicture *picture)
+{
+	reinterpret_cast<SinkBuffer *>(picture->custom_ptr)->write(data, size);
+	return 1;
+}
+
+/*
+ * libwebp drops the alpha of opaque pictures after scanning it, importing them
+ * as RGBX skips creating the alpha plane, the output is the same.
+ */
+int importRGBA(WebPPicture *pic, uint8_t *rgba, int width, int height)
+{
+	auto stride = width * CHANNELS_RGBA;
+	return isOpaque(rgba, (size_t)width * height, COLOR_DEPTH, CHANNELS_RGBA)
+		? WebPPictureImportRGBX(pic, rgba, stride)
+		: WebPPictureImportRGBA(pic, rgba, stride);
+}
+
+/*
+ * If `control.sink` is set, the output is written to it by chunks,
+ * and returns the number of bytes written.
+ */
+val encode(std::string pixels, int width, int height, WebPConfig config, val control)
+{
+	Progress progress(control);
 	auto rgba = reinterpret_cast<uint8_t *>(pixels.data());
 	WebPPicture pic;
 	WebPMemoryWriter writer;
+	auto target = sinkOf(control);
+	auto streaming = !target.isUndefined();
+	SinkBuffer sink(target, streaming ? 65536 : 0);
 
 	if (!WebPPictureInit(&pic))
 	{
@@ -21,22 +56,137 @@ val encode(std::string pixels, int width, int height, WebPConfig config)
 	pic.use_argb = config.lossless || config.use_sharp_yuv || config.preprocessing > 0;
 	pic.width = width;
 	pic.height = height;
-	pic.writer = WebPMemoryWrite;
-	pic.custom_ptr = &writer;
+	pic.writer = streaming ? sinkWrite : WebPMemoryWrite;
+	pic.custom_ptr = streaming ? (void *)&sink : &writer;
+	pic.progress_hook = progressHook;
+	pic.user_data = &progress;
 
 	WebPMemoryWriterInit(&writer);
 
-	auto stride = width * CHANNELS_RGBA;
-	auto ok = WebPPictureImportRGBA(&pic, rgba, stride) && WebPEncode(&config, &pic);
+	auto ok = importRGBA(&pic, rgba, width, height) && WebPEncode(&config, &pic);
 	WebPPictureFree(&pic);
 
 	auto _ = toRAII(&writer, WebPMemoryWriterClear);
-	return ok ? toUint8Array(writer.mem, writer.size) : val("WebPEncode");
+	if (progress.cancelled())
+	{
+		return val(CANCELLED);
+	}
+	if (!ok)
+	{
+		return val("WebPEncode");
+	}
+	if (streaming)
+	{
+		sink.flush();
+		return val(sink.written);
+	}
+	return toUint8Array(writer.mem, writer.size);
+}
+
+/*
+ * Import pixels for the kind of conversion, same as `encode` does:
+ * RGBA to YUV directly, or ARGB which is converted by the encoder,
+ * or ARGB converted with sharp YUV ahead.
+ */
+enum PictureKind
+{
+	PICTURE_YUV,
+	PICTURE_ARGB,
+	PICTURE_SHARP_YUV,
+};
+
+bool importPicture(WebPPicture *pic, uint8_t *rgba, int width, int height, PictureKind kind)
+{
+	pic->use_argb = kind != PICTURE_YUV;
+	pic->width = width;
+	pic->height = height;
+	if (!importRGBA(pic, rgba, width, height))
+	{
+		return false;
+	}
+	return kind != PICTURE_SHARP_YUV || WebPPictureSharpARGBToYUVA(pic);
+}
+
+/*
+ * Encode the image with multiple configs, pixels are imported and converted
+ * once for each kind, then copied for every config, because the encoder
+ * modifies the picture (e.g. cleanup transparent area).
+ *
+ * @param configs Array of WebPConfig objects.
+ * @return Array of encoded data, in the same order as configs.
+ */
+val encodeMany(std::string pixels, int width, int height, val configs, val control)
+{
+	Progress progress(control);
+	auto rgba = reinterpret_cast<uint8_t *>(pixels.data());
+	auto count = configs["length"].as<size_t>();
+	auto results = val::array();
+
+	WebPPicture pictures[3];
+	bool imported[3] = {false, false, false};
+	for (auto &picture : pictures)
+	{
+		if (!WebPPictureInit(&picture))
+		{
+			return val("WebPPictureInit");
+		}
+	}
+	auto _ = toRAII(pictures, [](WebPPicture *p)
+	{
+		std::for_each(p, p + 3, WebPPictureFree);
+	});
+
+	for (size_t i = 0; i < count; i++)
+	{
+		auto config = configs[i].as<WebPConfig>();
+		config.qmax = 100;
+		progress.range((double)i / count, (double)(i + 1) / count);
+
+		auto kind = config.lossless || config.preprocessing > 0
+			? PICTURE_ARGB
+			: config.use_sharp_yuv ? PICTURE_SHARP_YUV : PICTURE_YUV;
+		if (!imported[kind])
+		{
+			if (!importPicture(&pictures[kind], rgba, width, height, kind))
+			{
+				return val("WebPPictureImportRGBA");
+			}
+			imported[kind] = true;
+		}
+
+		WebPPicture pic;
+		if (!WebPPictureCopy(&pictures[kind], &pic))
+		{
+			return val("Out of memory");
+		}
+		auto _pic = toRAII(&pic, WebPPictureFree);
+
+		WebPMemoryWriter writer;
+		WebPMemoryWriterInit(&writer);
+		auto _writer = toRAII(&writer, WebPMemoryWriterClear);
+
+		pic.writer = WebPMemoryWrite;
+		pic.custom_ptr = &writer;
+		pic.progress_hook = progressHook;
+		pic.user_data = &progress;
+
+		if (!WebPEncode(&config, &pic))
+		{
+			return val(progress.cancelled() ? CANCELLED : "WebPEncode");
+		}
+		results.call<void>("push", toUint8Array(writer.mem, writer.size));
+	}
+	return results;
 }
 
 EMSCRIPTEN_BINDINGS(icodec_module_WebP)
 {
+#ifdef ICODEC_TRANSCODER
+	transcoder::encoder("webp", &encode);
+#else
 	function("encode", &encode);
+	function("encodeMany", &encodeMany);
+#endif
 
 	// Since `value_object` uses this enum, it must be register.
 	enum_<WebPImageHint>("WebPImageHint")
@@ -73,3 +223,5 @@ EMSCRIPTEN_BINDINGS(icodec_module_WebP)
 		.field("useDeltaPalette", &WebPConfig::use_delta_palette)
 		.field("sharpYUV", &WebPConfig::use_sharp_yuv);
 }
+
+}
@@ -2,10 +2,44 @@
 #include "icodec.h"
 #include "src/wp2/decode.h"
 
-val decode(std::string input)
+/*
+ * Forward progress of libwebp2 to our Progress, returning false aborts the operation.
+ */
+struct ProgressHook : public WP2::ProgressHook
 {
+	Progress progress;
+
+	explicit ProgressHook(val control) : progress(control) {}
+
+	bool OnUpdate(double value) override
+	{
+		return progress.update(value);
+	}
+};
+
+val decode(std::string input, val control)
+{
+	// Check the header before allocating for pixels.
+	WP2::BitstreamFeatures features;
+	if (features.Read(reinterpret_cast<uint8_t *>(input.data()), input.size()) == WP2_STATUS_OK)
+	{
+		auto bytes = (double)features.width * features.height * CHANNELS_RGBA;
+		if (auto error = Limits(control).check(features.width, features.height, bytes))
+		{
+			return val(error);
+		}
+	}
+
 	auto buffer = WP2::ArgbBuffer(WP2_RGBA_32);
-	auto status = WP2::Decode(input, &buffer);
+	ProgressHook hook(control);
+	WP2::DecoderConfig config;
+	config.progress_hook = &hook;
+
+	auto status = WP2::Decode(input, &buffer, config);
+	if (hook.progress.cancelled())
+	{
+		return val(CANCELLED);
+	}
 	if (status != WP2_STATUS_OK)
 	{
 		return val(WP2GetStatusText(status));
@@ -13,7 +47,21 @@ val decode(std::string input)
 	return toImageData(buffer.GetRow8(0), buffer.width(), buffer.height(), 8);
 }
 
+val probe(std::string input)
+{
+	auto bytes = reinterpret_cast<uint8_t *>(input.data());
+	WP2::BitstreamFeatures features;
+
+	auto status = features.Read(bytes, input.size());
+	if (status != WP2_STATUS_OK)
+	{
+		return val(WP2GetStatusText(status));
+	}
+	return toImageInfo(features.width, features.height, 8);
+}
+
 EMSCRIPTEN_BINDINGS(icodec_module_WebP2)
 {
 	function("decode", &decode);
+	function("probe", &probe);
 }
@@ -2,6 +2,9 @@
 #include "icodec.h"
 #include "src/wp2/encode.h"
 
+namespace
+{
+
 #define CHECK_STATUS(s) if (s != WP2_STATUS_OK)		\
 {                                   				\
 	return val(WP2GetStatusText(s));				\
@@ -18,12 +21,50 @@ struct WP2Options
 	int csp_type;
 	int error_diffusion;
 	bool use_random_matrix;
+	bool keep_alpha;
+};
+
+/*
+ * Forward progress of libwebp2 to our Progress, returning false aborts the operation.
+ */
+struct ProgressHook : public WP2::ProgressHook
+{
+	Progress progress;
+
+	explicit ProgressHook(val control) : progress(control) {}
+
+	bool OnUpdate(double value) override
+	{
+		return progress.update(value);
+	}
 };
 
-val encode(std::string pixels, uint32_t width, uint32_t height, WP2Options options)
+/*
+ * Send the output of libwebp2 to the JS sink by chunks.
+ */
+struct SinkWriter : public WP2::Writer
+{
+	SinkBuffer buffer;
+
+	explicit SinkWriter(val sink) : buffer(sink, sink.isUndefined() ? 0 : 65536) {}
+
+	bool Append(const void *data, size_t data_size) override
+	{
+		buffer.write(reinterpret_cast<const uint8_t *>(data), data_size);
+		return true;
+	}
+};
+
+/*
+ * If `control.sink` is set, the output is written to it by chunks,
+ * and returns the number of bytes written.
+ */
+val encode(std::string pixels, uint32_t width, uint32_t height, WP2Options options, val control)
 {
 	auto rgba = reinterpret_cast<uint8_t *>(pixels.data());
 	WP2::EncoderConfig config;
+	ProgressHook hook(control);
+	config.progress_hook = &hook;
 
 	config.quality = options.quality;
 	config.alpha_quality = options.alpha_quality;
@@ -45,17 +86,38 @@ val encode(std::string pixels, uint32_t width, uint32_t height, WP2Options optio
 	}
 
 	auto src = WP2::ArgbBuffer(format);
-	CHECK_STATUS(src.Import(WP2_RGBA_32, width, height, rgba, CHANNELS_RGBA * width));
+	// RGBX skips the alpha of opaque images.
+	auto opaque = !options.keep_alpha && isOpaque(rgba, (size_t)width * height, COLOR_DEPTH, CHANNELS_RGBA);
+	CHECK_STATUS(src.Import(opaque ? WP2_RGBX_32 : WP2_RGBA_32, width, height, rgba, CHANNELS_RGBA * width));
 
+	auto sink = sinkOf(control);
 	WP2::MemoryWriter memory_writer;
-	CHECK_STATUS(WP2::Encode(src, &memory_writer, config));
+	SinkWriter sink_writer(sink);
+	auto streaming = !sink.isUndefined();
 
+	auto writer = streaming ? static_cast<WP2::Writer *>(&sink_writer) : &memory_writer;
+	auto status = WP2::Encode(src, writer, config);
+	if (hook.progress.cancelled())
+	{
+		return val(CANCELLED);
+	}
+	CHECK_STATUS(status);
+
+	if (streaming)
+	{
+		sink_writer.buffer.flush();
+		return val(sink_writer.buffer.written);
+	}
 	return toUint8Array(memory_writer.mem_, memory_writer.size_);
 }
 
 EMSCRIPTEN_BINDINGS(icodec_module_WebP2)
 {
+#ifdef ICODEC_TRANSCODER
+	transcoder::encoder("wp2", &encode);
+#else
 	function("encode", &encode);
+#endif
 
 	value_object<WP2Options>("WP2Options")
 		.field("quality", &WP2Options::quality)
@@ -66,5 +128,8 @@ EMSCRIPTEN_BINDINGS(icodec_module_WebP2)
 		.field("sns", &WP2Options::sns)
 		.field("cspType", &WP2Options::csp_type)
 		.field("errorDiffusion", &WP2Options::error_diffusion)
-		.field("useRandomMatrix", &WP2Options::use_random_matrix);
+		.field("useRandomMatrix", &WP2Options::use_random_matrix)
+		.field("keepAlpha", &WP2Options::keep_alpha);
+}
+
 }
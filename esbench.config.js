@@ -1,4 +1,4 @@
-import { defineConfig, inProcessExecutor, WebRemoteExecutor } from "esbench/host";
+import { defineConfig, inProcessExecutor, rawReporter, textReporter, WebRemoteExecutor } from "esbench/host";
 
 const webExecutor = new WebRemoteExecutor({
 	open: {},
@@ -6,8 +6,12 @@ const webExecutor = new WebRemoteExecutor({
 });
 
 export default defineConfig({
+	reporters: [
+		textReporter(),
+		rawReporter("reports/result.json"),
+	],
 	toolchains: [{
-		include: ["./benchmark/encode.ts"],
+		include: ["./benchmark/encode.ts", "./benchmark/matrix.ts"],
 		executors: [inProcessExecutor],
 	},{
 		include: ["./benchmark/decode.ts"],
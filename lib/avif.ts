@@ -1,6 +1,6 @@
 import wasmFactoryEnc from "../dist/avif-enc.js";
 import wasmFactoryDec from "../dist/avif-dec.js";
-import { check, encodeES, ImageDataLike, loadES, WasmSource } from "./common.js";
+import { ByteSource, Control, decodeES, DecodeOptions, encodeES, encodeManyES, encodeTiledES, ImageDataLike, loadES, PixelFormat, selectDecoder, selectEncoder, selectStreamDecoder, TileSource, toWasmOptions, WasmSource } from "./common.js";
 
 export enum Subsampling {
 	YUV444 = 1,
@@ -94,6 +94,14 @@ export interface Options {
 	 * @default false
 	 */
 	sharpYUV?: boolean;
+
+	/**
+	 * Encode the alpha channel even if all pixels are opaque, by default the
+	 * alpha is detected at import and the image is encoded without the alpha item.
+	 *
+	 * @default false
+	 */
+	keepAlpha?: boolean;
 }
 
 export const defaultOptions: Required<Options> = {
@@ -109,27 +117,105 @@ export const defaultOptions: Required<Options> = {
 	denoiseLevel: 0,
 	tune: AVIFTune.Auto,
 	sharpYUV: false,
+	keepAlpha: false,
 };
 
 export const mimeType = "image/avif";
 export const extension = "avif";
 export const bitDepth = [8, 10, 12, 16];
 
+// Pixel formats encoded without conversion, RGB does not create the alpha plane.
+const inputFormats: PixelFormat[] = ["rgb", "rgba"];
+
+// Rough peak memory usage per pixel, used to select 32-bit or 64-bit WASM.
+export const bytesPerPixel = 24;
+
+// YUV and alpha planes of all grid cells, and the encoder state.
+const tiledBytesPerPixel = 4;
+
 let encoderWASM: any;
 let decoderWASM: any;
+let encoderWASM64: any;
+let decoderWASM64: any;
+
+export async function loadEncoder(input?: WasmSource, relaxed?: boolean) {
+	const loadRelaxed = () => import("../dist/avif-enc-relaxed.js");
+	return encoderWASM ??= await loadES(wasmFactoryEnc, input, relaxed, loadRelaxed);
+}
+
+export async function loadDecoder(input?: WasmSource, relaxed?: boolean) {
+	const loadRelaxed = () => import("../dist/avif-dec-relaxed.js");
+	return decoderWASM ??= await loadES(wasmFactoryDec, input, relaxed, loadRelaxed);
+}
+
+/**
+ * Load the 64-bit encoder, which is used for images too large for the 32-bit.
+ */
+export async function loadEncoder64(input?: WasmSource) {
+	return encoderWASM64 ??= await loadES((await import("../dist/avif-enc-64.js")).default, input);
+}
+
+/**
+ * Load the 64-bit decoder, which is used for images too large for the 32-bit.
+ */
+export async function loadDecoder64(input?: WasmSource) {
+	return decoderWASM64 ??= await loadES((await import("../dist/avif-dec-64.js")).default, input);
+}
+
+export function encode(image: ImageDataLike, options?: Options, control?: Control) {
+	const wasm = selectEncoder("AVIF Encode", image, bytesPerPixel, encoderWASM, encoderWASM64, control);
+	return encodeES("AVIF Encode", wasm, defaultOptions, image, options, control, inputFormats);
+}
+
+/**
+ * Encode the image with each of the options, the RGB to YUV conversion
+ * is shared by options with the same subsampling and color settings.
+ */
+export function encodeMany(image: ImageDataLike, optionsList: Options[], control?: Control) {
+	const wasm = selectEncoder("AVIF Encode", image, bytesPerPixel, encoderWASM, encoderWASM64, control);
+	return encodeManyES("AVIF Encode", wasm, defaultOptions, image, optionsList, control, inputFormats);
+}
 
-export async function loadEncoder(input?: WasmSource) {
-	return encoderWASM ??= await loadES(wasmFactoryEnc, input);
+/**
+ * Size of grid cells, AVIF allows at most 256 columns and rows,
+ * and it must be even for chroma subsampling.
+ */
+function cellSize(size: number) {
+	const min = Math.ceil(size / 256);
+	return Math.max(1024, min + (min & 1));
 }
 
-export async function loadDecoder(input?: WasmSource) {
-	return decoderWASM ??= await loadES(wasmFactoryDec, input);
+/**
+ * Encode a large image as an AVIF grid, pixels are pulled from the source by cells.
+ * It's not streaming, planes of all cells are kept until encoding.
+ * 16-bit is not supported.
+ */
+export function encodeTiled(source: TileSource, options?: Options, control?: Control) {
+	const wasm = selectEncoder("AVIF Encode", source, tiledBytesPerPixel, encoderWASM, encoderWASM64, control);
+	const { width, height, depth } = source;
+	const tiles = {
+		width,
+		height,
+		depth,
+		tileWidth: cellSize(width),
+		tileHeight: cellSize(height),
+		read: source.read.bind(source),
+	};
+	return encodeTiledES("AVIF Encode", wasm, defaultOptions, tiles, options, control);
 }
 
-export function encode(image: ImageDataLike, options?: Options) {
-	return encodeES("AVIF Encode", encoderWASM, defaultOptions, image, options);
+export function decode(input: BufferSource, options?: DecodeOptions) {
+	const wasm = selectDecoder("AVIF Decode", input, bytesPerPixel, decoderWASM, decoderWASM64, options);
+	const result = wasm.decode(input, toWasmOptions("AVIF Decode", options));
+	return decodeES<ImageData>("AVIF Decode", result, options);
 }
 
-export function decode(input: BufferSource) {
-	return check<ImageData>(decoderWASM.decode(input), "AVIF Decode");
+/**
+ * Like `decode`, but the input is read from the source as libavif requests,
+ * only boxes and the compressed image item are loaded into memory.
+ */
+export function decodeStream(source: ByteSource, options?: DecodeOptions) {
+	const wasm = selectStreamDecoder("AVIF Decode", source, bytesPerPixel, decoderWASM, decoderWASM64, options);
+	const result = wasm.decodeStream(source, toWasmOptions("AVIF Decode", options));
+	return decodeES<ImageData>("AVIF Decode", result, options);
 }
@@ -3,28 +3,102 @@
  *
  * - If is a string, it's the URL of WASM file to fetch.
  * - If is BufferSource, it will be treated as the WASM bytes.
+ * - If is WebAssembly.Module, it's instantiated without compiling,
+ *   the module can be shared between workers via `postMessage`.
+ * - If is NativeAddon, it's used as is, see `icodec/node`.
  */
-export type WasmSource = string | BufferSource;
+export type WasmSource = string | BufferSource | WebAssembly.Module | NativeAddon;
 
-export function loadES(factory: any, source?: WasmSource) {
+/**
+ * Exports of a native Node addon built from the same glue code,
+ * it has the same functions as the Emscripten module.
+ */
+export interface NativeAddon {
+	native: true;
+}
+
+/**
+ * Whether the runtime supports WebAssembly relaxed SIMD, detected by validating
+ * a tiny module which contains a `i8x16.relaxed_swizzle` instruction.
+ */
+export const relaxedSIMD = WebAssembly.validate(new Uint8Array([
+	0, 97, 115, 109, 1, 0, 0, 0, 1, 5, 1, 96, 0, 1, 123, 3, 2, 1, 0, 10, 15, 1, 13, 0,
+	65, 1, 253, 15, 65, 2, 253, 15, 253, 128, 2, 11,
+]));
+
+type ESModuleLoader = () => Promise<{ default: any }>;
+
+/**
+ * Instantiate the Emscripten module, some codecs have relaxed SIMD variants,
+ * it's used if the runtime supports and the source is not specified.
+ *
+ * @param factory The factory of the baseline variant.
+ * @param source The WASM file, must match the selected variant.
+ * @param relaxed Use the relaxed SIMD variant, default is auto.
+ * @param loadRelaxed Function to import the relaxed SIMD variant.
+ */
+export async function loadES(factory: any, source?: WasmSource, relaxed?: boolean, loadRelaxed?: ESModuleLoader) {
+	// Only native addons have the `native` property, sources can be strings.
+	if (typeof source === "object" && source !== null && (source as NativeAddon).native === true) {
+		return source;
+	}
+	relaxed ??= source === undefined && relaxedSIMD;
+	if (relaxed && loadRelaxed) {
+		factory = (await loadRelaxed()).default;
+	}
+	if (source instanceof WebAssembly.Module) {
+		return instantiateModule(factory, source);
+	}
 	return typeof source === "string"
 		? factory({ locateFile: () => source })
 		: factory({ wasmBinary: source });
 }
 
+/**
+ * Emscripten does not accept a compiled module directly, but we can
+ * instantiate it in the `instantiateWasm` hook.
+ */
+function instantiateModule(factory: any, module: WebAssembly.Module) {
+	return new Promise((resolve, reject) => {
+		function instantiateWasm(imports: WebAssembly.Imports, receive: any) {
+			WebAssembly.instantiate(module, imports)
+				.then(instance => receive(instance, module), reject);
+			return {};
+		}
+		factory({ instantiateWasm }).then(resolve, reject);
+	});
+}
+
+/**
+ * Layout of pixels, channels are interleaved in the order of the name.
+ */
+export type PixelFormat = "gray" | "grayAlpha" | "rgb" | "rgba";
+
+const CHANNELS: Record<PixelFormat, number> = {
+	gray: 1,
+	grayAlpha: 2,
+	rgb: 3,
+	rgba: 4,
+};
+
 export interface ImageDataLike {
 	width: number;
 	height: number;
 	depth: number;
 	data: Uint8Array | Uint8ClampedArray;
+
+	/**
+	 * Pixel format of the data, default is "rgba".
+	 */
+	format?: PixelFormat;
 }
 
 export function toBitDepth(image: ImageDataLike, value: number) {
-	const { data, width, height, depth = 8 } = image;
+	const { data, width, height, depth = 8, format = "rgba" } = image;
 	if (value === depth) {
 		return image;
 	}
-	const pixels = width * height * 4;
+	const pixels = width * height * CHANNELS[format];
 	const dist = value === 8
 		? new Uint8ClampedArray(pixels)
 		: new Uint16Array(pixels);
@@ -39,7 +113,586 @@ export function toBitDepth(image: ImageDataLike, value: number) {
 	}
 
 	const nd = new Uint8ClampedArray(dist.buffer, dist.byteOffset, dist.byteLength);
-	return _icodec_ImageData(nd, width, height, value);
+	return _icodec_ImageData(nd, width, height, value, format);
+}
+
+/**
+ * Convert the image to another pixel format. Gray is computed from RGB
+ * by BT.601 luma weights, and opaque alpha is added if missing.
+ *
+ * @param format The target format, return the image itself if it's already in.
+ */
+export function toPixelFormat(image: ImageDataLike, format: PixelFormat = "rgba") {
+	const { data, width, height, depth = 8, format: from = "rgba" } = image;
+	if (from === format) {
+		return image;
+	}
+	const sc = CHANNELS[from];
+	const dc = CHANNELS[format];
+	const length = width * height * sc;
+	const src = depth === 8
+		? data
+		: new Uint16Array(data.buffer, data.byteOffset, length);
+	const dist = depth === 8
+		? new Uint8ClampedArray(width * height * dc)
+		: new Uint16Array(width * height * dc);
+
+	const opaque = (1 << depth) - 1;
+	for (let i = 0, j = 0; i < length; i += sc, j += dc) {
+		if (dc < 3) {
+			dist[j] = sc < 3 ? src[i] : Math.round(0.299 * src[i] + 0.587 * src[i + 1] + 0.114 * src[i + 2]);
+		} else if (sc < 3) {
+			dist[j] = dist[j + 1] = dist[j + 2] = src[i];
+		} else {
+			dist[j] = src[i];
+			dist[j + 1] = src[i + 1];
+			dist[j + 2] = src[i + 2];
+		}
+		if (dc % 2 === 0) {
+			dist[j + dc - 1] = sc % 2 === 0 ? src[i + sc - 1] : opaque;
+		}
+	}
+
+	const nd = new Uint8ClampedArray(dist.buffer, dist.byteOffset, dist.byteLength);
+	return _icodec_ImageData(nd, width, height, depth, format);
+}
+
+/**
+ * Convert the image to a format accepted by the encoder, RGBA is always accepted.
+ */
+function toInputFormat(image: ImageDataLike, formats: PixelFormat[]) {
+	const { format = "rgba" } = image;
+	return formats.includes(format) ? image : toPixelFormat(image, "rgba");
+}
+
+type ImageSize = Pick<ImageDataLike, "width" | "height"> & { depth?: number };
+
+/**
+ * Source of tiled encoding, pixels are pulled by rectangles on demand,
+ * so the whole image does not need to be in memory.
+ */
+export interface TileSource {
+	width: number;
+	height: number;
+
+	/**
+	 * Bit depth of pixels, default is 8.
+	 */
+	depth?: number;
+
+	/**
+	 * Return RGBA pixels of the rectangle, rows are packed without padding,
+	 * the byte length must be `width * height * 4 * (depth > 8 ? 2 : 1)`.
+	 */
+	read(x: number, y: number, width: number, height: number): Uint8Array | Uint8ClampedArray;
+
+	/**
+	 * Whether all pixels are opaque, if not specified, JXL reads the source once
+	 * to detect it before encoding, unless `keepAlpha` is set.
+	 */
+	opaque?: boolean;
+}
+
+/**
+ * Random access source of stream decoding, e.g. a file descriptor,
+ * bytes are pulled by chunks, so the whole file is not in memory.
+ */
+export interface ByteSource {
+	/**
+	 * Total length in bytes.
+	 */
+	size: number;
+
+	/**
+	 * Synchronously read bytes at the position into the buffer, which is a view
+	 * of WASM memory and invalid after return. Return the number of bytes read,
+	 * 0 means the end.
+	 */
+	read(buffer: Uint8Array, position: number): number;
+}
+
+/**
+ * Receives encoded data by chunks, in order.
+ */
+export interface ByteSink {
+	/**
+	 * The chunk is a view of WASM memory, it must be consumed or copied before return.
+	 */
+	write(chunk: Uint8Array): void;
+}
+
+/**
+ * Compute the source range and weights of each destination pixel for area averaging.
+ */
+function areaWeights(source: number, dest: number) {
+	const scale = source / dest;
+	const result = [];
+	for (let i = 0; i < dest; i++) {
+		const begin = i * scale;
+		const end = begin + scale;
+		const first = Math.floor(begin);
+		const weights = [];
+		for (let j = first; j < Math.min(Math.ceil(end), source); j++) {
+			weights.push((Math.min(j + 1, end) - Math.max(j, begin)) / scale);
+		}
+		result.push({ first, weights });
+	}
+	return result;
+}
+
+/**
+ * Resize the image by area averaging with premultiplied alpha,
+ * which is good for downscaling, but is blocky for upscaling.
+ * The result is always RGBA.
+ */
+export function resize(image: ImageDataLike, width: number, height: number) {
+	if (image.width === width && image.height === height) {
+		return image;
+	}
+	image = toPixelFormat(image, "rgba");
+	const { data, width: sw, height: sh, depth = 8 } = image;
+	const src = depth === 8
+		? data
+		: new Uint16Array(data.buffer, data.byteOffset, sw * sh * 4);
+	const columns = areaWeights(sw, width);
+	const rows = areaWeights(sh, height);
+
+	// Horizontal pass, colors are premultiplied by alpha.
+	const temp = new Float32Array(width * sh * 4);
+	for (let y = 0, o = 0; y < sh; y++) {
+		for (const { first, weights } of columns) {
+			let r = 0, g = 0, b = 0, a = 0;
+			for (let k = 0, i = (y * sw + first) * 4; k < weights.length; k++, i += 4) {
+				const w = weights[k] * src[i + 3];
+				r += src[i] * w;
+				g += src[i + 1] * w;
+				b += src[i + 2] * w;
+				a += w;
+			}
+			temp[o++] = r;
+			temp[o++] = g;
+			temp[o++] = b;
+			temp[o++] = a;
+		}
+	}
+
+	// Vertical pass, then divide colors by the alpha.
+	const pixels = width * height * 4;
+	const dist = depth === 8 ? new Uint8ClampedArray(pixels) : new Uint16Array(pixels);
+	for (let y = 0, o = 0; y < height; y++) {
+		const { first, weights } = rows[y];
+		for (let x = 0; x < width; x++, o += 4) {
+			let r = 0, g = 0, b = 0, a = 0;
+			for (let k = 0, i = (first * width + x) * 4; k < weights.length; k++, i += width * 4) {
+				const w = weights[k];
+				r += temp[i] * w;
+				g += temp[i + 1] * w;
+				b += temp[i + 2] * w;
+				a += temp[i + 3] * w;
+			}
+			if (a > 0) {
+				dist[o] = Math.round(r / a);
+				dist[o + 1] = Math.round(g / a);
+				dist[o + 2] = Math.round(b / a);
+			}
+			dist[o + 3] = Math.round(a);
+		}
+	}
+
+	const nd = new Uint8ClampedArray(dist.buffer, dist.byteOffset, dist.byteLength);
+	return _icodec_ImageData(nd, width, height, depth);
+}
+
+/**
+ * A codec module used by `encodeMany`.
+ */
+interface BatchEncoder<T> {
+	encode(image: ImageDataLike, options?: T, control?: Control): Uint8Array;
+
+	encodeMany?(image: ImageDataLike, optionsList: T[], control?: Control): Uint8Array[];
+}
+
+/**
+ * An output of `encodeMany`.
+ */
+export interface EncodeTarget<T = any> {
+	/**
+	 * The codec module, e.g. `avif`, the encoder must be loaded.
+	 */
+	codec: BatchEncoder<T>;
+
+	/**
+	 * Resize the image to the width, if only one of width and height
+	 * is specified, the other is calculated by the aspect ratio.
+	 */
+	width?: number;
+	height?: number;
+
+	options?: T;
+}
+
+/**
+ * Encode one image to multiple outputs (sizes, formats and options) in a single call.
+ *
+ * Resizing is done once for each size, and codecs which have `encodeMany`
+ * (AVIF, WebP) import the pixels and convert RGB to YUV once for all their targets.
+ *
+ * @param control The timeout applies to the whole batch.
+ * @return Encoded data in the same order as targets.
+ */
+export function encodeMany(image: ImageDataLike, targets: EncodeTarget[], control: Control = {}) {
+	const { timeout, onProgress } = control;
+	const deadline = timeout === undefined ? Infinity : performance.now() + timeout;
+	const outputs = new Array<Uint8Array>(targets.length);
+
+	// Control of a call, with the remaining time and the progress mapped to the batch.
+	const slice = (start: number, count: number): Control => ({
+		...control,
+		timeout: deadline === Infinity ? undefined : deadline - performance.now(),
+		onProgress: onProgress && (p => onProgress((start + p * count) / targets.length)),
+	});
+
+	// Group targets by size, then by codec.
+	const sizes = new Map<string, SizeGroup>();
+	for (let i = 0; i < targets.length; i++) {
+		const { codec } = targets[i];
+		const [width, height] = resolveSize(image, targets[i]);
+		const key = `${width}x${height}`;
+
+		let group = sizes.get(key);
+		if (!group) {
+			sizes.set(key, group = { width, height, codecs: new Map() });
+		}
+		let indexes = group.codecs.get(codec);
+		if (!indexes) {
+			group.codecs.set(codec, indexes = []);
+		}
+		indexes.push(i);
+	}
+
+	let done = 0;
+	for (const { width, height, codecs } of sizes.values()) {
+		const resized = resize(image, width, height);
+
+		for (const [codec, indexes] of codecs) {
+			const optionsList = indexes.map(i => targets[i].options);
+			const results = codec.encodeMany
+				? codec.encodeMany(resized, optionsList, slice(done, indexes.length))
+				: optionsList.map((o, i) => codec.encode(resized, o, slice(done + i, 1)));
+
+			indexes.forEach((target, i) => outputs[target] = results[i]);
+			done += indexes.length;
+		}
+	}
+	return outputs;
+}
+
+interface SizeGroup {
+	width: number;
+	height: number;
+	codecs: Map<BatchEncoder<any>, number[]>;
+}
+
+function resolveSize(image: ImageDataLike, target: EncodeTarget) {
+	const { width, height } = target;
+	if (width === undefined && height === undefined) {
+		return [image.width, image.height];
+	}
+	if (height === undefined) {
+		return [width!, Math.max(1, Math.round(image.height * width! / image.width))];
+	}
+	if (width === undefined) {
+		return [Math.max(1, Math.round(image.width * height / image.height)), height];
+	}
+	return [width, height];
+}
+
+/**
+ * Statistics of pixels used by `encodeAuto` to choose the format.
+ */
+export interface ImageStats {
+	/**
+	 * Number of unique RGBA colors, counting stops at 257.
+	 */
+	colors: number;
+
+	/**
+	 * "binary" if alpha values are only 0 and 255.
+	 */
+	alpha: "opaque" | "binary" | "translucent";
+
+	/**
+	 * Ratio of horizontal neighbors that have the same color, high for graphics.
+	 */
+	flat: number;
+
+	/**
+	 * Ratio of horizontal neighbors with a strong luma step (>= 32).
+	 */
+	edges: number;
+
+	/**
+	 * Mean luma difference of other horizontal neighbors, estimates noise and texture.
+	 */
+	noise: number;
+}
+
+const MAX_PALETTE = 256;
+
+// Rows of edges and noise are sampled, it's enough for the estimation.
+const SAMPLE_ROWS = 256;
+
+/**
+ * Analyze the image, pixels are read as 32-bit words, so comparisons take
+ * one operation. Color counting stops once it exceeds the palette size,
+ * edges and noise are estimated from sampled rows.
+ * Images of higher bit depth are reduced to 8-bit first.
+ */
+export function analyzeImage(image: ImageDataLike): ImageStats {
+	image = toPixelFormat(toBitDepth(image, 8), "rgba");
+	const { width, height } = image;
+	let { data } = image;
+	if (data.byteOffset % 4 !== 0) {
+		data = data.slice();
+	}
+	// Little-endian, alpha is the highest byte.
+	const pixels = new Uint32Array(data.buffer, data.byteOffset, width * height);
+
+	const alpha = alphaOf(pixels);
+
+	// Photos exceed the palette after a few pixels, only graphics are fully scanned.
+	const colors = new Set<number>();
+	for (let i = 0, last = -1; i < pixels.length && colors.size <= MAX_PALETTE; i++) {
+		const p = pixels[i];
+		if (p !== last) {
+			colors.add(last = p);
+		}
+	}
+
+	let flat = 0, edges = 0, others = 0, sum = 0;
+	const step = Math.max(1, Math.floor(height / SAMPLE_ROWS));
+	for (let y = 0; y < height; y += step) {
+		let i = y * width;
+		let previous = luma(pixels[i]);
+		for (const end = i + width - 1; i < end; i++) {
+			const current = luma(pixels[i + 1]);
+			const delta = Math.abs(current - previous);
+			if (pixels[i] === pixels[i + 1]) {
+				flat++;
+			} else if (delta >= 32) {
+				edges++;
+			} else {
+				sum += delta;
+				others++;
+			}
+			previous = current;
+		}
+	}
+
+	const pairs = Math.max(1, flat + edges + others);
+	return {
+		colors: colors.size,
+		alpha,
+		flat: flat / pairs,
+		edges: edges / pairs,
+		noise: others ? sum / others : 0,
+	};
+}
+
+const OPAQUE = 0xFF000000 | 0;
+
+/*
+ * Alpha needs all pixels, AND of blocks skips opaque ones without branches
+ * like `isOpaque` in WASM, others are scanned until a translucent pixel.
+ */
+function alphaOf(pixels: Uint32Array): ImageStats["alpha"] {
+	let transparent = false;
+	for (let start = 0; start < pixels.length; start += 4096) {
+		const end = Math.min(pixels.length, start + 4096);
+		let all = OPAQUE;
+		for (let i = start; i < end; i++) {
+			all &= pixels[i];
+		}
+		if (all === OPAQUE) {
+			continue;
+		}
+		for (let i = start; i < end; i++) {
+			const a = pixels[i] >>> 24;
+			if (a === 0) {
+				transparent = true;
+			} else if (a !== 255) {
+				return "translucent";
+			}
+		}
+	}
+	return transparent ? "binary" : "opaque";
+}
+
+// Approximation of BT.601 luma by integer weights (2, 5, 1) / 8.
+function luma(p: number) {
+	return ((p & 0xFF) * 2 + (p >>> 8 & 0xFF) * 5 + (p >>> 16 & 0xFF)) >> 3;
+}
+
+/**
+ * Graphics (screenshots, text, illustrations) have large flat areas, or
+ * sharp edges without noise, they compress better in lossless formats.
+ */
+function isGraphic(stats: ImageStats) {
+	return stats.flat >= 0.5 || (stats.flat >= 0.25 && stats.edges >= 0.05 && stats.noise < 6);
+}
+
+interface AutoEncoder<T> extends BatchEncoder<T> {
+	bitDepth: number[];
+}
+
+/**
+ * Codec modules `encodeAuto` can choose from, only loaded encoders should be passed.
+ */
+export interface AutoCodecs {
+	png?: AutoEncoder<any>;
+	jxl?: AutoEncoder<any>;
+	webp?: AutoEncoder<any>;
+	avif?: AutoEncoder<any>;
+	jpeg?: AutoEncoder<any>;
+}
+
+export interface AutoConstraints {
+	/**
+	 * Encoders to choose from, e.g. `{ png, webp, avif }`.
+	 */
+	codecs: AutoCodecs;
+
+	/**
+	 * Quality of lossy encoding, in the scale of each codec.
+	 *
+	 * @default 75
+	 */
+	quality?: number;
+
+	/**
+	 * true to only use lossless modes, false to only use lossy, default is chosen by the content.
+	 */
+	lossless?: boolean;
+
+	/**
+	 * Try the next candidate if the output is larger than this.
+	 */
+	maxBytes?: number;
+}
+
+export interface AutoResult {
+	/**
+	 * The key of the chosen codec in `AutoConstraints.codecs`.
+	 */
+	codec: keyof AutoCodecs;
+
+	options: any;
+
+	data: Uint8Array;
+
+	stats: ImageStats;
+}
+
+interface Candidate {
+	codec: keyof AutoCodecs;
+	options: any;
+	lossless: boolean;
+}
+
+/*
+ * Lossless output larger than this (bits per pixel) means the content is not
+ * a graphic, a lossy encoding is much smaller.
+ */
+const LOSSLESS_MAX_BPP = 4;
+
+/*
+ * Candidates of the same kind are ordered by compression, if one exceeds
+ * `maxBytes` by this ratio, the rest of the kind cannot fit either.
+ */
+const LOSING_RATIO = 1.5;
+
+function planCandidates(stats: ImageStats, depth: number, constraints: AutoConstraints) {
+	const { codecs, quality = 75, lossless = isGraphic(stats) || stats.colors <= MAX_PALETTE } = constraints;
+	const list: Candidate[] = [];
+
+	if (lossless) {
+		if (stats.colors <= MAX_PALETTE && depth === 8) {
+			const options = { quantize: true, quality: 100, colors: Math.max(2, stats.colors), dithering: 0 };
+			list.push({ codec: "png", options, lossless: true });
+		}
+		list.push({ codec: "jxl", options: { lossless: true, modular: true }, lossless: true });
+		list.push({ codec: "webp", options: { lossless: true }, lossless: true });
+		list.push({ codec: "png", options: { quantize: false }, lossless: true });
+	}
+	if (constraints.lossless !== true) {
+		list.push({ codec: "avif", options: { quality }, lossless: false });
+		list.push({ codec: "jxl", options: { quality }, lossless: false });
+		list.push({ codec: "webp", options: { quality }, lossless: false });
+		if (stats.alpha === "opaque") {
+			list.push({ codec: "jpeg", options: { quality }, lossless: false });
+		}
+	}
+	return list.filter(c => codecs[c.codec]?.bitDepth.includes(depth));
+}
+
+/**
+ * Choose the format and mode by the content and encode the image.
+ *
+ * `analyzeImage` classifies the image, images with few colors are encoded to
+ * palette PNG, graphics to lossless JXL, WebP or PNG, photos to lossy AVIF,
+ * JXL, WebP or JPEG, in the order of preference of the available codecs.
+ *
+ * Usually only one encoding is performed, the next candidate is tried only if
+ * the output is too large (`maxBytes`, or lossless with more than 4 bits per pixel),
+ * and candidates that clearly cannot fit are skipped.
+ *
+ * @param control The timeout and limits apply to all trials, each trial reports
+ *                progress in its share of the range, trials that are not run
+ *                are skipped, so it may not reach 1.
+ */
+export function encodeAuto(image: ImageDataLike, constraints: AutoConstraints, control: Control = {}): AutoResult {
+	const { timeout, onProgress } = control;
+	const deadline = timeout === undefined ? Infinity : performance.now() + timeout;
+	const { maxBytes = Infinity } = constraints;
+
+	const stats = analyzeImage(image);
+	const candidates = planCandidates(stats, image.depth ?? 8, constraints);
+	if (candidates.length === 0) {
+		throw new Error("No encoder is available for the image");
+	}
+	const lossyAllowed = candidates.some(c => !c.lossless);
+	const limit = (c: Candidate) => c.lossless && lossyAllowed && constraints.lossless === undefined
+		? Math.min(maxBytes, image.width * image.height * LOSSLESS_MAX_BPP / 8)
+		: maxBytes;
+
+	let best: AutoResult | undefined;
+	let skipLossless = false;
+	for (let i = 0; i < candidates.length; i++) {
+		const candidate = candidates[i];
+		if (candidate.lossless && skipLossless) {
+			continue;
+		}
+		const { codec, options } = candidate;
+		const data = constraints.codecs[codec]!.encode(image, options, {
+			...control,
+			timeout: deadline === Infinity ? undefined : deadline - performance.now(),
+			onProgress: onProgress && (p => onProgress((i + p) / candidates.length)),
+		});
+		if (!best || data.length < best.data.length) {
+			best = { codec, options, data, stats };
+		}
+		const max = limit(candidate);
+		if (data.length <= max) {
+			return { codec, options, data, stats };
+		}
+		if (data.length > max * LOSING_RATIO) {
+			if (!candidate.lossless) {
+				break;
+			}
+			skipLossless = true;
+		}
+	}
+	return best!;
 }
 
 /**
@@ -51,12 +704,14 @@ export class PureImageData implements ImageDataLike {
 	readonly width: number;
 	readonly height: number;
 	readonly depth: number;
+	readonly format: PixelFormat;
 
-	constructor(data: Uint8ClampedArray, width: number, height: number, depth = 8) {
+	constructor(data: Uint8ClampedArray, width: number, height: number, depth = 8, format: PixelFormat = "rgba") {
 		this.data = data;
 		this.width = width;
 		this.height = height;
 		this.depth = depth;
+		this.format = format;
 	}
 }
 
@@ -65,17 +720,339 @@ PureImageData.prototype.colorSpace = "srgb";
 
 interface ExtraDataES {
 	bitDepth: number;
+	channels: number;
+}
+
+// Most encoders only accept RGBA input.
+const RGBA_ONLY: PixelFormat[] = ["rgba"];
+
+/**
+ * Result of `probe` functions in decoder modules.
+ */
+interface ImageInfo {
+	width: number;
+	height: number;
+	depth: number;
+}
+
+/*
+ * 32-bit WASM can address up to 4GB, leave some space
+ * for the code, stack and fragmentation.
+ */
+const WASM32_LIMIT = 3.5 * 2 ** 30;
+
+export function estimateMemory(width: number, height: number, depth: number, bytesPerPixel: number) {
+	return width * height * bytesPerPixel * (depth > 8 ? 2 : 1);
+}
+
+/**
+ * Throw `LimitError` if the image exceeds the limits, called before
+ * passing it to WASM, so nothing is allocated for it.
+ *
+ * @param memory Estimated peak memory usage in bytes.
+ */
+export function checkLimits(hint: string, width: number, height: number, memory: number, limits?: Limits) {
+	const { maxPixels, maxMemory } = limits ?? {};
+	if (maxPixels && width * height > maxPixels) {
+		throw new LimitError(hint, "maxPixels");
+	}
+	if (maxMemory && memory > maxMemory) {
+		throw new LimitError(hint, "maxMemory");
+	}
+}
+
+function hasLimits(limits?: Limits) {
+	return Boolean(limits?.maxPixels || limits?.maxMemory);
+}
+
+/**
+ * Select the WASM instance to process an image. 32-bit is preferred because
+ * Memory64 is slower, the 64-bit instance is only used when the estimated
+ * memory usage exceeds the limit of 32-bit, or it's the only one loaded.
+ *
+ * @param hint Used in the error message.
+ * @param memory Estimated peak memory usage in bytes.
+ * @param wasm32 The 32-bit instance, maybe not loaded.
+ * @param wasm64 The 64-bit instance, maybe not loaded.
+ */
+export function selectWASM(hint: string, memory: number, wasm32: any, wasm64: any) {
+	if (wasm32?.native) {
+		return wasm32; // No 4 GB limit for native addons.
+	}
+	if (wasm64 && (!wasm32 || memory > WASM32_LIMIT)) {
+		return wasm64;
+	}
+	if (memory > WASM32_LIMIT) {
+		const gb = (memory / 2 ** 30).toFixed(1);
+		throw new Error(`${hint}: The image needs about ${gb} GB memory, ` +
+			"which exceeds the limit of 32-bit WASM, the 64-bit is not loaded");
+	}
+	return wasm32;
+}
+
+/**
+ * Select the encoder instance by dimensions of the image.
+ *
+ * @param bytesPerPixel Rough peak memory usage per 8-bit pixel of the codec.
+ */
+export function selectEncoder(hint: string, image: ImageSize, bytesPerPixel: number, wasm32: any, wasm64: any, limits?: Limits) {
+	const { width, height, depth = 8 } = image;
+	const memory = estimateMemory(width, height, depth, bytesPerPixel);
+	checkLimits(hint, width, height, memory, limits);
+	return selectWASM(hint, memory, wasm32, wasm64);
+}
+
+/**
+ * Select the decoder instance, dimensions are read by the `probe` function,
+ * which is cheap since it only parses the header.
+ *
+ * @param bytesPerPixel Rough peak memory usage per 8-bit pixel of the codec.
+ * @param limits Checked against the header, before any allocation for pixels.
+ */
+export function selectDecoder(hint: string, input: BufferSource, bytesPerPixel: number, wasm32: any, wasm64: any, limits?: Limits) {
+	// Probing is only needed to choose between instances or check limits.
+	if (!hasLimits(limits) && !(wasm32 && wasm64)) {
+		return wasm32 ?? wasm64;
+	}
+	const { width, height, depth } = check<ImageInfo>((wasm32 ?? wasm64).probe(input), hint);
+	const memory = estimateMemory(width, height, depth, bytesPerPixel) + input.byteLength;
+	checkLimits(hint, width, height, memory, limits);
+	return selectWASM(hint, memory, wasm32, wasm64);
+}
+
+// Enough to contain the header of most files.
+const HEADER_SIZE = 65536;
+
+/**
+ * Like `selectDecoder`, but only the beginning of the stream is probed. If it's not
+ * enough to read the dimensions, the 64-bit instance is used if it's loaded,
+ * and limits are left to the codec.
+ */
+export function selectStreamDecoder(hint: string, source: ByteSource, bytesPerPixel: number, wasm32: any, wasm64: any, limits?: Limits) {
+	// Probing is only needed to choose between instances or check limits.
+	if (!hasLimits(limits) && !(wasm32 && wasm64)) {
+		return wasm32 ?? wasm64;
+	}
+	const header = new Uint8Array(Math.min(source.size, HEADER_SIZE));
+	const info = (wasm32 ?? wasm64).probe(header.subarray(0, source.read(header, 0)));
+	if (typeof info === "string" || !info) {
+		return wasm64 ?? wasm32;
+	}
+	const { width, height, depth } = info as ImageInfo;
+	const memory = estimateMemory(width, height, depth, bytesPerPixel) + source.size;
+	checkLimits(hint, width, height, memory, limits);
+	return selectWASM(hint, memory, wasm32, wasm64);
 }
 
-export function encodeES<T>(name: string, wasm: any, defaults: T, image: ImageDataLike, options?: T) {
+/**
+ * Controls a long-running encode or decode.
+ *
+ * WASM code runs synchronously, cancellation is checked at hook points of
+ * the codec (e.g. rows, passes or tiles), so an AbortSignal only takes effect
+ * if it's aborted before the call or in `onProgress`.
+ * Some codecs (AVIF, HEIC encoder, QOI, PNG) can only be checked between steps.
+ */
+export interface Control extends Limits {
+	/**
+	 * Cancel the operation if it's not completed in the milliseconds.
+	 */
+	timeout?: number;
+
+	/**
+	 * Cancel the operation when it is aborted.
+	 */
+	signal?: AbortSignal;
+
+	/**
+	 * Called with the progress in [0, 1] at most once per percent,
+	 * return false to cancel the operation.
+	 */
+	onProgress?: (progress: number) => boolean | void;
+}
+
+/**
+ * Resource limits of an operation, to reject decompression bombs and huge
+ * inputs before they take the memory. Exceeding any throws `LimitError`.
+ *
+ * They are checked against the header (or the input image of encoders) before
+ * calling into WASM, and again by the codec after parsing, through its native
+ * limits where available (libavif image size limit, libjxl memory manager).
+ *
+ * Undefined or 0 means no limit, in both JS and WASM.
+ */
+export interface Limits {
+	/**
+	 * Maximum number of pixels (width * height) of the image.
+	 */
+	maxPixels?: number;
+
+	/**
+	 * Maximum memory in bytes that the operation may use, compared with
+	 * the estimated peak usage, and caps allocations of codecs that
+	 * have a custom allocator (JXL).
+	 */
+	maxMemory?: number;
+}
+
+/**
+ * A rectangle in the image, in pixels.
+ */
+export interface Region {
+	x: number;
+	y: number;
+	width: number;
+	height: number;
+}
+
+/**
+ * Options of decode functions.
+ */
+export interface DecodeOptions extends Control {
+	/**
+	 * Pixel format of the result, codecs output it directly if they can
+	 * (e.g. gray JPEG, RGB for most codecs), otherwise it's converted.
+	 *
+	 * @default "rgba"
+	 */
+	format?: PixelFormat;
+}
+
+/**
+ * Decode options of codecs that can decode a part of the image.
+ */
+export interface RegionOptions extends DecodeOptions {
+	/**
+	 * Decode only pixels in the rectangle, the result has the same size as it.
+	 * Throws if the region is empty or exceeds the image.
+	 */
+	region?: Region;
+}
+
+/**
+ * Thrown when an operation is cancelled by `Control`.
+ */
+export class CancelledError extends Error {
+
+	constructor(hint: string) {
+		super(`${hint}: Cancelled`);
+		this.name = "CancelledError";
+	}
+}
+
+/**
+ * Thrown when the image exceeds `maxPixels` or `maxMemory` of `Control`.
+ */
+export class LimitError extends Error {
+
+	/**
+	 * The name of the exceeded limit.
+	 */
+	readonly limit: keyof Limits;
+
+	constructor(hint: string, limit: keyof Limits) {
+		super(`${hint}: The image exceeds ${limit}`);
+		this.name = "LimitError";
+		this.limit = limit;
+	}
+}
+
+// The message returned by WASM functions when cancelled.
+const CANCELLED = "Cancelled";
+
+// Prefix of messages returned by WASM functions when exceeded limits.
+const LIMIT_EXCEEDED = "Limit exceeded: ";
+
+/**
+ * Convert the control to the argument of WASM functions, which have
+ * an absolute deadline and a callback combining the signal.
+ * Use `toWasmOptions` for decode functions.
+ */
+export function toWasmControl(hint: string, control?: Control) {
+	if (!control) {
+		return undefined;
+	}
+	const { timeout, signal, onProgress, maxPixels, maxMemory } = control;
+	if (signal?.aborted || (timeout !== undefined && timeout <= 0)) {
+		throw new CancelledError(hint);
+	}
+	return {
+		maxPixels,
+		maxMemory,
+		deadline: timeout === undefined ? Infinity : performance.now() + timeout,
+		onProgress(progress: number) {
+			return onProgress?.(progress) !== false && !signal?.aborted;
+		},
+	};
+}
+
+/**
+ * Like `toWasmControl`, and the requested pixel format is passed to WASM.
+ */
+export function toWasmOptions(hint: string, options?: DecodeOptions) {
+	const control = toWasmControl(hint, options);
+	return options?.format ? { ...control, format: options.format } : control;
+}
+
+/**
+ * Convert the decoded image to the requested format, if the codec can't output it.
+ */
+export function decodeES<T extends ImageDataLike>(name: string, result: string | null | T, options?: DecodeOptions) {
+	return toPixelFormat(check<T>(result, name), options?.format) as T;
+}
+
+/**
+ * @param formats Pixel formats accepted by the WASM, others are converted to RGBA.
+ */
+export function encodeES<T>(name: string, wasm: any, defaults: T, image: ImageDataLike, options?: T, control?: Control, formats = RGBA_ONLY) {
 	options = { ...defaults, ...options };
+	image = toInputFormat(image, formats);
 	const { data, width, height } = image;
 	(options as ExtraDataES).bitDepth = image.depth ?? 8;
-	const result = wasm.encode(data, width, height, options);
+	(options as ExtraDataES).channels = CHANNELS[image.format ?? "rgba"];
+	const result = wasm.encode(data, width, height, options, toWasmControl(name, control));
+	return check<Uint8Array>(result, name);
+}
+
+export function encodeManyES<T>(name: string, wasm: any, defaults: T, image: ImageDataLike, optionsList: T[], control?: Control, formats = RGBA_ONLY) {
+	image = toInputFormat(image, formats);
+	const { data, width, height } = image;
+	const bitDepth = image.depth ?? 8;
+	const channels = CHANNELS[image.format ?? "rgba"];
+	optionsList = optionsList.map(options => ({ ...defaults, ...options, bitDepth, channels }));
+	const result = wasm.encodeMany(data, width, height, optionsList, toWasmControl(name, control));
+	return check<Uint8Array[]>(result, name);
+}
+
+/**
+ * Encode and write the output to the sink by chunks.
+ *
+ * @return The number of bytes written.
+ */
+export function encodeStreamES<T>(name: string, wasm: any, defaults: T, image: ImageDataLike, sink: ByteSink, options?: T, control?: Control, formats = RGBA_ONLY) {
+	options = { ...defaults, ...options };
+	image = toInputFormat(image, formats);
+	const { data, width, height } = image;
+	(options as ExtraDataES).bitDepth = image.depth ?? 8;
+	(options as ExtraDataES).channels = CHANNELS[image.format ?? "rgba"];
+	const result = wasm.encode(data, width, height, options, { ...toWasmControl(name, control), sink });
+	return check<number>(result, name);
+}
+
+export function encodeTiledES<T>(name: string, wasm: any, defaults: T, source: TileSource, options?: T, control?: Control) {
+	options = { ...defaults, ...options };
+	(options as ExtraDataES).bitDepth = source.depth ?? 8;
+	(options as ExtraDataES).channels = 4;
+	const result = wasm.encodeTiled(source, options, toWasmControl(name, control));
 	return check<Uint8Array>(result, name);
 }
 
 export function check<T>(value: string | null | T, hint: string) {
+	if (value === CANCELLED) {
+		throw new CancelledError(hint);
+	}
+	if (typeof value === "string" && value.startsWith(LIMIT_EXCEEDED)) {
+		throw new LimitError(hint, value.slice(LIMIT_EXCEEDED.length) as keyof Limits);
+	}
 	if (typeof value === "string") {
 		throw new Error(`${hint}: ${value}`);
 	}
@@ -1,6 +1,6 @@
 import wasmFactoryEnc from "../dist/heic-enc.js";
 import wasmFactoryDec from "../dist/heic-dec.js";
-import { check, encodeES, ImageDataLike, loadES, WasmSource } from "./common.js";
+import { ByteSink, Control, decodeES, DecodeOptions, encodeES, encodeStreamES, ImageDataLike, loadES, selectDecoder, selectEncoder, toWasmOptions, WasmSource } from "./common.js";
 
 export const Presets = ["ultrafast", "superfast", "veryfast", "faster", "fast", "medium", "slow", "slower", "veryslow", "placebo"] as const;
 
@@ -71,6 +71,14 @@ export interface Options {
 	 * @default false
 	 */
 	sharpYUV?: boolean;
+
+	/**
+	 * Encode the alpha channel even if all pixels are opaque, by default the
+	 * pixels are imported as RGB, and no alpha image is stored.
+	 *
+	 * @default false
+	 */
+	keepAlpha?: boolean;
 }
 
 export const defaultOptions: Required<Options> = {
@@ -82,27 +90,63 @@ export const defaultOptions: Required<Options> = {
 	complexity: 50,
 	chroma: "420",
 	sharpYUV: false,
+	keepAlpha: false,
 };
 
 export const mimeType = "image/heic";
 export const extension = "heic";
 export const bitDepth = [8, 10, 12];
 
+// Rough peak memory usage per pixel, used to select 32-bit or 64-bit WASM.
+export const bytesPerPixel = 24;
+
 let encoderWASM: any;
 let decoderWASM: any;
+let encoderWASM64: any;
+let decoderWASM64: any;
+
+export async function loadEncoder(input?: WasmSource, relaxed?: boolean) {
+	const loadRelaxed = () => import("../dist/heic-enc-relaxed.js");
+	return encoderWASM ??= await loadES(wasmFactoryEnc, input, relaxed, loadRelaxed);
+}
+
+export async function loadDecoder(input?: WasmSource, relaxed?: boolean) {
+	const loadRelaxed = () => import("../dist/heic-dec-relaxed.js");
+	return decoderWASM ??= await loadES(wasmFactoryDec, input, relaxed, loadRelaxed);
+}
+
+/**
+ * Load the 64-bit encoder, which is used for images too large for the 32-bit.
+ */
+export async function loadEncoder64(input?: WasmSource) {
+	return encoderWASM64 ??= await loadES((await import("../dist/heic-enc-64.js")).default, input);
+}
 
-export async function loadEncoder(input?: WasmSource) {
-	return encoderWASM ??= await loadES(wasmFactoryEnc, input);
+/**
+ * Load the 64-bit decoder, which is used for images too large for the 32-bit.
+ */
+export async function loadDecoder64(input?: WasmSource) {
+	return decoderWASM64 ??= await loadES((await import("../dist/heic-dec-64.js")).default, input);
 }
 
-export async function loadDecoder(input?: WasmSource) {
-	return decoderWASM ??= await loadES(wasmFactoryDec, input);
+export function encode(image: ImageDataLike, options?: Options, control?: Control) {
+	const wasm = selectEncoder("HEIC Encode", image, bytesPerPixel, encoderWASM, encoderWASM64, control);
+	return encodeES("HEIC Encode", wasm, defaultOptions, image, options, control);
 }
 
-export function encode(image: ImageDataLike, options?: Options) {
-	return encodeES("HEIC Encode", encoderWASM, defaultOptions, image, options);
+/**
+ * Encode the image and write the output to the sink, libheif produces
+ * the file in one piece, but it's not copied out of WASM memory.
+ *
+ * @return The number of bytes written.
+ */
+export function encodeStream(image: ImageDataLike, sink: ByteSink, options?: Options, control?: Control) {
+	const wasm = selectEncoder("HEIC Encode", image, bytesPerPixel, encoderWASM, encoderWASM64, control);
+	return encodeStreamES("HEIC Encode", wasm, defaultOptions, image, sink, options, control);
 }
 
-export function decode(input: BufferSource) {
-	return check<ImageData>(decoderWASM.decode(input), "HEIC Decode");
+export function decode(input: BufferSource, options?: DecodeOptions) {
+	const wasm = selectDecoder("HEIC Decode", input, bytesPerPixel, decoderWASM, decoderWASM64, options);
+	const result = wasm.decode(input, toWasmOptions("HEIC Decode", options));
+	return decodeES<ImageData>("HEIC Decode", result, options);
 }
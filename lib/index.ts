@@ -1,6 +1,6 @@
-import { ImageDataLike, PureImageData, toBitDepth, WasmSource } from "./common.js";
+import { analyzeImage, AutoCodecs, AutoConstraints, AutoResult, ByteSink, ByteSource, CancelledError, Control, DecodeOptions, encodeAuto, encodeMany, EncodeTarget, ImageDataLike, ImageStats, LimitError, Limits, PixelFormat, PureImageData, Region, RegionOptions, resize, TileSource, toBitDepth, toPixelFormat, WasmSource } from "./common.js";
 
-export { ImageDataLike, toBitDepth };
+export { analyzeImage, AutoCodecs, AutoConstraints, AutoResult, ByteSink, ByteSource, CancelledError, Control, DecodeOptions, encodeAuto, encodeMany, EncodeTarget, ImageDataLike, ImageStats, LimitError, Limits, PixelFormat, Region, RegionOptions, resize, TileSource, toBitDepth, toPixelFormat };
 
 export * as avif from "./avif.js";
 export * as png from "./png.js";
@@ -11,21 +11,25 @@ export * as heic from "./heic.js";
 export * as qoi from "./qoi.js";
 export * as wp2 from "./wp2.js";
 
+export { loadTranscoder, transcode, TranscodeTarget } from "./transcoder.js";
+
 declare global {
 	// eslint-disable-next-line no-var
-	var _icodec_ImageData: (data: Uint8ClampedArray, w: number, h: number, depth: number) => ImageDataLike;
+	var _icodec_ImageData: (data: Uint8ClampedArray, w: number, h: number, depth: number, format?: PixelFormat) => ImageDataLike;
 }
 
-globalThis._icodec_ImageData = (data, w, h, depth) => {
-	if (depth === 8) {
+// The builtin ImageData only supports 8-bit RGBA.
+globalThis._icodec_ImageData = (data, w, h, depth, format = "rgba") => {
+	if (depth === 8 && format === "rgba") {
 		return new ImageDataEx(data, w, h);
 	}
-	return new PureImageData(data, w, h, depth);
+	return new PureImageData(data, w, h, depth, format);
 };
 
 class ImageDataEx extends ImageData implements ImageDataLike {
 
 	readonly depth = 8;
+	readonly format = "rgba";
 }
 
 /**
@@ -62,30 +66,90 @@ export interface ICodecModule<T = any> {
 	 * Multiple calls are ignored, and return the first result.
 	 *
 	 * @param source If pass a string, it's the URL of WASM file to fetch,
+	 *               if pass a WebAssembly.Module, it's used without compiling,
 	 *               else it will be treated as the WASM bytes.
+	 * @param relaxed Use the relaxed SIMD variant if the codec has, the source
+	 *               must be the variant's WASM file. Default is true when the
+	 *               source is not specified and the runtime supports it.
 	 * @return the underlying WASM module, which is not part of
 	 *               the public API and can be changed at any time.
 	 */
-	loadDecoder(source?: WasmSource): Promise<any>;
+	loadDecoder(source?: WasmSource, relaxed?: boolean): Promise<any>;
+
+	/**
+	 * Convert the image to raw pixels, RGBA by default.
+	 *
+	 * @param options Report progress, cancel the decoding with a timeout or signal,
+	 *                throws `CancelledError` if cancelled. `format` selects the
+	 *                pixel format of the result. Throws `LimitError` if the image
+	 *                exceeds `maxPixels` or `maxMemory`.
+	 */
+	decode(input: Uint8Array, options?: DecodeOptions): ImageData;
 
 	/**
-	 * Convert the image to raw RGBA data.
+	 * Like `decode`, but the input is read from the source by chunks.
+	 * Available for AVIF, JPEG and JXL.
 	 */
-	decode(input: Uint8Array): ImageData;
+	decodeStream?(source: ByteSource, options?: DecodeOptions): ImageData;
+
+	/**
+	 * Decode the file, it's streamed into WASM memory if the codec
+	 * has `decodeStream`, otherwise read as a whole.
+	 * Only available in the Node entry (`icodec/node`).
+	 */
+	decodeFile?(path: string, options?: DecodeOptions): ImageData;
 
 	/**
 	 * Load the encoder WASM file, must be called once before encode.
 	 * Multiple calls are ignored, and return the first result.
 	 *
 	 * @param source If pass a string, it's the URL of WASM file to fetch,
+	 *               if pass a WebAssembly.Module, it's used without compiling,
 	 *               else it will be treated as the WASM bytes.
+	 * @param relaxed Use the relaxed SIMD variant if the codec has, the source
+	 *               must be the variant's WASM file. Default is true when the
+	 *               source is not specified and the runtime supports it.
 	 * @return the underlying WASM module, which is not part of
 	 *               the public API and can be changed at any time.
 	 */
-	loadEncoder(source?: WasmSource): Promise<any>;
+	loadEncoder(source?: WasmSource, relaxed?: boolean): Promise<any>;
+
+	/**
+	 * Load the 64-bit variant of encoder/decoder, they are used only for images
+	 * that need more than 4GB memory, since 64-bit WASM is slower.
+	 * Not available for PNG.
+	 */
+	loadEncoder64?(source?: WasmSource): Promise<any>;
+	loadDecoder64?(source?: WasmSource): Promise<any>;
+
+	/**
+	 * Encode an image, pixels in formats not supported by the codec
+	 * are converted to RGBA.
+	 *
+	 * @param control Report progress, cancel the encoding with a timeout or signal,
+	 *                throws `CancelledError` if cancelled. Throws `LimitError`
+	 *                if the image exceeds `maxPixels` or `maxMemory`.
+	 */
+	encode(image: ImageDataLike, options?: T, control?: Control): Uint8Array;
+
+	/**
+	 * Encode the image with each of the options, shares the pixel import
+	 * and color conversion between them. Available for AVIF and WebP.
+	 */
+	encodeMany?(image: ImageDataLike, optionsList: T[], control?: Control): Uint8Array[];
+
+	/**
+	 * Encode the image and write the output to the sink, without returning
+	 * the whole output. Available for HEIC, JPEG, JXL, WebP and WebP2.
+	 *
+	 * @return The number of bytes written.
+	 */
+	encodeStream?(image: ImageDataLike, sink: ByteSink, options?: T, control?: Control): number;
 
 	/**
-	 * Encode an image with RGBA pixels data.
+	 * Encode the image to the file, streamed by `encodeStream` if the codec has.
+	 * The file is removed if the encoding failed.
+	 * Only available in the Node entry (`icodec/node`).
 	 */
-	encode(image: ImageDataLike, options?: T): Uint8Array;
+	encodeToFile?(path: string, image: ImageDataLike, options?: T, control?: Control): void;
 }
@@ -1,5 +1,5 @@
 import wasmFactoryEnc from "../dist/mozjpeg.js";
-import { check, encodeES, ImageDataLike, loadES, WasmSource } from "./common.js";
+import { ByteSink, ByteSource, Control, decodeES, encodeES, encodeStreamES, ImageDataLike, loadES, PixelFormat, RegionOptions, selectDecoder, selectEncoder, selectStreamDecoder, toWasmOptions, WasmSource } from "./common.js";
 
 export enum ColorSpace {
 	GRAYSCALE = 1,
@@ -130,7 +130,14 @@ export const bitDepth = [8];
 export const mimeType = "image/jpeg";
 export const extension = "jpg";
 
+// Pixel formats encoded without conversion, alpha is dropped by JPEG anyway.
+const inputFormats: PixelFormat[] = ["gray", "rgb", "rgba"];
+
+// Rough peak memory usage per pixel, used to select 32-bit or 64-bit WASM.
+export const bytesPerPixel = 12;
+
 let codecWASM: any;
+let codecWASM64: any;
 
 export async function loadEncoder(input?: WasmSource) {
 	return codecWASM = await loadES(wasmFactoryEnc, input);
@@ -138,10 +145,47 @@ export async function loadEncoder(input?: WasmSource) {
 
 export const loadDecoder = loadEncoder;
 
-export function encode(image: ImageDataLike, options?: Options) {
-	return encodeES("JPEG Encode", codecWASM, defaultOptions, image, options);
+/**
+ * Load the 64-bit module, which is used for images too large for the 32-bit.
+ */
+export async function loadEncoder64(input?: WasmSource) {
+	return codecWASM64 = await loadES((await import("../dist/mozjpeg-64.js")).default, input);
+}
+
+export const loadDecoder64 = loadEncoder64;
+
+export function encode(image: ImageDataLike, options?: Options, control?: Control) {
+	const wasm = selectEncoder("JPEG Encode", image, bytesPerPixel, codecWASM, codecWASM64, control);
+	return encodeES("JPEG Encode", wasm, defaultOptions, image, options, control, inputFormats);
+}
+
+/**
+ * Encode the image and write the output to the sink by chunks,
+ * the whole output is not buffered.
+ *
+ * @return The number of bytes written.
+ */
+export function encodeStream(image: ImageDataLike, sink: ByteSink, options?: Options, control?: Control) {
+	const wasm = selectEncoder("JPEG Encode", image, bytesPerPixel, codecWASM, codecWASM64, control);
+	return encodeStreamES("JPEG Encode", wasm, defaultOptions, image, sink, options, control, inputFormats);
+}
+
+/**
+ * Decode the image, or only a part of it with `options.region`.
+ */
+export function decode(input: BufferSource, options?: RegionOptions) {
+	const wasm = selectDecoder("JPEG Decode", input, bytesPerPixel, codecWASM, codecWASM64, options);
+	const control = toWasmOptions("JPEG Decode", options);
+	const result = wasm.decode(input, { ...control, region: options?.region });
+	return decodeES<ImageData>("JPEG Decode", result, options);
 }
 
-export function decode(input: BufferSource) {
-	return check<ImageData>(codecWASM.decode(input), "JPEG Decode");
+/**
+ * Like `decode`, but the input is read from the source by chunks.
+ */
+export function decodeStream(source: ByteSource, options?: RegionOptions) {
+	const wasm = selectStreamDecoder("JPEG Decode", source, bytesPerPixel, codecWASM, codecWASM64, options);
+	const control = toWasmOptions("JPEG Decode", options);
+	const result = wasm.decodeStream(source, { ...control, region: options?.region });
+	return decodeES<ImageData>("JPEG Decode", result, options);
 }
@@ -1,6 +1,6 @@
 import wasmFactoryEnc from "../dist/jxl-enc.js";
 import wasmFactoryDec from "../dist/jxl-dec.js";
-import { check, encodeES, ImageDataLike, loadES, WasmSource } from "./common.js";
+import { ByteSink, ByteSource, Control, decodeES, encodeES, encodeStreamES, encodeTiledES, ImageDataLike, loadES, PixelFormat, RegionOptions, selectDecoder, selectEncoder, selectStreamDecoder, TileSource, toWasmOptions, WasmSource } from "./common.js";
 
 // Tristate bool value, `Default` means encoder chooses.
 export enum Override { Default = -1, False, True}
@@ -189,6 +189,14 @@ export interface Options {
 	 * @default Predictor.Default,
 	 */
 	modularPredictor?: Predictor;
+
+	/**
+	 * Encode the alpha channel even if all pixels are opaque, by default the
+	 * alpha is removed before encoding, the image has no extra channel.
+	 *
+	 * @default false
+	 */
+	keepAlpha?: boolean;
 }
 
 export const defaultOptions: Required<Options> = {
@@ -211,27 +219,92 @@ export const defaultOptions: Required<Options> = {
 	iterations: -1,
 	modularColorspace: -1,
 	modularPredictor: Predictor.Default,
+	keepAlpha: false,
 };
 
 export const mimeType = "image/jxl";
 export const extension = "jxl";
 export const bitDepth = [8, 9, 10, 11, 12, 13, 14, 15, 16];
 
+// Pixel formats encoded without conversion, unused channels are not stored.
+const inputFormats: PixelFormat[] = ["gray", "grayAlpha", "rgb", "rgba"];
+
+// Rough peak memory usage per pixel, used to select 32-bit or 64-bit WASM.
+export const bytesPerPixel = 64;
+
+// Output and frame-level data of streaming encoding, tiles are small.
+const tiledBytesPerPixel = 1;
+
 let encoderWASM: any;
 let decoderWASM: any;
+let encoderWASM64: any;
+let decoderWASM64: any;
+
+export async function loadEncoder(input?: WasmSource, relaxed?: boolean) {
+	const loadRelaxed = () => import("../dist/jxl-enc-relaxed.js");
+	return encoderWASM ??= await loadES(wasmFactoryEnc, input, relaxed, loadRelaxed);
+}
+
+export async function loadDecoder(input?: WasmSource, relaxed?: boolean) {
+	const loadRelaxed = () => import("../dist/jxl-dec-relaxed.js");
+	return decoderWASM ??= await loadES(wasmFactoryDec, input, relaxed, loadRelaxed);
+}
+
+/**
+ * Load the 64-bit encoder, which is used for images too large for the 32-bit.
+ */
+export async function loadEncoder64(input?: WasmSource) {
+	return encoderWASM64 ??= await loadES((await import("../dist/jxl-enc-64.js")).default, input);
+}
+
+/**
+ * Load the 64-bit decoder, which is used for images too large for the 32-bit.
+ */
+export async function loadDecoder64(input?: WasmSource) {
+	return decoderWASM64 ??= await loadES((await import("../dist/jxl-dec-64.js")).default, input);
+}
+
+export function encode(image: ImageDataLike, options?: Options, control?: Control) {
+	const wasm = selectEncoder("JXL Encode", image, bytesPerPixel, encoderWASM, encoderWASM64, control);
+	return encodeES("JXL Encode", wasm, defaultOptions, image, options, control, inputFormats);
+}
 
-export async function loadEncoder(input?: WasmSource) {
-	return encoderWASM ??= await loadES(wasmFactoryEnc, input);
+/**
+ * Encode the image and write the output to the sink by chunks,
+ * the whole output is not buffered.
+ *
+ * @return The number of bytes written.
+ */
+export function encodeStream(image: ImageDataLike, sink: ByteSink, options?: Options, control?: Control) {
+	const wasm = selectEncoder("JXL Encode", image, bytesPerPixel, encoderWASM, encoderWASM64, control);
+	return encodeStreamES("JXL Encode", wasm, defaultOptions, image, sink, options, control, inputFormats);
 }
 
-export async function loadDecoder(input?: WasmSource) {
-	return decoderWASM ??= await loadES(wasmFactoryDec, input);
+/**
+ * Encode a large image by chunks, pixels are pulled from the source by groups,
+ * and the output is streamed, so the RGBA data of the whole image is not needed.
+ */
+export function encodeTiled(source: TileSource, options?: Options, control?: Control) {
+	const wasm = selectEncoder("JXL Encode", source, tiledBytesPerPixel, encoderWASM, encoderWASM64, control);
+	return encodeTiledES("JXL Encode", wasm, defaultOptions, source, options, control);
 }
 
-export function encode(image: ImageDataLike, options?: Options) {
-	return encodeES("JXL Encode", encoderWASM, defaultOptions, image, options);
+/**
+ * Decode the image, or only a part of it with `options.region`.
+ */
+export function decode(input: BufferSource, options?: RegionOptions) {
+	const wasm = selectDecoder("JXL Decode", input, bytesPerPixel, decoderWASM, decoderWASM64, options);
+	const control = toWasmOptions("JXL Decode", options);
+	const result = wasm.decode(input, { ...control, region: options?.region });
+	return decodeES<ImageData>("JXL Decode", result, options);
 }
 
-export function decode(input: BufferSource) {
-	return check<ImageData>(decoderWASM.decode(input), "JXL Decode");
+/**
+ * Like `decode`, but the input is read from the source by chunks.
+ */
+export function decodeStream(source: ByteSource, options?: RegionOptions) {
+	const wasm = selectStreamDecoder("JXL Decode", source, bytesPerPixel, decoderWASM, decoderWASM64, options);
+	const control = toWasmOptions("JXL Decode", options);
+	const result = wasm.decodeStream(source, { ...control, region: options?.region });
+	return decodeES<ImageData>("JXL Decode", result, options);
 }
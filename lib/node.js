@@ -1,7 +1,9 @@
-import { readFileSync } from "node:fs";
+import { closeSync, existsSync, fstatSync, mkdirSync, openSync, readdirSync, readFileSync, readSync, renameSync, rmSync, statSync, utimesSync, writeFileSync, writeSync } from "node:fs";
 import { join } from "node:path";
+import { createRequire } from "node:module";
+import { createHash } from "node:crypto";
 
-import { PureImageData } from "./common.js";
+import { checkLimits, estimateMemory, PureImageData, relaxedSIMD } from "./common.js";
 
 import * as avifRaw from "./avif.js";
 import * as pngRaw from "./png.js";
@@ -11,36 +13,393 @@ import * as webpRaw from "./webp.js";
 import * as heicRaw from "./heic.js";
 import * as qoiRaw from "./qoi.js";
 import * as wp2Raw from "./wp2.js";
+import * as transcoderRaw from "./transcoder.js";
 
-globalThis._icodec_ImageData = (data, w, h, depth) => {
-	return new PureImageData(data, w, h, depth);
+export { analyzeImage, CancelledError, encodeAuto, encodeMany, LimitError, resize, toPixelFormat } from "./common.js";
+export { transcode } from "./transcoder.js";
+
+globalThis._icodec_ImageData = (data, w, h, depth, format) => {
+	return new PureImageData(data, w, h, depth, format);
 };
 
+/**
+ * Resolve the WASM file in dist directory, prefer the relaxed SIMD
+ * variant if it's enabled and exists.
+ *
+ * @return the file path and whether it's the relaxed variant.
+ */
+function resolveDist(name, relaxed = relaxedSIMD) {
+	const path = join(import.meta.dirname, "../dist", name);
+	const variant = path.replace(/\.wasm$/, "-relaxed.wasm");
+	if (relaxed && existsSync(variant)) {
+		return [variant, true];
+	}
+	return [path, false];
+}
+
+const require = createRequire(import.meta.url);
+
+/**
+ * Load the native addon built by `node scripts/build.js --native` if it exists,
+ * it's faster than WASM on servers, and the image size is not limited to 4 GB.
+ *
+ * @param name Name of the WASM file, or null for HEIC encoder.
+ */
+function loadNative(name) {
+	name = (name ?? "heic-enc.wasm").replace(/\.wasm$/, "-native.node");
+	const path = join(import.meta.dirname, "../dist", name);
+	return existsSync(path) ? require(path) : undefined;
+}
+
+const compiled = new Map();
+
+/**
+ * Compile the WASM file once per thread, the result can be sent to workers
+ * via `postMessage`, and pass to `load*` functions to skip compilation.
+ */
+function compileDist(name, relaxed) {
+	const [path, isRelaxed] = resolveDist(name, relaxed);
+	let module = compiled.get(path);
+	if (!module) {
+		module = WebAssembly.compile(readFileSync(path)).then(compiled => {
+			compiledVariants.set(compiled, isRelaxed);
+			return compiled;
+		});
+		compiled.set(path, module);
+	}
+	return module;
+}
+
+// Whether modules compiled by `compileDist` are the relaxed SIMD variant.
+const compiledVariants = new WeakMap();
+
+/*
+ * The variant of a compiled module cannot be detected from itself. Use the `relaxed`
+ * argument if given, then the variant it was compiled for in this thread. Modules
+ * sent to workers are copies, if `relaxed` is not given, we resolve it again,
+ * which gives the same result in the same environment.
+ */
+function resolveInput(name, input, relaxed) {
+	if (input instanceof WebAssembly.Module) {
+		relaxed ??= compiledVariants.get(input);
+		return [input, relaxed ?? resolveDist(name)[1]];
+	}
+	if (input === undefined) {
+		const [path, isRelaxed] = resolveDist(name, relaxed);
+		return [readFileSync(path), isRelaxed];
+	}
+	if (typeof input === "string") {
+		input = readFileSync(input);
+	}
+	return [input, relaxed];
+}
+
+/**
+ * Read the file by positional reads, bytes are copied into
+ * WASM memory directly, the whole file is never in JS memory.
+ */
+function fileSource(fd) {
+	return {
+		size: fstatSync(fd).size,
+		read: (buffer, position) => readSync(fd, buffer, 0, buffer.length, position),
+	};
+}
+
+function fileSink(fd) {
+	return {
+		write(chunk) {
+			for (let i = 0; i < chunk.length;) {
+				i += writeSync(fd, chunk, i);
+			}
+		},
+	};
+}
+
+/**
+ * Cache of encoded outputs, keyed by SHA-256 of the pixels, the codec, options merged
+ * with defaults, and versions of the package and libraries (versions.json).
+ *
+ * Entries are kept in a LRU in memory, and optionally in a directory, which can be
+ * shared by processes, files are replaced atomically and evicted by modification time.
+ */
+class EncodeCache {
+
+	constructor({ maxMemory = 64 * 2 ** 20, directory, maxDiskSize = 2 ** 30 }) {
+		this.maxMemory = maxMemory;
+		this.maxDiskSize = maxDiskSize;
+		this.directory = directory;
+		this.salt = readVersions();
+
+		// Map keeps the insertion order, the first entry is the least recently used.
+		this.memory = new Map();
+		this.memorySize = 0;
+		this.files = new Map();
+		this.diskSize = 0;
+
+		if (directory) {
+			mkdirSync(directory, { recursive: true });
+			const files = readdirSync(directory)
+				.filter(name => name.endsWith(".bin"))
+				.map(name => [name.slice(0, -4), statSync(join(directory, name))])
+				.sort((a, b) => a[1].mtimeMs - b[1].mtimeMs);
+
+			for (const [key, { size }] of files) {
+				this.files.set(key, size);
+				this.diskSize += size;
+			}
+		}
+	}
+
+	/**
+	 * @return The key, or undefined if options cannot be serialized (e.g. PNG palette).
+	 */
+	keyOf(original, image, options) {
+		const merged = { ...original.defaultOptions, ...options };
+		const names = Object.keys(merged).sort();
+		for (const name of names) {
+			const value = merged[name];
+			if (value !== null && typeof value === "object" && !Array.isArray(value)) {
+				return undefined;
+			}
+		}
+		const { width, height, depth = 8, format = "rgba", data } = image;
+		return createHash("sha256")
+			.update(this.salt)
+			.update(`${original.extension} ${width}x${height} ${depth} ${format}`)
+			.update(JSON.stringify(merged, names))
+			.update(data)
+			.digest("hex");
+	}
+
+	get(key) {
+		let data = this.memory.get(key);
+		if (data) {
+			this.memory.delete(key);
+			this.memory.set(key, data);
+			return data;
+		}
+		if (!this.files.has(key)) {
+			return undefined;
+		}
+		const path = join(this.directory, key + ".bin");
+		try {
+			data = new Uint8Array(readFileSync(path));
+			const now = new Date();
+			utimesSync(path, now, now);
+		} catch {
+			this.removeFile(key); // Evicted by another process.
+			return undefined;
+		}
+		this.files.delete(key);
+		this.files.set(key, data.length);
+		this.putMemory(key, data);
+		return data;
+	}
+
+	set(key, data) {
+		this.putMemory(key, data);
+
+		if (!this.directory || data.length > this.maxDiskSize) {
+			return;
+		}
+		const path = join(this.directory, key + ".bin");
+		const temp = `${path}.${process.pid}.tmp`;
+		writeFileSync(temp, data);
+		renameSync(temp, path);
+
+		this.removeFile(key);
+		this.files.set(key, data.length);
+		this.diskSize += data.length;
+		for (const key of this.files.keys()) {
+			if (this.diskSize <= this.maxDiskSize) break;
+			rmSync(join(this.directory, key + ".bin"), { force: true });
+			this.removeFile(key);
+		}
+	}
+
+	putMemory(key, data) {
+		if (data.length > this.maxMemory) {
+			return;
+		}
+		this.memory.set(key, data);
+		this.memorySize += data.length;
+		for (const [key, value] of this.memory) {
+			if (this.memorySize <= this.maxMemory) break;
+			this.memory.delete(key);
+			this.memorySize -= value.length;
+		}
+	}
+
+	// Whether an output of the size can be stored.
+	accepts(size) {
+		return size <= this.maxMemory || (this.directory && size <= this.maxDiskSize);
+	}
+
+	removeFile(key) {
+		const size = this.files.get(key);
+		if (size !== undefined) {
+			this.files.delete(key);
+			this.diskSize -= size;
+		}
+	}
+}
+
+function readVersions() {
+	const root = join(import.meta.dirname, "..");
+	const { version } = JSON.parse(readFileSync(join(root, "package.json"), "utf8"));
+	const path = join(root, "versions.json");
+	return version + (existsSync(path) ? readFileSync(path, "utf8") : "");
+}
+
+let cache;
+
+/**
+ * Cache outputs of `encode` and `encodeToFile` of all codecs, identical inputs
+ * are returned from the cache without loading the encoder.
+ * Calling it again replaces the cache. Outputs from the cache are shared, do not modify them.
+ *
+ * @param options.maxMemory Size limit of the LRU in memory, default is 64 MB.
+ * @param options.directory Also store entries in this directory.
+ * @param options.maxDiskSize Size limit of the directory, default is 1 GB.
+ */
+export function enableEncodeCache(options = {}) {
+	cache = new EncodeCache(options);
+}
+
+export function disableEncodeCache() {
+	cache = undefined;
+}
+
+/*
+ * Limits are not in the key, check them before the lookup like `encode` does,
+ * so a hit does not bypass them.
+ */
+function checkEncodeLimits(original, image, control) {
+	const { width, height, depth = 8 } = image;
+	const memory = estimateMemory(width, height, depth, original.bytesPerPixel);
+	checkLimits(`${original.extension.toUpperCase()} Encode`, width, height, memory, control);
+}
+
+function cachedEncode(original, image, options, control) {
+	if (cache) {
+		checkEncodeLimits(original, image, control);
+	}
+	const key = cache?.keyOf(original, image, options);
+	if (key === undefined) {
+		return original.encode(image, options, control);
+	}
+	let data = cache.get(key);
+	if (!data) {
+		data = original.encode(image, options, control);
+		cache.set(key, data);
+	}
+	return data;
+}
+
+function decodeFile(original, path, options) {
+	const fd = openSync(path, "r");
+	try {
+		return original.decodeStream
+			? original.decodeStream(fileSource(fd), options)
+			: original.decode(readFileSync(fd), options);
+	} finally {
+		closeSync(fd);
+	}
+}
+
+function encodeToFile(original, path, image, options, control) {
+	if (cache) {
+		checkEncodeLimits(original, image, control);
+	}
+	const key = cache?.keyOf(original, image, options);
+	const data = key && cache.get(key);
+	if (data) {
+		return writeFileSync(path, data);
+	}
+	const fd = openSync(path, "w");
+	try {
+		if (original.encodeStream) {
+			original.encodeStream(image, fileSink(fd), options, control);
+		} else {
+			fileSink(fd).write(original.encode(image, options, control));
+		}
+	} catch (e) {
+		closeSync(fd);
+		rmSync(path, { force: true });
+		throw e;
+	}
+	closeSync(fd);
+
+	if (key && cache.accepts(statSync(path).size)) {
+		cache.set(key, new Uint8Array(readFileSync(path)));
+	}
+}
+
 function wrapLoaders(original, e, d = e) {
 	let loadedEnc;
 	let loadedDec;
 
-	const loadEncoder = input => {
+	const loadEncoder = (input, relaxed) => {
 		if (loadedEnc) return loadedEnc;
 
-		input ??= join(import.meta.dirname, "../dist", e);
-		if (typeof input === "string") {
-			input = readFileSync(input);
+		const native = input === undefined && loadNative(e);
+		if (native) {
+			return loadedEnc = original.loadEncoder(native);
 		}
-		return loadedEnc = original.loadEncoder(input);
+		[input, relaxed] = resolveInput(e, input, relaxed);
+		return loadedEnc = original.loadEncoder(input, relaxed);
 	};
 
-	const loadDecoder = input => {
+	const loadDecoder = (input, relaxed) => {
 		if (loadedDec) return loadedDec;
 
-		input ??= join(import.meta.dirname, "../dist", d);
+		const native = input === undefined && loadNative(d);
+		if (native) {
+			return loadedDec = original.loadDecoder(native);
+		}
+		[input, relaxed] = resolveInput(d, input, relaxed);
+		return loadedDec = original.loadDecoder(input, relaxed);
+	};
+
+	const compileEncoder = relaxed => compileDist(e, relaxed);
+	const compileDecoder = relaxed => compileDist(d, relaxed);
+
+	const wrapped = {
+		...original,
+		loadEncoder,
+		loadDecoder,
+		compileEncoder,
+		compileDecoder,
+		encode: cachedEncode.bind(null, original),
+		decodeFile: decodeFile.bind(null, original),
+		encodeToFile: encodeToFile.bind(null, original),
+	};
+	if (original.loadEncoder64) {
+		wrapped.loadEncoder64 = wrap64(original.loadEncoder64, e);
+		wrapped.loadDecoder64 = wrap64(original.loadDecoder64, d);
+	}
+	return wrapped;
+}
+
+/*
+ * HEIC encoder has no file name (it runs in Web Workers), then the input
+ * is passed as is, and the Emscripten module locates its own file.
+ */
+function wrap64(loader, name) {
+	let loaded;
+
+	return input => {
+		if (loaded) return loaded;
+
+		if (name === null) {
+			return loaded = loader(input);
+		}
+		input ??= join(import.meta.dirname, "../dist", name.replace(/\.wasm$/, "-64.wasm"));
 		if (typeof input === "string") {
 			input = readFileSync(input);
 		}
-		return loadedDec = original.loadDecoder(input);
+		return loaded = loader(input);
 	};
-
-	return { ...original, loadEncoder, loadDecoder };
 }
 
 export const avif = wrapLoaders(avifRaw, "avif-enc.wasm", "avif-dec.wasm");
@@ -56,3 +415,14 @@ export const wp2 = wrapLoaders(wp2Raw, "wp2-enc.wasm", "wp2-dec.wasm");
  * it will require the bundler to add additional config to exclude node modules.
  */
 export const heic = wrapLoaders(heicRaw, null, "heic-dec.wasm");
+
+/**
+ * Load dist/transcoder.wasm if the input is not specified.
+ */
+export function loadTranscoder(input) {
+	input ??= join(import.meta.dirname, "../dist/transcoder.wasm");
+	if (typeof input === "string") {
+		input = readFileSync(input);
+	}
+	return transcoderRaw.loadTranscoder(input);
+}
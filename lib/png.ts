@@ -1,5 +1,5 @@
-import wasmFactory, { optimize, png_to_rgba, quantize } from "../dist/pngquant.js";
-import { ImageDataLike, toBitDepth, WasmSource } from "./common.js";
+import wasmFactory, { optimize, Palette, png_to_rgba, quantize } from "../dist/pngquant.js";
+import { checkLimits, Control, decodeES, DecodeOptions, estimateMemory, ImageDataLike, PixelFormat, toBitDepth, toPixelFormat, toWasmControl, WasmSource } from "./common.js";
 
 export interface QuantizeOptions {
 	/**
@@ -33,6 +33,22 @@ export interface QuantizeOptions {
 	 * @default 1
 	 */
 	dithering?: number;
+
+	/**
+	 * Remap colors to the palette from `createPalette` instead of generating one,
+	 * other quantize options are ignored since they are applied at its creation.
+	 *
+	 * @default null
+	 */
+	palette?: Palette | null;
+
+	/**
+	 * Run imagequant (and oxipng trials of `encode`) in parallel, only effective
+	 * if the threaded variant is loaded by `loadEncoderThreaded`.
+	 *
+	 * @default true
+	 */
+	threads?: boolean;
 }
 
 export interface Options extends QuantizeOptions {
@@ -55,7 +71,8 @@ export interface Options extends QuantizeOptions {
 	 * Lossy compress the image to PNG for significant file size reduction.
 	 * Implements the same functionality as [pngquant](https://pngquant.org)
 	 *
-	 * if set to false, properties from `QuantizeOptions` are ignored.
+	 * if set to false, other properties from `QuantizeOptions` are ignored,
+	 * except `threads`, and passing a `palette` throws TypeError.
 	 *
 	 * @default true
 	 */
@@ -63,6 +80,9 @@ export interface Options extends QuantizeOptions {
 
 	/** @internal */
 	bit_depth?: number;
+
+	/** @internal */
+	channels?: number;
 }
 
 export const defaultOptions: Required<Options> = {
@@ -70,13 +90,22 @@ export const defaultOptions: Required<Options> = {
 	quality: 75,
 	colors: 256,
 	dithering: 1,
+	palette: null,
 	level: 3,
 	interlace: false,
 	quantize: true,
+	threads: true,
 
 	bit_depth: 8,
+	channels: 4,
 };
 
+// Indexed by the number of channels, PNG supports all pixel formats.
+const pixelFormats: PixelFormat[] = ["gray", "grayAlpha", "rgb", "rgba"];
+
+// Rough peak memory usage per pixel, used to check `maxMemory`.
+export const bytesPerPixel = 8;
+
 export const bitDepth = [8, 16];
 export const mimeType = "image/png";
 export const extension = "png";
@@ -84,6 +113,25 @@ export const extension = "png";
 export const loadEncoder = (module_or_path?: WasmSource) => wasmFactory({ module_or_path });
 export const loadDecoder = loadEncoder;
 
+let threadedWASM: any;
+
+/**
+ * Load the threaded variant (`png-mt.wasm`), which runs on a pool of Web Workers.
+ * It needs `SharedArrayBuffer`, so the page must be cross-origin isolated,
+ * and it's not supported in Node.
+ *
+ * @param threads Number of threads in the pool, default is all logical processors.
+ */
+export async function loadEncoderThreaded(module_or_path?: WasmSource, threads = navigator.hardwareConcurrency) {
+	if (!threadedWASM) {
+		const module = await import("../dist/pngquant-mt.js");
+		await module.default({ module_or_path });
+		await module.initThreadPool(threads);
+		threadedWASM = module;
+	}
+	return threadedWASM;
+}
+
 /**
  * Reduces the colors used in the image at a slight loss, using a combination
  * of vector quantization algorithms.
@@ -92,25 +140,97 @@ export const loadDecoder = loadEncoder;
  */
 export function reduceColors(image: ImageDataLike, options?: QuantizeOptions) {
 	options = { ...defaultOptions, ...options };
-	const { data, width, height } = toBitDepth(image, 8);
-	return quantize(data as Uint8Array, width, height, { ...defaultOptions, ...options });
+	const { data, width, height } = toPixelFormat(toBitDepth(image, 8), "rgba");
+	if (options.palette) {
+		return options.palette.remap(data as Uint8Array, width, height);
+	}
+	const wasm = options.threads && threadedWASM ? threadedWASM : { quantize };
+	return wasm.quantize(data as Uint8Array, width, height, { ...defaultOptions, ...options });
 }
 
-export function encode(image: ImageDataLike, options?: Options) {
+/**
+ * Generate a palette from colors of all the images, which can be passed to
+ * `reduceColors` and `encode` as `options.palette`. Images remapped with it
+ * have consistent colors, e.g. frames of an animation or icons of a set,
+ * and the quantization is done only once.
+ *
+ * The palette is generated on the first use, images can't be added after that.
+ * Call `palette.free()` to release the WASM memory when it's no longer needed.
+ */
+export function createPalette(images: ImageDataLike[], options?: QuantizeOptions) {
+	const palette = new Palette({ ...defaultOptions, ...options, palette: null });
+	for (const image of images) {
+		const { data, width, height } = toPixelFormat(toBitDepth(image, 8), "rgba");
+		palette.add(data as Uint8Array, width, height);
+	}
+	return palette;
+}
+
+/**
+ * Like `reduceColors`, but all images share one palette generated from them.
+ */
+export function reduceColorsMany(images: ImageDataLike[], options?: QuantizeOptions) {
+	const palette = createPalette(images, options);
+	try {
+		return images.map(image => reduceColors(image, { palette }));
+	} finally {
+		palette.free();
+	}
+}
+
+/**
+ * The Rust code does not support progress or cancellation, the control
+ * is only checked before encoding.
+ */
+export function encode(image: ImageDataLike, options?: Options, control?: Control) {
+	toWasmControl("PNG Encode", control);
+	const memory = estimateMemory(image.width, image.height, image.depth ?? 8, bytesPerPixel);
+	checkLimits("PNG Encode", image.width, image.height, memory, control);
 	options = { ...defaultOptions, ...options };
+	if (options.palette && !options.quantize) {
+		throw new TypeError("PNG Encode: `palette` requires `quantize`");
+	}
 	if (options.quantize) {
-		image = toBitDepth(image, 8);
+		image = toPixelFormat(toBitDepth(image, 8), "rgba");
 	}
-	const { data, width, height, depth } = image;
+	if (options.quantize && options.palette) {
+		const { data, width, height } = image;
+		image = { data: options.palette.remap(data as Uint8Array, width, height), width, height, depth: 8 };
+		options.quantize = false;
+	}
+	options.palette = null;
+	const { data, width, height, depth, format = "rgba" } = image;
 	options.bit_depth = depth;
-	return optimize(data as Uint8Array, width, height, { ...defaultOptions, ...options });
+	options.channels = pixelFormats.indexOf(format) + 1;
+	const wasm = options.threads && threadedWASM ? threadedWASM : { optimize };
+	return wasm.optimize(data as Uint8Array, width, height, { ...defaultOptions, ...options });
 }
 
-export function decode(input: Uint8Array) {
-	const [data, width, depth] = png_to_rgba(input);
-	let height = data.byteLength / width / 4;
+const PNG_SIGNATURE = [0x89, 0x50, 0x4E, 0x47, 0x0D, 0x0A, 0x1A, 0x0A];
+
+/**
+ * Gray and RGB images are decoded without expanding if `options.format` is not RGBA.
+ */
+export function decode(input: Uint8Array, options?: DecodeOptions) {
+	toWasmControl("PNG Decode", options);
+
+	// IHDR is always the first chunk: signature (8 bytes), length and type (8 bytes),
+	// width, height (32-bit big endian) and bit depth. Other input is left to the
+	// decoder, which reports the format error.
+	if (input.byteLength >= 25 && PNG_SIGNATURE.every((v, i) => input[i] === v)) {
+		const view = new DataView(input.buffer, input.byteOffset, input.byteLength);
+		const width = view.getUint32(16);
+		const height = view.getUint32(20);
+		const memory = estimateMemory(width, height, input[24], bytesPerPixel) + input.byteLength;
+		checkLimits("PNG Decode", width, height, memory, options);
+	}
+
+	const rgba = (options?.format ?? "rgba") === "rgba";
+	const [data, width, depth, channels] = png_to_rgba(input, rgba ? 4 : 0, options?.maxMemory ?? 0);
+	let height = data.byteLength / width / channels;
 	if (depth === 16) {
 		height /= 2;
 	}
-	return _icodec_ImageData(data, width, height, depth);
+	const image = _icodec_ImageData(data, width, height, depth, pixelFormats[channels - 1]);
+	return decodeES("PNG Decode", image, options);
 }
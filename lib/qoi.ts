@@ -1,5 +1,5 @@
 import wasmFactory from "../dist/qoi.js";
-import { check, ImageDataLike, loadES, WasmSource } from "./common.js";
+import { check, Control, decodeES, DecodeOptions, ImageDataLike, loadES, selectDecoder, selectEncoder, toPixelFormat, toWasmControl, toWasmOptions, WasmSource } from "./common.js";
 
 /**
  * QOI encoder does not have options, it's always lossless.
@@ -12,7 +12,11 @@ export const bitDepth = [8];
 export const mimeType = "image/qoi";
 export const extension = "qoi";
 
+// Rough peak memory usage per pixel, used to select 32-bit or 64-bit WASM.
+export const bytesPerPixel = 10;
+
 let codecWASM: any;
+let codecWASM64: any;
 
 export async function loadEncoder(input?: WasmSource) {
 	return codecWASM = await loadES(wasmFactory, input);
@@ -20,12 +24,31 @@ export async function loadEncoder(input?: WasmSource) {
 
 export const loadDecoder = loadEncoder;
 
-export function encode(image: ImageDataLike) {
+/**
+ * Load the 64-bit module, which is used for images too large for the 32-bit.
+ */
+export async function loadEncoder64(input?: WasmSource) {
+	return codecWASM64 = await loadES((await import("../dist/qoi-64.js")).default, input);
+}
+
+export const loadDecoder64 = loadEncoder64;
+
+/**
+ * QOI stores RGB or RGBA, gray images are converted to them.
+ */
+export function encode(image: ImageDataLike, _?: Options, control?: Control) {
+	if (image.format !== "rgb") {
+		image = toPixelFormat(image, "rgba");
+	}
 	const { data, width, height } = image;
-	const result = codecWASM.encode(data, width, height, undefined);
+	const channels = image.format === "rgb" ? 3 : 4;
+	const wasm = selectEncoder("QOI Encode", image, bytesPerPixel, codecWASM, codecWASM64, control);
+	const result = wasm.encode(data, width, height, { channels }, toWasmControl("QOI Encode", control));
 	return check<Uint8Array>(result, "QOI Encode");
 }
 
-export function decode(input: BufferSource) {
-	return check<ImageData>(codecWASM.decode(input), "QOI Decode");
+export function decode(input: BufferSource, options?: DecodeOptions) {
+	const wasm = selectDecoder("QOI Decode", input, bytesPerPixel, codecWASM, codecWASM64, options);
+	const result = wasm.decode(input, toWasmOptions("QOI Decode", options));
+	return decodeES<ImageData>("QOI Decode", result, options);
 }
@@ -0,0 +1,51 @@
+import wasmFactory from "../dist/transcoder.js";
+import { check, Control, loadES, toWasmControl, WasmSource } from "./common.js";
+
+/**
+ * The encoder of `transcode`, it's a codec module like `avif`.
+ */
+export interface TranscodeTarget<T> {
+	defaultOptions: T;
+	extension: string;
+	bitDepth: number[];
+}
+
+let codecWASM: any;
+
+/**
+ * Load the transcoder WASM file, must be called once before `transcode`.
+ * It's built with the codecs listed by `--transcoder` of the build script,
+ * default is JPEG, WebP, JXL, AVIF, QOI and WebP2 (encode only).
+ */
+export async function loadTranscoder(input?: WasmSource) {
+	return codecWASM = await loadES(wasmFactory, input);
+}
+
+/**
+ * Convert the image to another format without returning pixels to JS, it's faster
+ * than `decode` then `encode` with codec modules, which copies pixels twice.
+ * The input format is detected by the signature.
+ *
+ * Images of bit depth not supported by the target are rescaled.
+ * Progress is reported as 0-0.5 for decoding and 0.5-1 for encoding.
+ *
+ * @example
+ * import { avif, loadTranscoder, transcode } from "icodec";
+ *
+ * await loadTranscoder();
+ * const output = transcode(jpegBytes, avif, { quality: 60 });
+ */
+export function transcode<T>(input: BufferSource, target: TranscodeTarget<T>, options?: T, control?: Control) {
+	const onProgress = control?.onProgress;
+	const decodeControl = toWasmControl("Transcode", control && {
+		...control,
+		onProgress: onProgress && (p => onProgress(p / 2)),
+	});
+	const encodeControl = toWasmControl("Transcode", control && {
+		...control,
+		onProgress: onProgress && (p => onProgress(0.5 + p / 2)),
+	});
+	options = { ...target.defaultOptions, ...options };
+	const result = codecWASM.transcode(input, target.extension, options, target.bitDepth, decodeControl, encodeControl);
+	return check<Uint8Array>(result, "Transcode");
+}
@@ -1,6 +1,6 @@
 import wasmFactoryEnc from "../dist/webp-enc.js";
 import wasmFactoryDec from "../dist/webp-dec.js";
-import { check, encodeES, ImageDataLike, loadES, WasmSource } from "./common.js";
+import { ByteSink, Control, decodeES, DecodeOptions, encodeES, encodeManyES, encodeStreamES, ImageDataLike, loadES, selectDecoder, selectEncoder, toWasmOptions, WasmSource } from "./common.js";
 
 export enum Preprocess {
 	None,
@@ -272,8 +272,13 @@ export const bitDepth = [8];
 export const mimeType = "image/webp";
 export const extension = "webp";
 
+// Rough peak memory usage per pixel, used to select 32-bit or 64-bit WASM.
+export const bytesPerPixel = 16;
+
 let encoderWASM: any;
 let decoderWASM: any;
+let encoderWASM64: any;
+let decoderWASM64: any;
 
 export async function loadEncoder(input?: WasmSource) {
 	return encoderWASM ??= await loadES(wasmFactoryEnc, input);
@@ -283,10 +288,47 @@ export async function loadDecoder(input?: WasmSource) {
 	return decoderWASM ??= await loadES(wasmFactoryDec, input);
 }
 
-export function encode(image: ImageDataLike, options?: Options) {
-	return encodeES("Webp Encode", encoderWASM, defaultOptions, image, options);
+/**
+ * Load the 64-bit encoder, which is used for images too large for the 32-bit.
+ */
+export async function loadEncoder64(input?: WasmSource) {
+	return encoderWASM64 ??= await loadES((await import("../dist/webp-enc-64.js")).default, input);
+}
+
+/**
+ * Load the 64-bit decoder, which is used for images too large for the 32-bit.
+ */
+export async function loadDecoder64(input?: WasmSource) {
+	return decoderWASM64 ??= await loadES((await import("../dist/webp-dec-64.js")).default, input);
+}
+
+export function encode(image: ImageDataLike, options?: Options, control?: Control) {
+	const wasm = selectEncoder("Webp Encode", image, bytesPerPixel, encoderWASM, encoderWASM64, control);
+	return encodeES("Webp Encode", wasm, defaultOptions, image, options, control);
+}
+
+/**
+ * Encode the image with each of the options, pixels are imported once,
+ * and lossy options with the same sharpYUV share the YUV conversion.
+ */
+export function encodeMany(image: ImageDataLike, optionsList: Options[], control?: Control) {
+	const wasm = selectEncoder("Webp Encode", image, bytesPerPixel, encoderWASM, encoderWASM64, control);
+	return encodeManyES("Webp Encode", wasm, defaultOptions, image, optionsList, control);
+}
+
+/**
+ * Encode the image and write the output to the sink by chunks,
+ * the whole output is not buffered.
+ *
+ * @return The number of bytes written.
+ */
+export function encodeStream(image: ImageDataLike, sink: ByteSink, options?: Options, control?: Control) {
+	const wasm = selectEncoder("Webp Encode", image, bytesPerPixel, encoderWASM, encoderWASM64, control);
+	return encodeStreamES("Webp Encode", wasm, defaultOptions, image, sink, options, control);
 }
 
-export function decode(input: BufferSource) {
-	return check<ImageData>(decoderWASM.decode(input), "Webp Decode");
+export function decode(input: BufferSource, options?: DecodeOptions) {
+	const wasm = selectDecoder("Webp Decode", input, bytesPerPixel, decoderWASM, decoderWASM64, options);
+	const result = wasm.decode(input, toWasmOptions("Webp Decode", options));
+	return decodeES<ImageData>("Webp Decode", result, options);
 }
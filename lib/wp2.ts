@@ -1,4 +1,4 @@
-import { check, encodeES, ImageDataLike, loadES, WasmSource } from "./common.js";
+import { ByteSink, Control, decodeES, DecodeOptions, encodeES, encodeStreamES, ImageDataLike, loadES, selectDecoder, selectEncoder, toWasmOptions, WasmSource } from "./common.js";
 import wasmFactoryEnc from "../dist/wp2-enc.js";
 import wasmFactoryDec from "../dist/wp2-dec.js";
 
@@ -73,6 +73,14 @@ export interface Options {
 
 	// Experimental features
 	useRandomMatrix?: boolean;
+
+	/**
+	 * Encode the alpha channel even if all pixels are opaque, by default the
+	 * pixels are imported as RGBX.
+	 *
+	 * @default false
+	 */
+	keepAlpha?: boolean;
 }
 
 export const defaultOptions: Required<Options> = {
@@ -85,6 +93,7 @@ export const defaultOptions: Required<Options> = {
 	cspType: Csp.YCoCg,
 	errorDiffusion: 0,
 	useRandomMatrix: false,
+	keepAlpha: false,
 };
 
 export const bitDepth = [8];
@@ -93,21 +102,56 @@ export const bitDepth = [8];
 export const mimeType = "image/webp2";
 export const extension = "wp2";
 
+// Rough peak memory usage per pixel, used to select 32-bit or 64-bit WASM.
+export const bytesPerPixel = 32;
+
 let encoderWASM: any;
 let decoderWASM: any;
+let encoderWASM64: any;
+let decoderWASM64: any;
+
+export async function loadEncoder(input?: WasmSource, relaxed?: boolean) {
+	const loadRelaxed = () => import("../dist/wp2-enc-relaxed.js");
+	return encoderWASM ??= await loadES(wasmFactoryEnc, input, relaxed, loadRelaxed);
+}
+
+export async function loadDecoder(input?: WasmSource, relaxed?: boolean) {
+	const loadRelaxed = () => import("../dist/wp2-dec-relaxed.js");
+	return decoderWASM ??= await loadES(wasmFactoryDec, input, relaxed, loadRelaxed);
+}
+
+/**
+ * Load the 64-bit encoder, which is used for images too large for the 32-bit.
+ */
+export async function loadEncoder64(input?: WasmSource) {
+	return encoderWASM64 ??= await loadES((await import("../dist/wp2-enc-64.js")).default, input);
+}
 
-export async function loadEncoder(input?: WasmSource) {
-	return encoderWASM ??= await loadES(wasmFactoryEnc, input);
+/**
+ * Load the 64-bit decoder, which is used for images too large for the 32-bit.
+ */
+export async function loadDecoder64(input?: WasmSource) {
+	return decoderWASM64 ??= await loadES((await import("../dist/wp2-dec-64.js")).default, input);
 }
 
-export async function loadDecoder(input?: WasmSource) {
-	return decoderWASM ??= await loadES(wasmFactoryDec, input);
+export function encode(image: ImageDataLike, options?: Options, control?: Control) {
+	const wasm = selectEncoder("Webp2 Encode", image, bytesPerPixel, encoderWASM, encoderWASM64, control);
+	return encodeES("Webp2 Encode", wasm, defaultOptions, image, options, control);
 }
 
-export function encode(image: ImageDataLike, options?: Options) {
-	return encodeES("Webp2 Encode", encoderWASM, defaultOptions, image, options);
+/**
+ * Encode the image and write the output to the sink by chunks,
+ * the whole output is not buffered.
+ *
+ * @return The number of bytes written.
+ */
+export function encodeStream(image: ImageDataLike, sink: ByteSink, options?: Options, control?: Control) {
+	const wasm = selectEncoder("Webp2 Encode", image, bytesPerPixel, encoderWASM, encoderWASM64, control);
+	return encodeStreamES("Webp2 Encode", wasm, defaultOptions, image, sink, options, control);
 }
 
-export function decode(input: BufferSource) {
-	return check<ImageData>(decoderWASM.decode(input), "Webp2 Decode");
+export function decode(input: BufferSource, options?: DecodeOptions) {
+	const wasm = selectDecoder("Webp2 Decode", input, bytesPerPixel, decoderWASM, decoderWASM64, options);
+	const result = wasm.decode(input, toWasmOptions("Webp2 Decode", options));
+	return decodeES<ImageData>("Webp2 Decode", result, options);
 }
@@ -1,3 +1,4 @@
+#[cfg(not(feature = "threads"))]
 use lol_alloc::{AssumeSingleThreaded, FreeListAllocator};
 use std::cmp;
 use bytemuck::Pod;
@@ -8,10 +9,16 @@ use serde_wasm_bindgen::from_value;
 use wasm_bindgen::prelude::*;
 
 // Save ~5KB WASM size and has the same performance as std.
+// The threaded build uses the std allocator, which takes a lock with atomics.
+#[cfg(not(feature = "threads"))]
 #[global_allocator]
 static ALLOC: AssumeSingleThreaded<FreeListAllocator> =
 	unsafe { AssumeSingleThreaded::new(FreeListAllocator::new()) };
 
+// Exported as `initThreadPool(threads)`, must be called before using the threaded build.
+#[cfg(feature = "threads")]
+pub use wasm_bindgen_rayon::init_thread_pool;
+
 #[derive(Serialize, Deserialize)]
 pub struct QuantizeOptions {
 	pub quality: u8,
@@ -20,14 +27,25 @@ pub struct QuantizeOptions {
 	pub dithering: f32,
 }
 
-#[wasm_bindgen]
-pub fn quantize(mut data: Vec<u8>, width: usize, height: usize, options: JsValue) -> Vec<u8> {
-	let options: QuantizeOptions = from_value(options).unwrap_throw();
-
+fn new_quantizer(options: &QuantizeOptions) -> imagequant::Attributes {
 	let mut quantizer = imagequant::new();
 	quantizer.set_speed(options.speed).unwrap_throw();
 	quantizer.set_quality(0, options.quality).unwrap_throw();
 	quantizer.set_max_colors(options.colors).unwrap_throw();
+	return quantizer;
+}
+
+/// Convert RGBAs back from the palette and the color references.
+fn write_remapped(rgba: &mut [RGBA<u8>], palette: &[RGBA<u8>], pixels: &[u8]) {
+	for i in 0..pixels.len() {
+		rgba[i] = palette[pixels[i] as usize]
+	}
+}
+
+#[wasm_bindgen]
+pub fn quantize(mut data: Vec<u8>, width: usize, height: usize, options: JsValue) -> Vec<u8> {
+	let options: QuantizeOptions = from_value(options).unwrap_throw();
+	let quantizer = new_quantizer(&options);
 
 	let rgba: &mut [RGBA<u8>] = bytemuck::cast_slice_mut(data.as_mut_slice());
 	let mut image = quantizer.new_image(&*rgba, width, height, 0.0).unwrap_throw();
@@ -40,15 +58,72 @@ pub fn quantize(mut data: Vec<u8>, width: usize, height: usize, options: JsValue
 	// Enable dithering for subsequent remappings.
 	res.set_dithering_level(options.dithering).unwrap_throw();
 
-	// You can reuse the result to generate several images with the same palette.
+	// The result is reusable to generate several images with the same palette, see `Palette`.
 	let (palette, pixels) = res.remapped(&mut image).unwrap_throw();
+	write_remapped(rgba, &palette, &pixels);
 
-	// Convert RGBAs back from the palette and the color references.
-	for i in 0..pixels.len() {
-		rgba[i] = palette[pixels[i] as usize]
+	return data; // Modifications are not propagated to JS, so we need to return the data.
+}
+
+/// A palette shared by multiple images, e.g. frames or sprites. Colors of all
+/// images are accumulated into a histogram, the palette is generated from it
+/// on the first remapping, and can be reused for later images.
+#[wasm_bindgen]
+pub struct Palette {
+	quantizer: imagequant::Attributes,
+	histogram: imagequant::Histogram,
+	result: Option<imagequant::QuantizationResult>,
+	dithering: f32,
+}
+
+#[wasm_bindgen]
+impl Palette {
+	#[wasm_bindgen(constructor)]
+	pub fn new(options: JsValue) -> Palette {
+		let options: QuantizeOptions = from_value(options).unwrap_throw();
+		let quantizer = new_quantizer(&options);
+		let histogram = imagequant::Histogram::new(&quantizer);
+		return Palette { quantizer, histogram, result: None, dithering: options.dithering };
 	}
 
-	return data; // Modifications are not propagated to JS, so we need to return the data.
+	/// Add colors of the image to the histogram, must be called before remapping.
+	pub fn add(&mut self, data: &[u8], width: usize, height: usize) {
+		if self.result.is_some() {
+			wasm_bindgen::throw_str("The palette has been generated");
+		}
+		let rgba: &[RGBA<u8>] = bytemuck::cast_slice(data);
+		let mut image = self.quantizer.new_image(rgba, width, height, 0.0).unwrap_throw();
+		self.histogram.add_image(&self.quantizer, &mut image).unwrap_throw();
+	}
+
+	/// Replace pixels of the image with the palette, the image doesn't need to be added.
+	pub fn remap(&mut self, mut data: Vec<u8>, width: usize, height: usize) -> Vec<u8> {
+		let rgba: &mut [RGBA<u8>] = bytemuck::cast_slice_mut(data.as_mut_slice());
+		let mut image = self.quantizer.new_image(&*rgba, width, height, 0.0).unwrap_throw();
+
+		let res = self.generate();
+		let (palette, pixels) = res.remapped(&mut image).unwrap_throw();
+		write_remapped(rgba, &palette, &pixels);
+		return data;
+	}
+
+	/// Colors of the palette, 4 bytes (RGBA) per entry.
+	pub fn colors(&mut self) -> Vec<u8> {
+		let palette = self.generate().palette();
+		return bytemuck::cast_slice(palette).to_vec();
+	}
+
+	fn generate(&mut self) -> &mut imagequant::QuantizationResult {
+		if self.result.is_none() {
+			let mut res = match self.histogram.quantize(&self.quantizer) {
+				Ok(res) => res,
+				Err(err) => panic!("Quantization failed, because: {err:?}"),
+			};
+			res.set_dithering_level(self.dithering).unwrap_throw();
+			self.result = Some(res);
+		}
+		return self.result.as_mut().unwrap();
+	}
 }
 
 fn swap_endian(data: &mut Vec<u8>) {
@@ -61,6 +136,7 @@ pub struct EncodeOptions {
 	pub level: u8,
 	pub interlace: bool,
 	pub bit_depth: u8,
+	pub channels: u8,
 }
 
 pub fn png_encode(mut data: Vec<u8>, width: u32, height: u32, options: EncodeOptions) -> Vec<u8> {
@@ -79,10 +155,17 @@ pub fn png_encode(mut data: Vec<u8>, width: u32, height: u32, options: EncodeOpt
 		oxipng::BitDepth::Sixteen
 	};
 
+	let color_type = match options.channels {
+		1 => oxipng::ColorType::Grayscale { transparent_shade: None },
+		2 => oxipng::ColorType::GrayscaleAlpha,
+		3 => oxipng::ColorType::RGB { transparent_color: None },
+		_ => oxipng::ColorType::RGBA,
+	};
+
 	let raw = oxipng::RawImage::new(
 		width,
 		height,
-		oxipng::ColorType::RGBA,
+		color_type,
 		depth,
 		data
 	);
@@ -108,19 +191,35 @@ fn cast_pixels<T: Pod>(buf: &mut [u8]) {
 	}
 }
 
-/// Decode PNG image into 8-bit RGBA data, return only the buffer and width,
-/// but height can be calculated by `data.byteLength / width / 4`
+/// Decode PNG image into 8-bit or 16-bit pixels, return the buffer, width, depth
+/// and the number of channels, height can be calculated from them.
+///
+/// If `channels` is 4, the output is always RGBA, otherwise it's in the color type
+/// of the image (palette expanded), and JS side converts it to the requested.
+///
+/// `max_memory` limits the allocations of the decoder (chunks and row buffers),
+/// 0 means the default limit of the png crate.
 #[wasm_bindgen]
-pub fn png_to_rgba(data: &[u8]) -> js_sys::Array {
-	let mut decoder = png::Decoder::new(data);
-	decoder.set_transformations(png::Transformations::ALPHA);
+pub fn png_to_rgba(data: &[u8], channels: u8, max_memory: f64) -> js_sys::Array {
+	let mut decoder = if max_memory > 0.0 {
+		png::Decoder::new_with_limits(data, png::Limits { bytes: max_memory as usize })
+	} else {
+		png::Decoder::new(data)
+	};
+	decoder.set_transformations(if channels == 4 {
+		png::Transformations::ALPHA
+	} else {
+		png::Transformations::EXPAND
+	});
 	let mut reader = decoder.read_info().unwrap_throw();
 
+	let (color_type, bit_depth) = reader.output_color_type();
 	let info = reader.info();
 	let width = info.width;
-	let color_type = info.color_type;
-	let depth = cmp::max(8, info.bit_depth as u32);
-	let length = (width * info.height * depth / 2) as usize;
+	let depth = cmp::max(8, bit_depth as u32);
+	let samples = if channels == 4 { 4 } else { color_type.samples() as u32 };
+	let length = width as u64 * info.height as u64 * samples as u64 * depth as u64 / 8;
+	let length = usize::try_from(length).expect_throw("The image is too large");
 
 	// Create the buffer without fill the default value.
 	let mut buffer = Vec::<u8>::with_capacity(length);
@@ -129,14 +228,14 @@ pub fn png_to_rgba(data: &[u8]) -> js_sys::Array {
 	reader.next_frame(&mut buffer).unwrap();
 
 	match color_type {
-		png::ColorType::Grayscale | png::ColorType::GrayscaleAlpha => {
+		png::ColorType::Grayscale | png::ColorType::GrayscaleAlpha if channels == 4 => {
 			if depth == 16 {
 				cast_pixels::<u16>(&mut buffer);
 			} else {
 				cast_pixels::<u8>(&mut buffer);
 			}
 		}
-		_ => { /* Transformations ensure RGB & platted image to RGBA */ }
+		_ => { /* Transformations ensure RGB & platted image to RGBA, or keep the color type */ }
 	}
 
 	// Pixels stored in PNG is big-endian, but icodec use little-endian.
@@ -145,5 +244,5 @@ pub fn png_to_rgba(data: &[u8]) -> js_sys::Array {
 	}
 
 	let data = js_sys::Uint8ClampedArray::from(buffer.as_slice());
-	return js_sys::Array::of3(&data.into(), &width.into(), &depth.into());
+	return js_sys::Array::of4(&data.into(), &width.into(), &depth.into(), &samples.into());
 }
@@ -1,9 +1,9 @@
 import { execFileSync } from "node:child_process";
 import { dirname } from "node:path";
 import { argv } from "node:process";
-import { mkdirSync, renameSync, writeFileSync } from "node:fs";
-import { config, emcc, emcmake, fixPThreadImpl, wasmPack } from "./toolchain.js";
-import { removeRange, RepositoryManager } from "./repository.js";
+import { mkdirSync, readFileSync, renameSync, rmSync, writeFileSync } from "node:fs";
+import { config, emcc, emcmake, fixPThreadImpl, getVariants, variants, wasmPack } from "./toolchain.js";
+import { patchFile, removeRange, RepositoryManager } from "./repository.js";
 
 // Ensure we're on the project root directory.
 process.chdir(dirname(import.meta.dirname));
@@ -26,12 +26,28 @@ const repositories = new RepositoryManager({
 	// vvdec: ["v2.3.0", "https://github.com/fraunhoferhhi/vvdec"],
 });
 
+/*
+ * libwebp is shared by other modules, relaxed SIMD variants of
+ * them link to the baseline, 64-bit and native need their own build.
+ */
+function webpDir(variant) {
+	if (variant.native) {
+		return "vendor/libwebp-native";
+	}
+	return variant.wasm64 ? "vendor/libwebp-64" : "vendor/libwebp";
+}
+
 // It also builds libsharpyuv.a which used in other encoders.
-function buildWebPLibrary() {
+function buildWebPLibrary(variant) {
+	const dist = webpDir(variant);
+	const { native } = variant;
 	emcmake({
-		outFile: "vendor/libwebp/libwebp.a",
+		outFile: `${dist}/libwebp.a`,
 		src: "vendor/libwebp",
-		flags: "-msse2 -msse4.1 -DWEBP_DISABLE_STATS -DWEBP_REDUCE_CSP",
+		dist,
+		variant: native || variant.wasm64 ? variant : variants.simd,
+		// SSE flags let Emscripten translate intrinsics, native code dispatches at runtime.
+		flags: (native ? "" : "-msse2 -msse4.1 ") + "-DWEBP_DISABLE_STATS -DWEBP_REDUCE_CSP",
 		options: {
 			WEBP_ENABLE_SIMD: 1,
 			WEBP_BUILD_CWEBP: 0,
@@ -43,111 +59,175 @@ function buildWebPLibrary() {
 			WEBP_BUILD_LIBWEBPMUX: 0,
 			WEBP_BUILD_WEBPMUX: 0,
 			WEBP_BUILD_EXTRAS: 0,
-			WEBP_USE_THREAD: 0,
+			WEBP_USE_THREAD: native ? 1 : 0,
 			WEBP_BUILD_ANIM_UTILS: 0,
 		},
 	});
 }
 
 export function buildMozJPEG() {
-	emcmake({
-		outFile: "vendor/mozjpeg/libjpeg.a",
-		src: "vendor/mozjpeg",
-		// https://github.com/libjpeg-turbo/libjpeg-turbo/issues/600
-		flags: "-DNO_GETENV -DNO_PUTENV",
-		options: {
-			WITH_SIMD: 0,
-			ENABLE_SHARED: 0,
-			WITH_TURBOJPEG: 0,
-			PNG_SUPPORTED: 0,
-		},
-	});
-	execFileSync("emcc", [
-		"rdswitch.c",
-		"-O3",
-		"-c",
-		config.wasm64 ? "-sMEMORY64" : "",
-	], {
-		stdio: "inherit",
-		shell: true,
-		cwd: "vendor/mozjpeg",
+	/*
+	 * The SIMD extensions of libjpeg-turbo have no WASM backend, it falls back to
+	 * the C code when WITH_SIMD=0, we replace the stub with our SIMD128 port.
+	 */
+	patchFile("vendor/mozjpeg/CMakeLists.txt", file => {
+		const content = readFileSync(file, "utf8");
+		const stub = "add_library(simd OBJECT jsimd_none.c)";
+		if (!content.includes(stub)) {
+			throw new Error(file + ": Cannot find the pattern to replace");
+		}
+		return content.replace(stub, "add_library(simd OBJECT ../../cpp/jsimd_wasm.c)");
 	});
-	emcc("cpp/mozjpeg.cpp", [
-		"-I vendor/mozjpeg",
-		"vendor/mozjpeg/libjpeg.a",
-		"vendor/mozjpeg/rdswitch.o",
-	]);
+
+	for (const variant of getVariants()) {
+		const dist = "vendor/mozjpeg" + variant.suffix;
+		emcmake({
+			outFile: `${dist}/libjpeg.a`,
+			src: "vendor/mozjpeg",
+			dist,
+			variant,
+			// https://github.com/libjpeg-turbo/libjpeg-turbo/issues/600
+			flags: "-DNO_GETENV -DNO_PUTENV",
+			options: {
+				WITH_SIMD: variant.native ? 1 : 0,
+				ENABLE_SHARED: 0,
+				WITH_TURBOJPEG: 0,
+				PNG_SUPPORTED: 0,
+			},
+		});
+		execFileSync(variant.native ? "cc" : "emcc", [
+			"vendor/mozjpeg/rdswitch.c",
+			"-I vendor/mozjpeg",
+			`-I ${dist}`,
+			"-O3",
+			"-c",
+			"-o", `${dist}/rdswitch.o`,
+			variant.flags,
+		], {
+			stdio: "inherit",
+			shell: true,
+		});
+		emcc("cpp/mozjpeg.cpp", [
+			"-I vendor/mozjpeg",
+			`-I ${dist}`,
+			`${dist}/libjpeg.a`,
+			`${dist}/rdswitch.o`,
+		], variant);
+	}
 }
 
+// Rust has no stable wasm64 target yet, the PNG module is 32-bit only.
 export function buildPNGQuant() {
 	wasmPack("rust");
 	// `--out-dir` cannot be out of the rust workspace.
 	renameSync("rust/pkg/pngquant.js", `${config.outDir}/pngquant.js`);
 	renameSync("rust/pkg/pngquant_bg.wasm", `${config.outDir}/pngquant_bg.wasm`);
+
+	/*
+	 * The threaded variant runs oxipng trials and imagequant on a rayon pool
+	 * of Web Workers, the worker script of wasm-bindgen-rayon is in snippets.
+	 */
+	wasmPack("rust", "pngquant-mt", true);
+	renameSync("rust/pkg/pngquant-mt.js", `${config.outDir}/pngquant-mt.js`);
+	renameSync("rust/pkg/pngquant-mt_bg.wasm", `${config.outDir}/pngquant-mt_bg.wasm`);
+	rmSync(`${config.outDir}/snippets`, { recursive: true, force: true });
+	renameSync("rust/pkg/snippets", `${config.outDir}/snippets`);
 }
 
+/*
+ * Allocators of modules, dlmalloc is the default:
+ * - emmalloc for small modules, it is much smaller and they allocate only a few times.
+ * - mimalloc for multithreaded modules, dlmalloc uses a global lock.
+ */
+const SMALL_MALLOC = ["-s", "MALLOC=emmalloc"];
+const THREADED_MALLOC = ["-s", "MALLOC=mimalloc"];
+
 export function buildQOI() {
-	emcc("cpp/qoi.cpp", ["-I vendor/qoi"]);
+	for (const variant of getVariants()) {
+		emcc("cpp/qoi.cpp", ["-I vendor/qoi", ...SMALL_MALLOC], variant);
+	}
 }
 
 export function buildWebP() {
-	buildWebPLibrary();
-	emcc("cpp/webp_enc.cpp", [
-		"-I vendor/libwebp",
-		"vendor/libwebp/libwebp.a",
-		"vendor/libwebp/libsharpyuv.a",
-	]);
-	emcc("cpp/webp_dec.cpp", [
-		"-I vendor/libwebp",
-		"vendor/libwebp/libwebp.a",
-		"vendor/libwebp/libsharpyuv.a",
-	]);
+	for (const variant of getVariants()) {
+		const dist = webpDir(variant);
+		buildWebPLibrary(variant);
+		emcc("cpp/webp_enc.cpp", [
+			"-I vendor/libwebp",
+			`${dist}/libwebp.a`,
+			`${dist}/libsharpyuv.a`,
+		], variant);
+		emcc("cpp/webp_dec.cpp", [
+			"-I vendor/libwebp",
+			...SMALL_MALLOC,
+			`${dist}/libwebp.a`,
+			`${dist}/libsharpyuv.a`,
+		], variant);
+	}
 }
 
-export function buildJXL() {
-	// highway uses CJS scripts in build, but our project is ESM.
-	writeFileSync("vendor/libjxl/third_party/highway/package.json", "{}");
-	emcmake({
-		outFile: "vendor/libjxl/lib/libjxl.a",
-		src: "vendor/libjxl",
-		options: {
-			BUILD_SHARED_LIBS: 0,
-			BUILD_TESTING: 0,
-			JPEGXL_BUNDLE_LIBPNG: 0,
-			JPEGXL_ENABLE_JPEGLI: 0,
-			JPEGXL_ENABLE_SJPEG: 0,
-			JPEGXL_ENABLE_JNI: 0,
-			JPEGXL_ENABLE_MANPAGES: 0,
-			JPEGXL_ENABLE_TOOLS: 0,
-			JPEGXL_ENABLE_BENCHMARK: 0,
-			JPEGXL_ENABLE_DOXYGEN: 0,
-			JPEGXL_ENABLE_EXAMPLES: 0,
-		},
-	});
-	const includes = [
+function jxlLibraries(dist) {
+	return [
 		"-I vendor/libjxl/third_party/highway",
 		"-I vendor/libjxl/lib/include",
-		"vendor/libjxl/lib/libjxl.a",
-		"vendor/libjxl/lib/libjxl_cms.a",
-		"vendor/libjxl/third_party/brotli/libbrotlidec.a",
-		"vendor/libjxl/third_party/brotli/libbrotlienc.a",
-		"vendor/libjxl/third_party/brotli/libbrotlicommon.a",
-		"vendor/libjxl/third_party/highway/libhwy.a",
+		`-I ${dist}/lib/include`,
+		`${dist}/lib/libjxl.a`,
+		`${dist}/lib/libjxl_cms.a`,
+		`${dist}/third_party/brotli/libbrotlidec.a`,
+		`${dist}/third_party/brotli/libbrotlienc.a`,
+		`${dist}/third_party/brotli/libbrotlicommon.a`,
+		`${dist}/third_party/highway/libhwy.a`,
 	];
-	emcc("cpp/jxl_enc.cpp", includes);
-	emcc("cpp/jxl_dec.cpp", includes);
 }
 
-function buildAVIFPartial(isEncode) {
-	const typeName = isEncode ? "enc" : "dec";
+export function buildJXL() {
+	// highway uses CJS scripts in build, but our project is ESM.
+	writeFileSync("vendor/libjxl/third_party/highway/package.json", "{}");
+
+	for (const variant of getVariants(true)) {
+		const dist = "vendor/libjxl" + variant.suffix;
+		emcmake({
+			outFile: `${dist}/lib/libjxl.a`,
+			src: "vendor/libjxl",
+			dist,
+			variant,
+			options: {
+				BUILD_SHARED_LIBS: 0,
+				BUILD_TESTING: 0,
+				JPEGXL_BUNDLE_LIBPNG: 0,
+				JPEGXL_ENABLE_JPEGLI: 0,
+				JPEGXL_ENABLE_SJPEG: 0,
+				JPEGXL_ENABLE_JNI: 0,
+				JPEGXL_ENABLE_MANPAGES: 0,
+				JPEGXL_ENABLE_TOOLS: 0,
+				JPEGXL_ENABLE_BENCHMARK: 0,
+				JPEGXL_ENABLE_DOXYGEN: 0,
+				JPEGXL_ENABLE_EXAMPLES: 0,
+			},
+		});
+		const includes = jxlLibraries(dist);
+		emcc("cpp/jxl_enc.cpp", includes, variant);
+		emcc("cpp/jxl_dec.cpp", includes, variant);
+	}
+}
+
+/*
+ * Build aom and libavif with the encoder, the decoder or both, codec modules
+ * use one of them, the transcoder needs both in the same library.
+ */
+function buildAVIFLibrary(typeName, encoder, decoder, variant) {
+	const { native } = variant;
+	const aomDir = `vendor/aom/${typeName}-build${variant.suffix}`;
+	const avifDir = `vendor/libavif/${typeName}-build${variant.suffix}`;
 	emcmake({
-		outFile: `vendor/aom/${typeName}-build/libaom.a`,
+		outFile: `${aomDir}/libaom.a`,
 		src: "vendor/aom",
-		dist: `vendor/aom/${typeName}-build`,
-		flags: "-msse2 -msse4.1",
+		dist: aomDir,
+		variant,
+		flags: native ? "" : "-msse2 -msse4.1",
 		options: {
 			ENABLE_CCACHE: 0,
-			AOM_TARGET_CPU: "generic",
+			AOM_TARGET_CPU: native ? process.arch : "generic",
 			AOM_EXTRA_C_FLAGS: "-UNDEBUG",
 			AOM_EXTRA_CXX_FLAGS: "-UNDEBUG",
 			ENABLE_DOCS: 0,
@@ -156,133 +236,148 @@ function buildAVIFPartial(isEncode) {
 			ENABLE_TOOLS: 0,
 			CONFIG_ACCOUNTING: 0,
 			CONFIG_INSPECTION: 0,
-			CONFIG_RUNTIME_CPU_DETECT: 0,
+			CONFIG_RUNTIME_CPU_DETECT: native ? 1 : 0,
 			CONFIG_WEBM_IO: 0,
 
-			CONFIG_MULTITHREAD: 0,
+			CONFIG_MULTITHREAD: native ? 1 : 0,
 			CONFIG_AV1_HIGHBITDEPTH: 1,
 
-			CONFIG_AV1_ENCODER: isEncode,
-			CONFIG_AV1_DECODER: 1 - isEncode,
+			CONFIG_AV1_ENCODER: encoder,
+			CONFIG_AV1_DECODER: decoder,
 		},
 	});
 	emcmake({
-		outFile: `vendor/libavif/${typeName}-build/libavif.a`,
+		outFile: `${avifDir}/libavif.a`,
 		src: "vendor/libavif",
-		dist: `vendor/libavif/${typeName}-build`,
+		dist: avifDir,
+		variant,
 		options: {
 			AVIF_ENABLE_EXPERIMENTAL_SAMPLE_TRANSFORM: 1,
 			BUILD_SHARED_LIBS: 0,
 
 			AVIF_CODEC_AOM: "SYSTEM",
-			AOM_LIBRARY: `vendor/aom/${typeName}-build/libaom.a`,
+			AOM_LIBRARY: `${aomDir}/libaom.a`,
 			AOM_INCLUDE_DIR: "vendor/aom",
 
 			AVIF_LIBYUV: "LOCAL",
 
 			AVIF_LIBSHARPYUV: "SYSTEM",
-			LIBSHARPYUV_LIBRARY: "vendor/libwebp/libsharpyuv.a",
+			LIBSHARPYUV_LIBRARY: `${webpDir(variant)}/libsharpyuv.a`,
 			LIBSHARPYUV_INCLUDE_DIR: "vendor/libwebp",
 
-			AVIF_CODEC_AOM_ENCODE: isEncode,
-			AVIF_CODEC_AOM_DECODE: 1 - isEncode,
+			AVIF_CODEC_AOM_ENCODE: encoder,
+			AVIF_CODEC_AOM_DECODE: decoder,
 		},
 	});
-	emcc(`cpp/avif_${typeName}.cpp`, [
+	return [
 		"-I vendor/libavif/include",
-		"vendor/libwebp/libsharpyuv.a",
-		`vendor/aom/${typeName}-build/libaom.a`,
-		`vendor/libavif/${typeName}-build/libavif.a`,
-	]);
+		`${webpDir(variant)}/libsharpyuv.a`,
+		`${aomDir}/libaom.a`,
+		`${avifDir}/libavif.a`,
+	];
+}
+
+function buildAVIFPartial(isEncode, variant) {
+	const typeName = isEncode ? "enc" : "dec";
+	const libraries = buildAVIFLibrary(typeName, isEncode, 1 - isEncode, variant);
+	emcc(`cpp/avif_${typeName}.cpp`, libraries, variant);
 }
 
 export function buildAVIF() {
-	buildWebPLibrary();
-	buildAVIFPartial(1);
-	buildAVIFPartial(0);
+	for (const variant of getVariants(true)) {
+		buildWebPLibrary(variant);
+		buildAVIFPartial(1, variant);
+		buildAVIFPartial(0, variant);
+	}
 }
 
 export function buildWebP2() {
 	// libwebp2 does not provide a switch for imageio library.
 	removeRange("vendor/libwebp2/CMakeLists.txt",
 		"# build the imageio library", "\n# #######");
-	emcmake({
-		outFile: "vendor/wp2_build/libwebp2.a",
-		src: "vendor/libwebp2",
-		dist: "vendor/wp2_build",
-		options: {
-			WP2_BUILD_EXAMPLES: 0,
-			WP2_BUILD_TESTS: 0,
-			WP2_ENABLE_TESTS: 0,
-			WP2_BUILD_EXTRAS: 0,
-			WP2_ENABLE_SIMD: 1,
-			CMAKE_DISABLE_FIND_PACKAGE_Threads: 1,
-
-			// Fails in vdebug.cc
-			// WP2_REDUCED: 1,
-		},
-	});
-	emcc("cpp/wp2_enc.cpp", [
-		"-I vendor/libwebp2",
-		"vendor/wp2_build/libwebp2.a",
-	]);
-	emcc("cpp/wp2_dec.cpp", [
-		"-I vendor/libwebp2",
-		"vendor/wp2_build/libwebp2.a",
-	]);
+
+	for (const variant of getVariants(true)) {
+		const dist = "vendor/wp2_build" + variant.suffix;
+		emcmake({
+			outFile: `${dist}/libwebp2.a`,
+			src: "vendor/libwebp2",
+			dist,
+			variant,
+			options: {
+				WP2_BUILD_EXAMPLES: 0,
+				WP2_BUILD_TESTS: 0,
+				WP2_ENABLE_TESTS: 0,
+				WP2_BUILD_EXTRAS: 0,
+				WP2_ENABLE_SIMD: 1,
+				CMAKE_DISABLE_FIND_PACKAGE_Threads: variant.native ? 0 : 1,
+
+				// Fails in vdebug.cc
+				// WP2_REDUCED: 1,
+			},
+		});
+		emcc("cpp/wp2_enc.cpp", [
+			"-I vendor/libwebp2",
+			`${dist}/libwebp2.a`,
+		], variant);
+		emcc("cpp/wp2_dec.cpp", [
+			"-I vendor/libwebp2",
+			`${dist}/libwebp2.a`,
+		], variant);
+	}
 }
 
-function buildHEICPartial(isEncode) {
+function buildHEICPartial(isEncode, variant) {
 	const typeName = isEncode ? "heic_enc" : "heic_dec";
+	const { suffix } = variant;
 	emcmake({
-		outFile: `vendor/${typeName}/libheif/libheif.a`,
+		outFile: `vendor/${typeName}${suffix}/libheif/libheif.a`,
 		src: "vendor/libheif",
-		dist: "vendor/" + typeName,
+		dist: `vendor/${typeName}${suffix}`,
 		exceptions: true,
+		variant,
 		options: {
 			CMAKE_DISABLE_FIND_PACKAGE_Doxygen: 1,
 			WITH_AOM_DECODER: 0,
 			WITH_AOM_ENCODER: 0,
 			WITH_EXAMPLES: 0,
 			WITH_GDK_PIXBUF: 0,
-			ENABLE_MULTITHREADING_SUPPORT: 0,
+			ENABLE_MULTITHREADING_SUPPORT: variant.native ? 1 : 0,
 			BUILD_TESTING: 0,
 			BUILD_SHARED_LIBS: 0,
 
 			...(isEncode ? {
 				LIBSHARPYUV_INCLUDE_DIR: "vendor/libwebp",
-				LIBSHARPYUV_LIBRARY: "vendor/libwebp/libsharpyuv.a",
+				LIBSHARPYUV_LIBRARY: `${webpDir(variant)}/libsharpyuv.a`,
 
 				X265_INCLUDE_DIR: "vendor/x265/source",
-				X265_LIBRARY: "vendor/x265/8bit/libx265.a",
+				X265_LIBRARY: `vendor/x265/8bit${suffix}/libx265.a`,
 			} : {
-				LIBDE265_INCLUDE_DIR: "vendor/libde265",
-				LIBDE265_LIBRARY: "vendor/libde265/libde265/libde265.a",
+				// Generated de265-version.h is in the build directory.
+				LIBDE265_INCLUDE_DIR: `"vendor/libde265;vendor/libde265${suffix}"`,
+				LIBDE265_LIBRARY: `vendor/libde265${suffix}/libde265/libde265.a`,
 			}),
 		},
 	});
 }
 
-function buildHEIC() {
-	// Must delete x265/source/CmakeLists.txt lines 240-248 for 32-bit build.
-	if (!config.wasm64) {
-		removeRange("vendor/x265/source/CmakeLists.txt",
-			"\n    elseif(X86 AND NOT X64)", "\n    endif()");
-	}
-
-	// buildWebPLibrary();
+function buildHEICVariant(variant) {
+	const { suffix } = variant;
 
 	const x265Options = {
 		ENABLE_LIBNUMA: 0,
 		ENABLE_SHARED: 0,
 		ENABLE_CLI: 0,
-		ENABLE_ASSEMBLY: 0,
+		ENABLE_ASSEMBLY: variant.native ? 1 : 0,
 	};
 
+	// The baseline of 8-bit x265 is built in-source.
+	const x265Main = suffix ? `vendor/x265/8bit${suffix}` : "vendor/x265/source";
+
 	emcmake({
-		outFile: "vendor/x265/12bit/libx265.a",
+		outFile: `vendor/x265/12bit${suffix}/libx265.a`,
 		src: "vendor/x265/source",
-		dist: "vendor/x265/12bit",
+		dist: `vendor/x265/12bit${suffix}`,
+		variant,
 		options: {
 			...x265Options,
 			HIGH_BIT_DEPTH: 1,
@@ -291,9 +386,10 @@ function buildHEIC() {
 		},
 	});
 	emcmake({
-		outFile: "vendor/x265/10bit/libx265.a",
+		outFile: `vendor/x265/10bit${suffix}/libx265.a`,
 		src: "vendor/x265/source",
-		dist: "vendor/x265/10bit",
+		dist: `vendor/x265/10bit${suffix}`,
+		variant,
 		options: {
 			...x265Options,
 			HIGH_BIT_DEPTH: 1,
@@ -301,19 +397,23 @@ function buildHEIC() {
 		},
 	});
 	emcmake({
-		outFile: "vendor/x265/source/libx265.a",
+		outFile: `${x265Main}/libx265.a`,
 		src: "vendor/x265/source",
+		dist: x265Main,
+		variant,
 		options: {
 			...x265Options,
 			LINKED_10BIT: 1,
 			LINKED_12BIT: 1,
-			EXTRA_LIB: "vendor/x265/10bit/libx265.a;vendor/x265/12bit/libx265.a;-ldl",
+			EXTRA_LIB: `vendor/x265/10bit${suffix}/libx265.a;vendor/x265/12bit${suffix}/libx265.a;-ldl`,
 		},
 	});
 
 	emcmake({
-		outFile: "vendor/libde265/libde265/libde265.a",
+		outFile: `vendor/libde265${suffix}/libde265/libde265.a`,
 		src: "vendor/libde265",
+		dist: `vendor/libde265${suffix}`,
+		variant,
 		options: {
 			BUILD_SHARED_LIBS: 0,
 			ENABLE_SDL: 0,
@@ -322,33 +422,104 @@ function buildHEIC() {
 	});
 
 	// TODO: single thread
-	buildHEICPartial(true);
-	buildHEICPartial(false);
+	buildHEICPartial(true, variant);
+	buildHEICPartial(false, variant);
 
 	emcc("cpp/heic_enc.cpp", [
 		"-s", "ENVIRONMENT=web,worker",
-		"-I vendor/heic_enc",
+		`-I vendor/heic_enc${suffix}`,
 		"-I vendor/libheif/libheif/api",
 		"-pthread",
 		"-s", "PTHREAD_POOL_SIZE=2",
+		...THREADED_MALLOC,
 		"-fexceptions",
-		"vendor/libwebp/libsharpyuv.a",
-		"vendor/x265/source/libx265.a",
-		"vendor/x265/10bit/libx265.a",
-		"vendor/x265/12bit/libx265.a",
-		"vendor/heic_enc/libheif/libheif.a",
-	]);
+		`${webpDir(variant)}/libsharpyuv.a`,
+		`${x265Main}/libx265.a`,
+		`vendor/x265/10bit${suffix}/libx265.a`,
+		`vendor/x265/12bit${suffix}/libx265.a`,
+		`vendor/heic_enc${suffix}/libheif/libheif.a`,
+	], variant);
 
 	emcc("cpp/heic_dec.cpp", [
 		"-s", "ENVIRONMENT=web",
-		"-I vendor/heic_dec",
+		`-I vendor/heic_dec${suffix}`,
 		"-I vendor/libheif/libheif/api",
 		"-fexceptions",
-		"vendor/libde265/libde265/libde265.a",
-		"vendor/heic_dec/libheif/libheif.a",
-	]);
+		`vendor/libde265${suffix}/libde265/libde265.a`,
+		`vendor/heic_dec${suffix}/libheif/libheif.a`,
+	], variant);
+
+	if (!variant.native) {
+		fixPThreadImpl(`${config.outDir}/heic-enc${suffix}.js`, 1);
+	}
+}
+
+function buildHEIC() {
+	// Must delete x265/source/CmakeLists.txt lines 240-248 for 32-bit build.
+	removeRange("vendor/x265/source/CmakeLists.txt",
+		"\n    elseif(X86 AND NOT X64)", "\n    endif()");
+
+	for (const variant of getVariants(true)) {
+		// buildWebPLibrary(variant);
+		buildHEICVariant(variant);
+	}
+}
+
+/*
+ * Glue sources and libraries of a codec in the transcoder, they are built by
+ * functions above, except AVIF that needs aom with both encoder and decoder.
+ * HEIC encoder requires pthreads, and WebP2 has no signature to detect input,
+ * so they are not included.
+ */
+function transcoderSources(name) {
+	switch (name) {
+		case "jpg":
+			return [
+				"cpp/mozjpeg.cpp",
+				"-I vendor/mozjpeg",
+				"vendor/mozjpeg/libjpeg.a",
+				"vendor/mozjpeg/rdswitch.o",
+			];
+		case "qoi":
+			return ["cpp/qoi.cpp", "-I vendor/qoi"];
+		case "webp":
+			return [
+				"cpp/webp_enc.cpp",
+				"cpp/webp_dec.cpp",
+				"-I vendor/libwebp",
+				"vendor/libwebp/libwebp.a",
+				"vendor/libwebp/libsharpyuv.a",
+			];
+		case "jxl":
+			return ["cpp/jxl_enc.cpp", "cpp/jxl_dec.cpp", ...jxlLibraries("vendor/libjxl")];
+		case "avif":
+			return [
+				"cpp/avif_enc.cpp",
+				"cpp/avif_dec.cpp",
+				...buildAVIFLibrary("transcoder", 1, 1, variants.simd),
+			];
+		case "wp2":
+			return ["cpp/wp2_enc.cpp", "-I vendor/libwebp2", "vendor/wp2_build/libwebp2.a"];
+		case "heic":
+			return [
+				"cpp/heic_dec.cpp",
+				"-I vendor/heic_dec",
+				"-I vendor/libheif/libheif/api",
+				"-fexceptions",
+				"vendor/libde265/libde265/libde265.a",
+				"vendor/heic_dec/libheif/libheif.a",
+			];
+	}
+	throw new Error("The transcoder does not support: " + name);
+}
 
-	fixPThreadImpl("dist/heic-enc.js", 1);
+/*
+ * Link codecs in `config.transcoder` into one module, which converts between
+ * formats without copying pixels to JS, only the baseline variant is built.
+ */
+export function buildTranscoder() {
+	const sources = config.transcoder.split(",").flatMap(transcoderSources);
+	emcc("cpp/transcoder.cpp", ["-DICODEC_TRANSCODER", ...new Set(sources)]);
 }
 
 function buildVVIC() {
@@ -432,6 +603,7 @@ if (process.argv[2] === "update") {
 	// buildMozJPEG();
 	// buildWebP2();
 	buildHEIC();
+	// buildTranscoder();
 	// buildPNGQuant();
 	// buildVVIC();
 
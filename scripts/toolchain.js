@@ -1,4 +1,4 @@
-import { basename, extname, join } from "node:path";
+import { basename, dirname, extname, join } from "node:path";
 import { execFileSync } from "node:child_process";
 import { existsSync, readFileSync, writeFileSync } from "node:fs";
 
@@ -19,14 +19,37 @@ export const config = {
 	debug: false,
 
 	/**
-	 * Build in 64-bit WASM, allows to access more than 4GB RAM.
-	 * This is an experimental feature.
+	 * Also build 64-bit WASM variants, allows to access more than 4GB RAM.
+	 * They are slower, loaders only use them for very large images.
 	 * https://github.com/WebAssembly/memory64/blob/main/proposals/memory64/Overview.md
-	 *
-	 * You'll also need to rebuild if you previously built 32-bit version.
 	 */
 	wasm64: true,
 
+	/**
+	 * Also build relaxed SIMD variants of AVIF, JXL, WebP2 and HEIC,
+	 * loaders pick them if the runtime supports.
+	 */
+	relaxedSIMD: true,
+
+	/**
+	 * Also build native Node addons (Node-API) with the host compiler, for servers.
+	 * They use SIMD of the CPU and threads, `icodec/node` prefers them if exist.
+	 * Requires CMake, NASM and a C++23 compiler, PNG is not included.
+	 */
+	native: false,
+
+	/**
+	 * Codecs linked into the transcoder module, comma separated file extensions.
+	 * It must be built after modules of these codecs, it reuses their libraries.
+	 */
+	transcoder: "jpg,webp,jxl,avif,qoi,wp2",
+
+	/**
+	 * Override the allocator of all modules, used to compare performance and size.
+	 * Possible values: "dlmalloc", "emmalloc", "mimalloc".
+	 */
+	malloc: null,
+
 	/**
 	 * Specify -G parameter of cmake, e.g. "Ninja"
 	 */
@@ -47,7 +70,7 @@ export const config = {
 			const [, key, value] = match;
 			switch (typeof this[key]) {
 				case "boolean":
-					this[key] = true;
+					this[key] = value !== "false";
 					break;
 				case "number":
 					this[key] = parseInt(value);
@@ -59,6 +82,55 @@ export const config = {
 	},
 };
 
+/**
+ * A variant is a set of extra compiler flags, and the suffix appended to
+ * names of the output and the build directory.
+ */
+export const variants = {
+	/**
+	 * The baseline, only requires WebAssembly SIMD.
+	 */
+	simd: { suffix: "", flags: "" },
+
+	/**
+	 * Allows relaxed SIMD instructions (FMA, relaxed swizzle...),
+	 * results of them may differ slightly between CPUs.
+	 * https://github.com/WebAssembly/relaxed-simd
+	 */
+	relaxed: { suffix: "-relaxed", flags: "-mrelaxed-simd" },
+
+	/**
+	 * 64-bit memory, it has overhead of bounds checks and 64-bit pointers.
+	 */
+	wasm64: { suffix: "-64", flags: "-sMEMORY64", wasm64: true },
+
+	/**
+	 * Native code for the host, libraries detect CPU features at runtime.
+	 * Code is position-independent to link into the addon, and exceptions
+	 * must pass through C frames, they are thrown from JS callbacks.
+	 */
+	native: { suffix: "-native", flags: "-fPIC -fexceptions", native: true },
+};
+
+/**
+ * Get variants to build, the baseline is always included.
+ *
+ * @param relaxed Include relaxed SIMD variant, for modules that have SIMD-heavy kernels.
+ */
+export function getVariants(relaxed = false) {
+	const list = [variants.simd];
+	if (relaxed && config.relaxedSIMD) {
+		list.push(variants.relaxed);
+	}
+	if (config.wasm64) {
+		list.push(variants.wasm64);
+	}
+	if (config.native) {
+		list.push(variants.native);
+	}
+	return list;
+}
+
 export function fixPThreadImpl(name, concurrency) {
 	const original = readFileSync(name, "utf8");
 	let code = original.replace('navigator["hardwareConcurrency"]', concurrency);
@@ -78,16 +150,13 @@ export function fixPThreadImpl(name, concurrency) {
 }
 
 export function emcmake(settings) {
-	const { outFile, src, dist = src, flags, options = {} } = settings;
+	const { outFile, src, dist = src, flags, variant = variants.simd, options = {} } = settings;
 	if (!config.rebuild && existsSync(outFile)) {
 		return;
 	}
 
-	let cxxFlags = "-pthread -msimd128";
-	if (config.wasm64) {
-		cxxFlags += " -sMEMORY64";
-	}
-	if (!settings.exceptions) {
+	let cxxFlags = variant.native ? "-pthread" : "-pthread -msimd128";
+	if (!settings.exceptions && !variant.native) {
 		cxxFlags += " -fno-exceptions";
 	}
 
@@ -95,6 +164,10 @@ export function emcmake(settings) {
 		cxxFlags += " ";
 		cxxFlags += flags;
 	}
+	if (variant.flags) {
+		cxxFlags += " ";
+		cxxFlags += variant.flags;
+	}
 
 	const args = [
 		"cmake", "-S", src, "-B", dist,
@@ -115,16 +188,25 @@ export function emcmake(settings) {
 	for (const [k, v] of Object.entries(options)) {
 		args.push(`-D${k}=${v}`);
 	}
-	execFileSync("emcmake", args, { stdio: "inherit", shell: true });
+	if (variant.native) {
+		execFileSync(args[0], args.slice(1), { stdio: "inherit", shell: true });
+	} else {
+		execFileSync("emcmake", args, { stdio: "inherit", shell: true });
+	}
 
 	const buildArgs = ["--build", ".", "-j", config.parallel];
 	execFileSync("cmake", buildArgs, { cwd: dist, stdio: "inherit" });
 }
 
-export function emcc(input, sourceArguments) {
-	let output = basename(input, extname(input)).replaceAll("_", "-") + ".js";
+export function emcc(input, sourceArguments, variant = variants.simd) {
+	let output = basename(input, extname(input)).replaceAll("_", "-");
+	output += variant.suffix + (variant.native ? ".node" : ".js");
 	output = join(config.outDir, output);
 
+	if (variant.native) {
+		return nodeAddon(input, sourceArguments, output);
+	}
+
 	const args = [
 		config.debug ? "-g" : "-O3",
 		"-o", output,
@@ -146,14 +228,17 @@ export function emcc(input, sourceArguments) {
 		 */
 		"-s", "STACK_SIZE=2MB",
 
-		// Save ~69KB, but may affect performance.
-		// "-s", "MALLOC=emmalloc",
+		/*
+		 * The default allocator is dlmalloc, modules can change it by arguments,
+		 * e.g. emmalloc is ~69KB smaller, mimalloc scales better with threads.
+		 */
 
-		// Save ~10KB, but it needs some work on our part.
+		// Save ~10KB, but does not support embind and our loader options.
 		// "-s", "MINIMAL_RUNTIME=1",
 	];
-	if (config.wasm64) {
-		args.push("-s", "MEMORY64=1");
+	if (!variant.wasm64) {
+		// Default is 2GB, raise to the limit of 32-bit address.
+		args.push("-s", "MAXIMUM_MEMORY=4GB");
 	}
 	if (config.debug) {
 		args.push("-s", "NO_DISABLE_EXCEPTION_CATCHING");
@@ -164,8 +249,17 @@ export function emcc(input, sourceArguments) {
 		args.push("-s", "ENVIRONMENT=web");
 	}
 
+	if (variant.flags) {
+		args.push(variant.flags);
+	}
+
 	args.push(...sourceArguments);
 
+	// Put after the module's arguments, later settings take precedence.
+	if (config.malloc) {
+		args.push("-s", `MALLOC=${config.malloc}`);
+	}
+
 	/*
 	 * Debug build add an assert for environment check, so we need to
 	 * add Node to the list, or remove the check code from generated JS.
@@ -178,7 +272,51 @@ export function emcc(input, sourceArguments) {
 	console.info(`Successfully build WASM module: ${output}`);
 }
 
-export function wasmPack(directory) {
+/**
+ * Compile the glue code to a Node-API addon with the host compiler, headers
+ * in cpp/native implement the used subset of embind, so the code is unchanged.
+ * Emscripten settings (`-s`) in the arguments are ignored.
+ */
+function nodeAddon(input, sourceArguments, output) {
+	const args = [
+		config.debug ? "-g" : "-O3",
+		"-o", output,
+		"-shared",
+		"-fPIC",
+		"-fexceptions",
+		"-pthread",
+		"-flto",
+		"-std=c++23",
+		"-I", "cpp/native",
+		"-I", "cpp",
+		"-I", join(dirname(process.execPath), "../include/node"),
+		input,
+		"cpp/native/addon.cpp",
+	];
+	if (process.platform === "darwin") {
+		args.push("-undefined", "dynamic_lookup"); // Node-API symbols are from the executable.
+	}
+	for (let i = 0; i < sourceArguments.length; i++) {
+		const arg = sourceArguments[i];
+		if (arg === "-s") {
+			i++;
+		} else if (!arg.startsWith("-s")) {
+			args.push(arg);
+		}
+	}
+	execFileSync(process.env.CXX ?? "c++", args, { stdio: "inherit", shell: true });
+	console.info(`Successfully build native addon: ${output}`);
+}
+
+/**
+ * Build the Rust crate with wasm-pack.
+ *
+ * @param directory The crate directory.
+ * @param outName Name of output files, default is the crate name.
+ * @param threads Build with the "threads" feature, it requires nightly toolchain
+ *                to rebuild the std with atomics, and the memory is shared.
+ */
+export function wasmPack(directory, outName, threads = false) {
 	const flags = [
 		"-Ctarget-feature=+simd128,+atomics,+bulk-memory,+nontrapping-fptoint",
 		"-Cembed-bitcode=yes",
@@ -203,8 +341,17 @@ export function wasmPack(directory) {
 		"--weak-refs",
 		"--target", "web",
 	];
+	if (outName) {
+		args.push("--out-name", outName);
+	}
 	if (config.debug) {
 		args.push("--dev");
 	}
-	execFileSync("wasm-pack", args, { stdio: "inherit", env });
+	if (!threads) {
+		execFileSync("wasm-pack", args, { stdio: "inherit", env });
+	} else {
+		// Arguments after `--` are passed to cargo.
+		args.push("--", "--features", "threads", "-Z", "build-std=panic_abort,std");
+		execFileSync("rustup", ["run", "nightly", "wasm-pack", ...args], { stdio: "inherit", env });
+	}
 }
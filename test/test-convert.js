@@ -1,7 +1,13 @@
 import { describe, test } from "node:test";
 import * as assert from "node:assert";
+import { mkdtempSync, readFileSync } from "node:fs";
+import { tmpdir } from "node:os";
+import { join } from "node:path";
+import { once } from "node:events";
+import { Worker } from "node:worker_threads";
 import sharp from "sharp";
-import { avif, heic, jpeg, jxl, png, qoi, webp, wp2 } from "../lib/node.js";
+import { avif, CancelledError, disableEncodeCache, enableEncodeCache, encodeAuto, encodeMany, heic, jpeg, jxl, LimitError, loadTranscoder, png, qoi, resize, toPixelFormat, transcode, webp, wp2 } from "../lib/node.js";
+import { loadES } from "../lib/common.js";
 import { assertSimilar, generateTestImage, getRawPixels, getSnapshot, makeOpaque, updateSnapshot } from "./fixtures.js";
 
 async function testEncode(image, options) {
@@ -101,6 +107,57 @@ test("decode gray PNG", async () => {
 	assertSimilar(expected, image, 0, 0);
 });
 
+test("pixel format", () => {
+	const data = new Uint8ClampedArray([255, 0, 0, 128]);
+	const image = { data, width: 1, height: 1, depth: 8 };
+
+	assert.deepStrictEqual(Array.from(toPixelFormat(image, "rgb").data), [255, 0, 0]);
+	assert.deepStrictEqual(Array.from(toPixelFormat(image, "grayAlpha").data), [76, 128]);
+
+	const gray = toPixelFormat(image, "gray");
+	assert.deepStrictEqual(Array.from(toPixelFormat(gray, "rgba").data), [76, 76, 76, 255]);
+});
+
+async function testDecodeFormat(format) {
+	const snapshot = getSnapshot("image", this);
+	const { loadDecoder, decode } = this;
+	await loadDecoder();
+
+	const output = decode(snapshot, { format });
+	assert.strictEqual(output.format, format);
+
+	const expected = toPixelFormat(decode(snapshot), format);
+	assertSimilar(toPixelFormat(expected, "rgba"), toPixelFormat(output, "rgba"), 0.1, 0.01);
+}
+
+describe("decode pixel format", () => {
+	test("JPEG", testDecodeFormat.bind(jpeg, "gray"));
+	test("PNG", testDecodeFormat.bind(png, "grayAlpha"));
+	test("WebP", testDecodeFormat.bind(webp, "rgb"));
+	test("JXL", testDecodeFormat.bind(jxl, "rgb"));
+});
+
+test("drop opaque alpha", async () => {
+	await jxl.loadEncoder();
+	await avif.loadEncoder();
+	const image = makeOpaque(getRawPixels("alpha"));
+	const rgb = toPixelFormat(image, "rgb");
+
+	for (const codec of [jxl, avif]) {
+		assert.deepStrictEqual(codec.encode(image), codec.encode(rgb));
+		assert.notDeepStrictEqual(codec.encode(image, { keepAlpha: true }), codec.encode(rgb));
+	}
+});
+
+test("encode gray JXL", async () => {
+	const image = toPixelFormat(getRawPixels("image"), "gray");
+	await jxl.loadEncoder();
+	await jxl.loadDecoder();
+
+	const output = jxl.decode(jxl.encode(image, { lossless: true }), { format: "gray" });
+	assert.deepStrictEqual(output.data, image.data);
+});
+
 async function testDecodeBroken() {
 	const image = getRawPixels("image");
 	const { loadDecoder, decode } = this;
@@ -119,3 +176,338 @@ describe("decode broken", () => {
 	test("JXL", testDecodeBroken.bind(jxl));
 	test("WebP2", testDecodeBroken.bind(wp2));
 });
+
+function crop(image, x, y, width, height) {
+	const data = new Uint8ClampedArray(width * height * 4);
+	for (let i = 0; i < height; i++) {
+		const start = ((y + i) * image.width + x) * 4;
+		data.set(image.data.subarray(start, start + width * 4), i * width * 4);
+	}
+	return { data, width, height };
+}
+
+async function testDecodeRegion() {
+	const snapshot = getSnapshot("image", this);
+	const { loadDecoder, decode } = this;
+	await loadDecoder();
+
+	const full = decode(snapshot);
+	const region = { x: 37, y: 21, width: 50, height: 40 };
+	const output = decode(snapshot, { region });
+
+	const { x, y, width, height } = region;
+	assertSimilar(crop(full, x, y, width, height), output, 0.1, 0.01);
+
+	region.x = full.width;
+	assert.throws(() => decode(snapshot, { region }));
+}
+
+describe("decode region", () => {
+	test("JPEG", testDecodeRegion.bind(jpeg));
+	test("JXL", testDecodeRegion.bind(jxl));
+});
+
+async function testEncodeTiled() {
+	const image = getRawPixels("image");
+	const { width, height } = image;
+	const source = {
+		width,
+		height,
+		read: (x, y, w, h) => crop(image, x, y, w, h).data,
+	};
+	const { loadEncoder, loadDecoder, encodeTiled, decode } = this;
+	await loadEncoder();
+	await loadDecoder();
+
+	const output = decode(encodeTiled(source));
+	assertSimilar(image, output, 0.2, 0.05);
+
+	const opaque = {
+		width,
+		height,
+		read(x, y, w, h) {
+			const data = crop(image, x, y, w, h).data;
+			for (let i = 3; i < data.length; i += 4) data[i] = 255;
+			return data;
+		},
+	};
+	const kept = encodeTiled(opaque, { keepAlpha: true });
+	assert.ok(encodeTiled(opaque).length < kept.length);
+
+	source.read = () => new Uint8Array(4);
+	assert.throws(() => encodeTiled(source));
+}
+
+describe("encode tiled", () => {
+	test("AVIF", testEncodeTiled.bind(avif));
+	test("JXL", testEncodeTiled.bind(jxl));
+});
+
+async function testDecodeFile() {
+	const snapshot = getSnapshot("image", this);
+	const path = `${import.meta.dirname}/snapshot/image.${this.extension}`;
+	const { loadDecoder, decode, decodeFile, decodeStream } = this;
+	await loadDecoder();
+
+	const expected = decode(snapshot);
+	assert.deepStrictEqual(decodeFile(path).data, expected.data);
+
+	if (!decodeStream) {
+		return;
+	}
+	// Read in small chunks to cover partial data in buffers.
+	const source = {
+		size: snapshot.length,
+		read(buffer, position) {
+			const end = position + Math.min(buffer.length, 100);
+			const chunk = snapshot.subarray(position, end);
+			buffer.set(chunk);
+			return chunk.length;
+		},
+	};
+	assert.deepStrictEqual(decodeStream(source).data, expected.data);
+}
+
+describe("decode file", () => {
+	test("JPEG", testDecodeFile.bind(jpeg));
+	test("PNG", testDecodeFile.bind(png));
+	test("AVIF", testDecodeFile.bind(avif));
+	test("JXL", testDecodeFile.bind(jxl));
+});
+
+async function testEncodeToFile() {
+	const image = getRawPixels("image");
+	const path = join(mkdtempSync(join(tmpdir(), "icodec-")), `image.${this.extension}`);
+	const { loadEncoder, encode, encodeToFile } = this;
+	await loadEncoder();
+
+	encodeToFile(path, image);
+	assert.deepStrictEqual(readFileSync(path), Buffer.from(encode(image)));
+}
+
+describe("encode to file", () => {
+	test("QOI", testEncodeToFile.bind(qoi));
+	test("JXL", testEncodeToFile.bind(jxl));
+	test("JPEG", testEncodeToFile.bind(jpeg));
+	test("WebP", testEncodeToFile.bind(webp));
+});
+
+test("resize", () => {
+	const data = new Uint8ClampedArray([255, 0, 0, 255, 0, 0, 255, 0]);
+	const output = resize({ data, width: 2, height: 1, depth: 8 }, 1, 1);
+
+	// Transparent pixels do not affect the color.
+	assert.deepStrictEqual(Array.from(output.data), [255, 0, 0, 128]);
+});
+
+test("encode many", async () => {
+	const image = getRawPixels("image");
+	await avif.loadEncoder();
+	await webp.loadEncoder();
+	await qoi.loadEncoder();
+
+	const outputs = encodeMany(image, [
+		{ codec: webp, options: { quality: 50 } },
+		{ codec: avif, width: 200 },
+		{ codec: webp, options: { lossless: true } },
+		{ codec: qoi, width: 200 },
+		{ codec: avif, width: 200, options: { quality: 80 } },
+	]);
+
+	const small = resize(image, 200, 55);
+	assert.deepStrictEqual(outputs, [
+		webp.encode(image, { quality: 50 }),
+		avif.encode(small),
+		webp.encode(image, { lossless: true }),
+		qoi.encode(small),
+		avif.encode(small, { quality: 80 }),
+	]);
+});
+
+test("encode auto", async () => {
+	await png.loadEncoder();
+	await webp.loadEncoder();
+	await avif.loadEncoder();
+	const codecs = { png, webp, avif };
+
+	const data = new Uint8ClampedArray(64 * 64 * 4).fill(255);
+	const flat = encodeAuto({ data, width: 64, height: 64, depth: 8 }, { codecs });
+	assert.strictEqual(flat.codec, "png");
+	assert.strictEqual(flat.stats.colors, 1);
+	assert.strictEqual(flat.stats.alpha, "opaque");
+
+	const image = getRawPixels("image");
+	const lossy = encodeAuto(image, { codecs, lossless: false, quality: 60 });
+	assert.strictEqual(lossy.codec, "avif");
+	assert.deepStrictEqual(lossy.data, avif.encode(image, { quality: 60 }));
+
+	// Progress of trials is mapped to a range, it never goes back.
+	const progress = [];
+	encodeAuto(image, { codecs, maxBytes: 1 }, { onProgress: p => void progress.push(p) });
+	assert.deepStrictEqual(progress, progress.toSorted((a, b) => a - b));
+	assert.throws(() => encodeAuto(image, { codecs }, { maxPixels: 100 }), LimitError);
+});
+
+test("transcode", async () => {
+	const input = getSnapshot("image", jpeg);
+	await loadTranscoder();
+	await jpeg.loadDecoder();
+	await webp.loadEncoder();
+
+	const image = jpeg.decode(input);
+	const output = transcode(input, webp, { quality: 50 });
+	assert.deepStrictEqual(output, webp.encode(image, { quality: 50 }));
+	assert.throws(() => transcode(new Uint8Array(16), webp), /Unsupported input format/);
+});
+
+test("encode cache", async () => {
+	const directory = mkdtempSync(join(tmpdir(), "icodec-cache-"));
+	const image = getRawPixels("image");
+	await qoi.loadEncoder();
+	try {
+		enableEncodeCache({ directory });
+		const output = qoi.encode(image);
+		assert.strictEqual(qoi.encode(image), output);
+
+		// A new cache has empty memory, the entry is read from the directory.
+		enableEncodeCache({ directory });
+		assert.deepStrictEqual(qoi.encode(image), output);
+
+		// Limits are checked on hits.
+		assert.throws(() => qoi.encode(image, undefined, { maxPixels: 100 }), LimitError);
+	} finally {
+		disableEncodeCache();
+	}
+});
+
+test("PNG shared palette", async () => {
+	const image = getRawPixels("image");
+	const images = [image, resize(image, 200, 55)];
+	await png.loadEncoder();
+
+	const colors = new Set();
+	for (const data of png.reduceColorsMany(images, { colors: 16 })) {
+		const view = new Uint32Array(data.buffer, data.byteOffset, data.length / 4);
+		view.forEach(c => colors.add(c));
+	}
+	assert.ok(colors.size <= 16);
+
+	const palette = png.createPalette(images);
+	try {
+		assert.throws(() => png.encode(image, { palette, quantize: false }), TypeError);
+	} finally {
+		palette.free();
+	}
+});
+
+async function testEncodeCancel(image) {
+	const { loadEncoder, encode } = this;
+	await loadEncoder();
+
+	const onProgress = () => false;
+	assert.throws(() => encode(image, undefined, { onProgress }), CancelledError);
+}
+
+describe("encode cancel", () => {
+	const image = generateTestImage(8);
+
+	test("JPEG", testEncodeCancel.bind(jpeg, image));
+	test("QOI", testEncodeCancel.bind(qoi, image));
+	test("WebP", testEncodeCancel.bind(webp, image));
+	test("AVIF", testEncodeCancel.bind(avif, image));
+	test("JXL", testEncodeCancel.bind(jxl, image));
+	test("WebP2", testEncodeCancel.bind(wp2, image));
+});
+
+async function testDecodeCancel() {
+	const snapshot = getSnapshot("square16_8bit", this);
+	const { loadDecoder, decode } = this;
+	await loadDecoder();
+
+	const onProgress = () => false;
+	assert.throws(() => decode(snapshot, { onProgress }), CancelledError);
+}
+
+describe("decode cancel", () => {
+	test("JPEG", testDecodeCancel.bind(jpeg));
+	test("QOI", testDecodeCancel.bind(qoi));
+	test("WebP", testDecodeCancel.bind(webp));
+	test("AVIF", testDecodeCancel.bind(avif));
+	test("JXL", testDecodeCancel.bind(jxl));
+	test("WebP2", testDecodeCancel.bind(wp2));
+});
+
+async function testDecodeLimits() {
+	const snapshot = getSnapshot("square16_8bit", this);
+	const { loadDecoder, decode } = this;
+	await loadDecoder();
+
+	assert.throws(() => decode(snapshot, { maxPixels: 100 }), { name: "LimitError", limit: "maxPixels" });
+	assert.throws(() => decode(snapshot, { maxMemory: 1000 }), LimitError);
+	assert.ok(decode(snapshot, { maxPixels: 256 }));
+
+	// Limits do not hide the format error of other data.
+	const garbage = new Uint8Array(64).fill(0xFF);
+	assert.throws(() => decode(garbage, { maxPixels: 1 }), e => !(e instanceof LimitError));
+}
+
+describe("decode limits", () => {
+	test("JPEG", testDecodeLimits.bind(jpeg));
+	test("PNG", testDecodeLimits.bind(png));
+	test("WebP", testDecodeLimits.bind(webp));
+	test("JXL", testDecodeLimits.bind(jxl));
+});
+
+test("encode limits", async () => {
+	const image = generateTestImage(8);
+	await qoi.loadEncoder();
+
+	assert.throws(() => qoi.encode(image, undefined, { maxPixels: 100 }), LimitError);
+	assert.deepStrictEqual(qoi.encode(image, undefined, { maxPixels: 0, maxMemory: 0 }), qoi.encode(image));
+	assert.throws(() => encodeMany(image, [{ codec: qoi }], { maxPixels: 100 }), LimitError);
+});
+
+test("cancel with aborted signal", async () => {
+	const image = generateTestImage(8);
+	await png.loadEncoder();
+
+	const signal = AbortSignal.abort();
+	assert.throws(() => png.encode(image, undefined, { signal }), CancelledError);
+});
+
+test("report progress", async () => {
+	const image = generateTestImage(8);
+	const values = [];
+	await webp.loadEncoder();
+
+	webp.encode(image, undefined, { onProgress: p => values.push(p) });
+	assert.deepStrictEqual(values, values.toSorted((a, b) => a - b));
+	assert.strictEqual(values.at(-1), 1);
+});
+
+test("load from URL", async () => {
+	const { locateFile } = await loadES(options => options, "https://example.com/qoi.wasm");
+	assert.strictEqual(locateFile(), "https://example.com/qoi.wasm");
+});
+
+test("load compiled module in worker", async () => {
+	const image = generateTestImage(8);
+	const module = await qoi.compileEncoder();
+	const lib = import.meta.resolve("../lib/node.js");
+
+	const worker = new Worker(`
+		const { parentPort, workerData } = require("node:worker_threads");
+		import(workerData.lib).then(async ({ qoi }) => {
+			await qoi.loadEncoder(workerData.module);
+			parentPort.postMessage(qoi.encode(workerData.image));
+		});
+	`, { eval: true, workerData: { lib, module, image } });
+
+	try {
+		const [encoded] = await once(worker, "message");
+		await qoi.loadEncoder();
+		assert.deepStrictEqual(encoded, qoi.encode(image));
+	} finally {
+		await worker.terminate();
+	}
+});